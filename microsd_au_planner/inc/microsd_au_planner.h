@@ -0,0 +1,104 @@
+#pragma once
+
+#include "project_config.h"
+
+#ifdef MODULE_MICROSD_AU_PLANNER_ENABLED
+
+#include "user_os.h"
+#include "microsd_base.h"
+
+/*!
+ * Последовательная запись целыми AU (allocation unit) поверх любой реализации MicrosdBase.
+ * Класс скорости карты (SPEED_CLASS, UHS, Video) гарантируется только для записи
+ * подряд в свободный AU, произвольная запись у тех же карт во много раз медленнее.
+ * Планировщик:
+ * - по SD Status (getSdStatus) определяет размер AU и сужает область
+ *   последовательной записи (например, кольцо лога) до целых AU;
+ * - подбирает размер одной записи (writeSectors), кратно укладывающийся в AU;
+ * - делит записи в область по границам AU, чтобы одна многоблочная запись
+ *   не захватывала два AU;
+ * - при eraseAhead стирает AU перед записью в его начало (карта получает свободный AU,
+ *   старое содержимое AU при этом теряется - только для записи по кругу).
+ * Записи вне области и все остальные вызовы передаются карте без изменений.
+ */
+
+/// AU, если карта его не сообщает: 4 МиБ (наибольший AU_SIZE для SDHC).
+#define MICROSD_AU_PLANNER_DEFAULT_AU_SECTORS			( 8192 )
+
+struct MicrosdAuPlannerCfg {
+	MicrosdBase*		card;
+
+	uint32_t			regionStart;			// Область последовательной записи, сектора.
+	uint32_t			regionCount;
+
+	uint32_t			defaultAuSectors;		// 0 - MICROSD_AU_PLANNER_DEFAULT_AU_SECTORS.
+	uint32_t			maxWriteSectors;		// Наибольшая запись, доступная приложению (размер буфера).
+
+	bool				eraseAhead;
+};
+
+/// Результат планирования (после initialize).
+struct MicrosdAuPlan {
+	uint32_t			auSectors;
+	bool				auFromCard;				// false - карта не сообщила AU, взят defaultAuSectors.
+
+	uint32_t			regionStart;			// Область, суженная до целых AU (regionCount == 0 - не вместила ни одного).
+	uint32_t			regionCount;
+
+	uint32_t			writeSectors;			// Рекомендуемый размер записи: делитель AU, не больше maxWriteSectors.
+
+	bool				sdStatusValid;
+	MicrosdSdStatus		sdStatus;				// Классы скорости, время стирания и т.д.
+};
+
+struct MicrosdAuPlannerStat {
+	uint32_t		writes;					// Запросов записи в область.
+	uint32_t		sectors;				// Секторов в них.
+	uint32_t		splits;					// Дополнительных записей из-за границ AU.
+	uint32_t		auStarted;				// Записей с начала AU.
+	uint32_t		auErased;				// Стертых перед записью AU.
+	uint32_t		unsequential;			// Записей в область не с места окончания предыдущей.
+	uint32_t		outside;				// Записей вне области.
+};
+
+class MicrosdAuPlanner : public MicrosdBase {
+public:
+	MicrosdAuPlanner ( const MicrosdAuPlannerCfg* const cfg );
+
+	/// Инициализирует карту и строит план по ее SD Status.
+	EC_MICRO_SD_TYPE	initialize			( void );
+	EC_MICRO_SD_TYPE	getType				( void );
+	EC_SD_RESULT		readSector			( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms );
+	EC_SD_RESULT		writeSector			( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms );
+	EC_SD_STATUS		getStatus			( void );
+	EC_SD_RESULT		getSectorCount		( uint32_t& sectorCount );
+	EC_SD_RESULT		getBlockSize		( uint32_t& blockSize );
+	EC_SD_RESULT		getSdStatus			( MicrosdSdStatus& status );
+	EC_SD_RESULT		discardSectors		( uint32_t sector, uint32_t count );
+
+	void				getPlan				( MicrosdAuPlan& plan );
+
+	/// Сколько секторов писать с sector (внутри области), чтобы закончить
+	/// на границе writeSectors (а значит и AU) или в конце области. 0 - sector вне области.
+	uint32_t			getWriteCount		( uint32_t sector );
+
+	void				getStat				( MicrosdAuPlannerStat& stat );
+	void				resetStat			( void );
+
+private:
+	// Построить план по SD Status (под mutex-ом).
+	void				makePlan			( void );
+
+	const MicrosdAuPlannerCfg*		const cfg;
+
+	USER_OS_STATIC_MUTEX_BUFFER		mb;
+	USER_OS_STATIC_MUTEX			m				= nullptr;
+
+	MicrosdAuPlan					plan			= {};
+
+	uint32_t						next			= 0;		// Сектор за последней записью в область.
+
+	MicrosdAuPlannerStat			stat;
+};
+
+#endif
@@ -0,0 +1,197 @@
+#include "microsd_au_planner.h"
+
+#ifdef MODULE_MICROSD_AU_PLANNER_ENABLED
+
+#include <string.h>
+
+MicrosdAuPlanner::MicrosdAuPlanner ( const MicrosdAuPlannerCfg* const cfg ) : cfg( cfg ) {
+    this->m = USER_OS_STATIC_MUTEX_CREATE( &this->mb );
+    this->resetStat();
+}
+
+//**********************************************************************
+// План (вызывается под mutex-ом).
+//**********************************************************************
+void MicrosdAuPlanner::makePlan ( void ) {
+    MicrosdAuPlan& p = this->plan;
+    p = {};
+
+    p.sdStatusValid	= ( this->cfg->card->getSdStatus( p.sdStatus ) == EC_SD_RESULT::OK );
+    p.auSectors		= p.sdStatusValid ? p.sdStatus.auSectors : 0;
+    p.auFromCard	= ( p.auSectors != 0 );
+
+    if ( !p.auFromCard ) {
+        p.auSectors = ( this->cfg->defaultAuSectors != 0 ) ? this->cfg->defaultAuSectors : MICROSD_AU_PLANNER_DEFAULT_AU_SECTORS;
+    }
+
+    /// Область - только целые AU (как стирание групп у SDSC).
+    p.regionStart	= this->cfg->regionStart;
+    p.regionCount	= this->cfg->regionCount;
+    if ( !microsdAlignEraseRange( p.regionStart, p.regionCount, false, p.auSectors ) ) {
+        p.regionCount = 0;
+    }
+
+    /// Наибольший делитель AU, помещающийся в буфер приложения:
+    /// записи такого размера с начала области ложатся в AU без остатка.
+    uint32_t w = ( this->cfg->maxWriteSectors < p.auSectors ) ? this->cfg->maxWriteSectors : p.auSectors;
+    while ( ( w > 1 ) && ( ( p.auSectors % w ) != 0 ) ) {
+        w--;
+    }
+    p.writeSectors = ( w != 0 ) ? w : 1;
+
+    this->next = p.regionStart;
+}
+
+//**********************************************************************
+// Основной функционал.
+//**********************************************************************
+EC_MICRO_SD_TYPE MicrosdAuPlanner::initialize ( void ) {
+    EC_MICRO_SD_TYPE t = this->cfg->card->initialize();
+
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    if ( t != EC_MICRO_SD_TYPE::ERROR ) {
+        this->makePlan();
+    } else {
+        this->plan = {};
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return t;
+}
+
+// Запись в область делится по границам AU. Перед записью с начала AU
+// (при eraseAhead) AU стирается целиком.
+EC_SD_RESULT MicrosdAuPlanner::writeSector ( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms ) {
+    EC_SD_RESULT r = EC_SD_RESULT::OK;
+
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    const uint32_t au			= this->plan.auSectors;
+    const uint32_t regionEnd	= this->plan.regionStart + this->plan.regionCount;
+
+    if ( ( this->plan.regionCount == 0 ) || ( sector + cout_sector <= this->plan.regionStart ) || ( sector >= regionEnd ) ) {
+        this->stat.outside++;
+        r = this->cfg->card->writeSector( source_array, sector, cout_sector, timeout_ms );
+    } else {
+        this->stat.writes++;
+        this->stat.sectors += cout_sector;
+        if ( sector != this->next ) {
+            this->stat.unsequential++;
+        }
+
+        const uint8_t*	p		= source_array;
+        uint32_t		left	= cout_sector;
+        bool			first	= true;
+
+        while ( left != 0 ) {
+            uint32_t n = left;
+
+            if ( sector < this->plan.regionStart ) {
+                /// Часть перед областью.
+                n = this->plan.regionStart - sector;
+            } else if ( sector < regionEnd ) {
+                uint32_t offset = ( sector - this->plan.regionStart ) % au;
+
+                if ( offset == 0 ) {
+                    this->stat.auStarted++;
+                    if ( this->cfg->eraseAhead ) {
+                        r = this->cfg->card->discardSectors( sector, au );
+                        if ( r != EC_SD_RESULT::OK ) break;
+                        this->stat.auErased++;
+                    }
+                }
+
+                if ( n > au - offset ) {
+                    n = au - offset;
+                }
+            }
+
+            if ( !first ) {
+                this->stat.splits++;
+            }
+            first = false;
+
+            r = this->cfg->card->writeSector( p, sector, n, timeout_ms );
+            if ( r != EC_SD_RESULT::OK ) break;
+
+            p		+= n * 512;
+            sector	+= n;
+            left	-= n;
+        }
+
+        /// Кольцо: после конца области запись продолжается с ее начала.
+        this->next = ( sector >= regionEnd ) ? this->plan.regionStart : sector;
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+uint32_t MicrosdAuPlanner::getWriteCount ( uint32_t sector ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    uint32_t n = 0;
+    const uint32_t regionEnd = this->plan.regionStart + this->plan.regionCount;
+
+    if ( ( sector >= this->plan.regionStart ) && ( sector < regionEnd ) ) {
+        n = this->plan.writeSectors - ( sector - this->plan.regionStart ) % this->plan.writeSectors;
+        if ( n > regionEnd - sector ) {
+            n = regionEnd - sector;
+        }
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return n;
+}
+
+void MicrosdAuPlanner::getPlan ( MicrosdAuPlan& plan ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    plan = this->plan;
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+EC_SD_RESULT MicrosdAuPlanner::readSector ( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms ) {
+    return this->cfg->card->readSector( sector, target_array, cout_sector, timeout_ms );
+}
+
+EC_SD_RESULT MicrosdAuPlanner::discardSectors ( uint32_t sector, uint32_t count ) {
+    return this->cfg->card->discardSectors( sector, count );
+}
+
+EC_MICRO_SD_TYPE MicrosdAuPlanner::getType ( void ) {
+    return this->cfg->card->getType();
+}
+
+EC_SD_STATUS MicrosdAuPlanner::getStatus ( void ) {
+    return this->cfg->card->getStatus();
+}
+
+EC_SD_RESULT MicrosdAuPlanner::getSectorCount ( uint32_t& sectorCount ) {
+    return this->cfg->card->getSectorCount( sectorCount );
+}
+
+EC_SD_RESULT MicrosdAuPlanner::getBlockSize ( uint32_t& blockSize ) {
+    return this->cfg->card->getBlockSize( blockSize );
+}
+
+EC_SD_RESULT MicrosdAuPlanner::getSdStatus ( MicrosdSdStatus& status ) {
+    return this->cfg->card->getSdStatus( status );
+}
+
+void MicrosdAuPlanner::getStat ( MicrosdAuPlannerStat& stat ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    stat = this->stat;
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+void MicrosdAuPlanner::resetStat ( void ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    memset( &this->stat, 0, sizeof( this->stat ) );
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+#endif
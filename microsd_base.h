@@ -35,6 +35,215 @@ enum class EC_SD_RES {
 	TIMEOUT						= 1,
 	IO_ERROR					= 2,					// Если низкоуровневый интерфейс (SDIO/SPI) не отработал.
 	R1_ILLEGAL_COMMAND			= 3,					// Команда не поддерживается.
+	CRC_ERROR					= 4,					// Не сошлась CRC блока данных.
+};
+
+//**********************************************************************
+// Общие для драйверов расчеты по регистрам карты.
+//**********************************************************************
+/// Размер AU (allocation unit) в секторах по полю AU_SIZE регистра SD Status (0 - не задан).
+inline uint32_t microsdGetAuSectors ( uint8_t auSize ) {
+	static const uint8_t bigAu[] = { 8, 12, 16, 24, 32, 64 };					// МиБ, AU_SIZE 0xA..0xF.
+	if ( ( auSize == 0 ) || ( auSize > 0xF ) )	return 0;
+	if ( auSize <= 9 )							return 32UL << ( auSize - 1 );		// 16 КиБ..4 МиБ.
+	return ( uint32_t )bigAu[ auSize - 0xA ] * 2048;
+}
+
+/*!
+ * Поля регистра SD Status (ACMD13, 64 байта), нужные для планирования записи и стирания.
+ * Классы скорости - в МБ/с (SPEED_CLASS 4 - 4 МБ/с и т.д.), 0 - не заявлен.
+ */
+struct MicrosdSdStatus {
+	uint8_t				busWidth;				// DAT_BUS_WIDTH: 1 или 4 бита.
+	uint8_t				speedClass;				// SPEED_CLASS: 0, 2, 4, 6, 10.
+	uint8_t				performanceMove;		// PERFORMANCE_MOVE, МБ/с (0 - не заявлена).
+	uint8_t				auSize;					// AU_SIZE (код, см. microsdGetAuSectors).
+	uint16_t			eraseSize;				// ERASE_SIZE: сколько AU стирать за одну операцию (0 - не задано).
+	uint8_t				eraseTimeout;			// ERASE_TIMEOUT, с (на eraseSize AU).
+	uint8_t				eraseOffset;			// ERASE_OFFSET, с.
+	uint8_t				uhsSpeedGrade;			// UHS_SPEED_GRADE: 0, 10 (U1), 30 (U3).
+	uint8_t				uhsAuSize;				// UHS_AU_SIZE (код, как AU_SIZE).
+	uint8_t				videoSpeedClass;		// VIDEO_SPEED_CLASS: 0, 6, 10, 30, 60, 90.
+	uint16_t			vscAuSize;				// VSC_AU_SIZE, МиБ.
+
+	/// AU, к которому относятся заявленные скорости, в секторах (0 - карта не сообщает):
+	/// UHS_AU_SIZE у карт с UHS_SPEED_GRADE, иначе AU_SIZE.
+	uint32_t			auSectors;
+};
+
+/// Разбор 64 байт SD Status (бит 511 - старший бит reg[ 0 ]).
+inline void microsdParseSdStatus ( const uint8_t* reg, MicrosdSdStatus& st ) {
+	static const uint8_t speedClass[] = { 0, 2, 4, 6, 10 };						// SPEED_CLASS 0..4.
+
+	st.busWidth			= ( ( reg[ 0 ] >> 6 ) == 2 ) ? 4 : 1;
+	st.speedClass		= ( reg[ 8 ] < sizeof( speedClass ) ) ? speedClass[ reg[ 8 ] ] : 0;
+	st.performanceMove	= reg[ 9 ];
+	st.auSize			= reg[ 10 ] >> 4;
+	st.eraseSize		= ( uint16_t )( ( reg[ 11 ] << 8 ) | reg[ 12 ] );
+	st.eraseTimeout		= reg[ 13 ] >> 2;
+	st.eraseOffset		= reg[ 13 ] & 0b11;
+	st.uhsSpeedGrade	= ( uint8_t )( ( reg[ 14 ] >> 4 ) * 10 );
+	st.uhsAuSize		= reg[ 14 ] & 0xF;
+	st.videoSpeedClass	= reg[ 15 ];
+	st.vscAuSize		= ( uint16_t )( ( ( reg[ 16 ] & 0b11 ) << 8 ) | reg[ 17 ] );
+
+	st.auSectors		= microsdGetAuSectors( st.auSize );
+	if ( ( st.uhsSpeedGrade != 0 ) && ( microsdGetAuSectors( st.uhsAuSize ) != 0 ) ) {
+		st.auSectors	= microsdGetAuSectors( st.uhsAuSize );
+	}
+}
+
+/*!
+ * Допустимое время стирания count секторов начиная с sector, мс.
+ * eraseSize, eraseTimeout, eraseOffset, auSize - поля SD Status.
+ * Если карта их не сообщает (eraseSize == 0) - по 250 мс на блок (SD Physical Layer, 4.14).
+ */
+inline uint32_t microsdGetEraseTimeoutMs ( uint32_t sector, uint32_t count, uint16_t eraseSize,
+										   uint8_t eraseTimeout, uint8_t eraseOffset, uint8_t auSize ) {
+	uint64_t ms;
+	uint32_t au = microsdGetAuSectors( auSize );
+
+	if ( ( eraseSize != 0 ) && ( eraseTimeout != 0 ) && ( au != 0 ) ) {
+		uint64_t auCount = ( ( uint64_t )sector + count - 1 ) / au - sector / au + 1;
+		ms = ( auCount * eraseTimeout * 1000 ) / eraseSize + ( uint64_t )eraseOffset * 1000;
+		if ( ms < 250 ) ms = 250;
+	} else {
+		ms = ( uint64_t )count * 250;
+	}
+
+	return ( ms > 0xFFFFFFFE ) ? 0xFFFFFFFE : ( uint32_t )ms;
+}
+
+/*!
+ * SDSC с ERASE_BLK_EN == 0 стирает только целыми группами по eraseSectors секторов
+ * (SECTOR_SIZE + 1 из CSD), частично задетая группа стерлась бы целиком.
+ * Сужает диапазон до целых групп, false - стирать нечего.
+ */
+inline bool microsdAlignEraseRange ( uint32_t& sector, uint32_t& count, bool eraseBlkEn, uint32_t eraseSectors ) {
+	if ( count == 0 )								return false;
+	if ( eraseBlkEn || ( eraseSectors <= 1 ) )		return true;
+
+	uint64_t first	= ( ( uint64_t )sector + eraseSectors - 1 ) / eraseSectors * eraseSectors;
+	uint64_t end	= ( ( uint64_t )sector + count ) / eraseSectors * eraseSectors;
+	if ( end <= first )								return false;
+
+	sector	= ( uint32_t )first;
+	count	= ( uint32_t )( end - first );
+	return true;
+}
+
+//**********************************************************************
+// CMD6 (SWITCH_FUNC): переключение режима доступа (группа функций 1).
+//**********************************************************************
+#define MICROSD_SWITCH_ACCESS_DEFAULT			( 0 )		// Default Speed, до 25 МГц.
+#define MICROSD_SWITCH_ACCESS_HIGH_SPEED		( 1 )		// High Speed, до 50 МГц.
+
+/// Аргумент CMD6: set == false - только проверка, остальные группы функций не меняются (0xF).
+inline uint32_t microsdGetSwitchArg ( bool set, uint8_t accessMode ) {
+	return ( set ? 0x80000000UL : 0 ) | 0x00FFFFF0UL | ( accessMode & 0xF );
+}
+
+/// Поддерживает ли карта функцию группы 1 (по 64 байтам статуса CMD6, биты 415:400).
+inline bool microsdSwitchSupported ( const uint8_t* status, uint8_t accessMode ) {
+	uint16_t support = ( uint16_t )( ( status[ 12 ] << 8 ) | status[ 13 ] );
+	return ( support & ( 1 << ( accessMode & 0xF ) ) ) != 0;
+}
+
+/// Функция группы 1, выбранная (или которая была бы выбрана) CMD6. 0xF - переключение невозможно.
+inline uint8_t microsdSwitchSelected ( const uint8_t* status ) {
+	return status[ 16 ] & 0xF;
+}
+
+/*!
+ * Результат перевода карты в High Speed и подбора частоты при initialize.
+ * Смысл setting зависит от драйвера (MicrosdSpi - шаг setSpiClock, MicrosdSdio - ClockDiv).
+ */
+struct MicrosdClockTune {
+	bool				highSpeed;				// Карта переключена CMD6 в High Speed.
+	bool				tuned;					// Подбор выполнен, работа идет на setting.
+	uint32_t			setting;
+	uint32_t			checked;				// Сколько настроек проверено (включая не прошедшую).
+};
+
+/*!
+ * Время этапов последнего initialize (мс, по USER_OS_GET_TICK_COUNT/HAL_GetTick).
+ * Этапы, которых не было (повторная инициализация, подбор выключен), равны 0.
+ */
+struct MicrosdInitTiming {
+	bool				warm;					// Та же карта (по CID) осталась инициализированной, сброса не было.
+	uint32_t			attempts;				// Запросов готовности: ACMD41 (MicrosdSpi), HAL_SD_InitCard (MicrosdSdio).
+	uint32_t			resetMs;				// Сброс (CMD0) или проверка карты при повторной инициализации.
+	uint32_t			readyMs;				// CMD8 и ожидание готовности карты.
+	uint32_t			configMs;				// OCR, CRC, CID, ширина шины, High Speed.
+	uint32_t			tuneMs;					// Подбор частоты.
+	uint32_t			totalMs;
+};
+
+enum class EC_SD_REQUEST_TYPE {
+	READ					= 0,
+	WRITE					= 1
+};
+
+/*!
+ * Фрагмент буфера для readSectors/writeSectors: count секторов по адресу buf.
+ * Фрагменты идут подряд по секторам карты, но не обязаны идти подряд в памяти.
+ */
+struct MicrosdSegment {
+	uint8_t*				buf;					// Для записи - только читается.
+	uint32_t				count;
+};
+
+/// Обход списка фрагментов по блокам 512 байт.
+struct MicrosdSegmentCursor {
+	const MicrosdSegment*	seg;
+	uint32_t				segCount;
+	uint32_t				i;
+	uint32_t				block;
+
+	MicrosdSegmentCursor ( const MicrosdSegment* seg, uint32_t segCount ) :
+		seg( seg ), segCount( segCount ), i( 0 ), block( 0 ) {}
+
+	/// Следующий блок или nullptr, если фрагменты закончились.
+	uint8_t*	next	( void ) {
+		while ( ( this->i < this->segCount ) && ( this->block >= this->seg[ this->i ].count ) ) {
+			this->i++;
+			this->block = 0;
+		}
+		if ( this->i == this->segCount ) return nullptr;
+		return &this->seg[ this->i ].buf[ 512 * this->block++ ];
+	}
+};
+
+/// Всего секторов во фрагментах.
+inline uint32_t microsdGetSegmentsSectors ( const MicrosdSegment* seg, uint32_t segCount ) {
+	uint32_t n = 0;
+	for ( uint32_t i = 0; i < segCount; i++ ) {
+		n += seg[ i ].count;
+	}
+	return n;
+}
+
+/*!
+ * Запрос асинхронного чтения/записи (см. MicrosdBase::submit).
+ * Память под запрос и буфер принадлежат вызывающему и должны жить до вызова callback.
+ */
+struct MicrosdRequest {
+	EC_SD_REQUEST_TYPE		type;
+	uint32_t				sector;
+	uint8_t*				buf;					// Для записи - только читается.
+	uint32_t				count;
+	uint32_t				timeoutMs;
+
+	/// Вызывается по завершении. В зависимости от драйвера - из прерывания
+	/// (MicrosdSdio, использовать только ...FromISR функции ОС) или из задачи драйвера.
+	/// Для доставки в очередь ОС достаточно положить в нее req из callback.
+	void					( *callback )	( MicrosdRequest* req );
+	void*					ctx;
+
+	volatile EC_SD_RESULT	result;
+
+	MicrosdRequest*			next;					// Для внутренней очереди драйвера.
+	uint32_t				tick;					// Для внутренней очереди: время постановки (мс).
 };
 
 class MicrosdBase {
@@ -76,4 +285,79 @@ public:
 
 	/// Размер блока.
 	virtual	EC_SD_RESULT		getBlockSize		( uint32_t& blockSize )			= 0;
+
+	/*!
+	 * Чтение/запись подряд идущих секторов, начиная с sector, в/из нескольких буферов
+	 * (без промежуточного копирования в один непрерывный буфер).
+	 * Реализация по умолчанию выполняет по одному readSector/writeSector на фрагмент,
+	 * драйверы переопределяют их одной многоблочной передачей.
+	 */
+	virtual EC_SD_RESULT		readSectors			( uint32_t sector,
+													  const MicrosdSegment* seg,
+													  uint32_t segCount,
+													  uint32_t timeout_ms	) {
+		for ( uint32_t i = 0; i < segCount; i++ ) {
+			if ( seg[ i ].count == 0 ) continue;
+			EC_SD_RESULT r = this->readSector( sector, seg[ i ].buf, seg[ i ].count, timeout_ms );
+			if ( r != EC_SD_RESULT::OK ) return r;
+			sector += seg[ i ].count;
+		}
+		return EC_SD_RESULT::OK;
+	}
+
+	virtual EC_SD_RESULT		writeSectors		( uint32_t sector,
+													  const MicrosdSegment* seg,
+													  uint32_t segCount,
+													  uint32_t timeout_ms	) {
+		for ( uint32_t i = 0; i < segCount; i++ ) {
+			if ( seg[ i ].count == 0 ) continue;
+			EC_SD_RESULT r = this->writeSector( seg[ i ].buf, sector, seg[ i ].count, timeout_ms );
+			if ( r != EC_SD_RESULT::OK ) return r;
+			sector += seg[ i ].count;
+		}
+		return EC_SD_RESULT::OK;
+	}
+
+	/*!
+	 * Прочитать и разобрать SD Status (ACMD13): размер AU, классы скорости, время стирания.
+	 * Реализация по умолчанию - ERROR (карта или обертка их не сообщает).
+	 */
+	virtual EC_SD_RESULT		getSdStatus			( MicrosdSdStatus& status ) {
+		( void )status;
+		return EC_SD_RESULT::ERROR;
+	}
+
+	/*!
+	 * Сообщить карте, что данные секторов [sector; sector + count) больше не нужны
+	 * (стирание CMD32/CMD33/CMD38). Карта перестает считать их занятыми и не тратит
+	 * время на перенос при следующей записи. После вызова содержимое не определено.
+	 * Подходит для FatFs disk_ioctl( CTRL_TRIM ): LBA_t* r = buff;
+	 * discardSectors( r[0], r[1] - r[0] + 1 ).
+	 * Реализация по умолчанию ничего не делает (discard - только подсказка карте).
+	 */
+	virtual EC_SD_RESULT		discardSectors		( uint32_t sector, uint32_t count ) {
+		( void )sector;
+		( void )count;
+		return EC_SD_RESULT::OK;
+	}
+
+	/*!
+	 * Поставить запрос в очередь и сразу вернуть управление.
+	 * OK - запрос принят, результат будет в req->result при вызове req->callback.
+	 * Иначе - запрос не принят и callback вызван не будет.
+	 * Реализация по умолчанию выполняет запрос синхронно (callback вызывается до возврата).
+	 */
+	virtual EC_SD_RESULT		submit				( MicrosdRequest* req ) {
+		if ( req->type == EC_SD_REQUEST_TYPE::READ ) {
+			req->result = this->readSector( req->sector, req->buf, req->count, req->timeoutMs );
+		} else {
+			req->result = this->writeSector( req->buf, req->sector, req->count, req->timeoutMs );
+		}
+
+		if ( req->callback != nullptr ) {
+			req->callback( req );
+		}
+
+		return EC_SD_RESULT::OK;
+	}
 };
@@ -0,0 +1,132 @@
+/*!
+ * Бенчмарк на хосте.
+ *
+ * Сборка (mc_spi.h и mc_pin.h берутся из модуля интерфейсов периферии):
+ * g++ -std=c++14 -O2 -include project_config.h \
+ *     -Imicrosd_benchmark/host -Imicrosd_card_emulator/host -I. \
+ *     -Imicrosd_card_spi/inc -Imicrosd_card_spi_t/inc -Imicrosd_card_emulator/inc -Imicrosd_benchmark/inc -I<mc_interfaces> \
+ *     microsd_benchmark/host/main.cpp microsd_benchmark/host/spi_t_card.cpp \
+ *     microsd_benchmark/src/microsd_benchmark.cpp \
+ *     microsd_card_spi/src/microsd_card_spi.cpp microsd_card_spi/src/microsd_spi_protocol.cpp \
+ *     microsd_card_emulator/src/microsd_card_emulator.cpp \
+ *     microsd_card_emulator/src/microsd_card_file.cpp -lpthread
+ *
+ * Запуск:
+ *     ./a.out				- MicrosdSpi поверх MicrosdEmulator (SDHC).
+ *     ./a.out -t			- MicrosdSpiT (через MicrosdSpiTAdapter) поверх того же эмулятора.
+ *     ./a.out image.bin	- MicrosdFile поверх файла.
+ */
+
+#include <stdio.h>
+#include <chrono>
+
+#include <string.h>
+
+#include "microsd_card_spi.h"
+#include "microsd_card_emulator.h"
+#include "microsd_card_file.h"
+#include "microsd_benchmark.h"
+#include "spi_t_card.h"
+
+#define CARD_SECTORS			( 64 * 1024 )			// 32 МиБ.
+#define BENCH_AREA_SECTORS		( 16 * 1024 )
+#define BENCH_BUF_SECTORS		( 128 )
+#define BENCH_REQUESTS			( 2048 )
+
+static uint8_t					cardMemory[ CARD_SECTORS * 512 ];
+alignas( 4 ) static uint8_t		benchBuf[ BENCH_BUF_SECTORS * 512 ];
+static uint32_t					benchLatency[ BENCH_REQUESTS ];
+
+static uint32_t getTimeUs ( void ) {
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return ( uint32_t )std::chrono::duration_cast< std::chrono::microseconds >(
+        std::chrono::steady_clock::now() - start ).count();
+}
+
+static bool getEmulatorStat ( void* ctx, MicrosdBenchBusStat& stat ) {
+    const MicrosdEmulatorStat& s = ( ( MicrosdEmulator* )ctx )->getStat();
+    stat.bytes			= s.bytes;
+    stat.transactions	= s.transactions;
+    return true;
+}
+
+static void setSpiSpeed ( SpiMaster8BitBase* spi, bool speed ) {
+    spi->setPrescaler( speed ? 2 : 256 );
+}
+
+static void printLine ( const char* line ) {
+    printf( "%s\n", line );
+}
+
+static const MicrosdEmulatorCfg emulatorCfg = {
+    .type				= EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK,
+    .memory				= cardMemory,
+    .sectorCount		= CARD_SECTORS,
+    .ncr				= 1,
+    .nac				= 2,
+    .busyBytes			= 32,
+    .acmd41Count		= 8,
+    .corruptEvery		= 0,
+    .unstablePrescaler	= 0,
+    .serial				= 0,
+    .blockLen			= 0
+};
+
+static MicrosdEmulator		emulator( &emulatorCfg );
+static MicrosdEmulatorCs	emulatorCs( &emulator );
+
+static const microsdSpiCfg spiCfg = {
+    .cs				= &emulatorCs,
+    .s				= &emulator,
+    .setSpiSpeed	= setSpiSpeed,
+    .asyncTaskPrio	= 0,
+    .crcEnable		= false,
+    .crcRetries		= 0,
+    .spinBudget		= 0,
+    .highSpeed		= false,
+    .setSpiClock	= nullptr,
+    .clockSteps		= 0,
+    .initTimeoutMs	= 0,
+    .warmInit		= false
+};
+
+static MicrosdSpi			spiCard( &spiCfg );
+
+int main ( int argc, char** argv ) {
+    MicrosdBase* card = &spiCard;
+    bool emulated = true;
+
+    bool useTemplate = ( argc > 1 ) && ( strcmp( argv[ 1 ], "-t" ) == 0 );
+
+    static MicrosdFile fileCard( ( ( argc > 1 ) && !useTemplate ) ? argv[ 1 ] : "", CARD_SECTORS );
+    if ( useTemplate ) {
+        card = getSpiTCard( &emulator, &emulatorCs );
+    } else if ( argc > 1 ) {
+        card = &fileCard;
+        emulated = false;
+    }
+
+    if ( card->initialize() == EC_MICRO_SD_TYPE::ERROR ) {
+        printf( "card init failed\n" );
+        return 1;
+    }
+
+    MicrosdBenchCfg cfg = {
+        .card			= card,
+        .getTimeUs		= getTimeUs,
+        .getBusStat		= emulated ? getEmulatorStat : nullptr,
+        .busStatCtx		= &emulator,
+        .buf			= benchBuf,
+        .bufSectors		= BENCH_BUF_SECTORS,
+        .latency		= benchLatency,
+        .latencyCount	= BENCH_REQUESTS,
+        .firstSector	= 0,
+        .areaSectors	= BENCH_AREA_SECTORS,
+        .bytesPerTest	= 4 * 1024 * 1024,
+        .timeoutMs		= 1000,
+        .print			= printLine
+    };
+
+    MicrosdBench bench( &cfg );
+    return ( bench.runAll() == EC_SD_RESULT::OK ) ? 0 : 1;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Конфигурация для сборки бенчмарка на хосте (Linux).
+#define MODULE_MICROSD_CARD_SPI_ENABLED
+#define MODULE_MICROSD_CARD_SPI_T_ENABLED
+#define MODULE_MICROSD_CARD_EMULATOR_ENABLED
+#define MODULE_MICROSD_CARD_FILE_ENABLED
+#define MODULE_MICROSD_BENCHMARK_ENABLED
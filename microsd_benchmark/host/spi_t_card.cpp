@@ -0,0 +1,17 @@
+#include "spi_t_card.h"
+#include "microsd_card_spi_t.h"
+
+/// Тот же эмулятор, что у MicrosdSpi, но SPI, CS и скорость известны при компиляции.
+struct SpiTPolicy : public MicrosdSpiTPolicyDefault {
+    static void setSpeed ( MicrosdEmulator& spi, bool fast ) {
+        spi.setPrescaler( fast ? 2 : 256 );
+    }
+};
+
+typedef MicrosdSpiT< MicrosdEmulator, MicrosdEmulatorCs, SpiTPolicy >	SpiTCard;
+
+MicrosdBase* getSpiTCard ( MicrosdEmulator* emulator, MicrosdEmulatorCs* cs ) {
+    static SpiTCard								card( *emulator, *cs );
+    static MicrosdSpiTAdapter< SpiTCard >		adapter( card );
+    return &adapter;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "microsd_base.h"
+#include "microsd_card_emulator.h"
+
+/*!
+ * MicrosdSpiT над эмулятором (ключ -t). Отдельная единица трансляции:
+ * ее объектный файл по размеру сравнивается с microsd_card_spi.o.
+ */
+MicrosdBase* getSpiTCard ( MicrosdEmulator* emulator, MicrosdEmulatorCs* cs );
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "project_config.h"
+
+#ifdef MODULE_MICROSD_BENCHMARK_ENABLED
+
+#include "user_os.h"
+#include "microsd_base.h"
+
+/*!
+ * Замер производительности любой реализации MicrosdBase.
+ * Работает как на хосте (с эмулятором или файлом вместо карты),
+ * так и на контроллере (время берется из getTimeUs, например, от тиков ОС).
+ * ВНИМАНИЕ: тесты записи портят содержимое области [firstSector; firstSector + areaSectors).
+ */
+
+enum class EC_MICROSD_BENCH_PATTERN {
+	SEQ_READ		=	0,
+	SEQ_WRITE		=	1,
+	RAND_READ		=	2,
+	RAND_WRITE		=	3,
+	MIXED			=	4		// Случайные адреса, 70% чтения / 30% записи.
+};
+
+/// Счетчики шины (если их можно получить, например, от MicrosdEmulator).
+struct MicrosdBenchBusStat {
+	uint32_t		bytes;
+	uint32_t		transactions;
+};
+
+struct MicrosdBenchCfg {
+	MicrosdBase*		card;
+
+	/// Источник времени в мкс (может переполняться, считаются только разности).
+	uint32_t			( *getTimeUs )		( void );
+
+	/// Может быть nullptr, тогда колонки шины не заполняются.
+	bool				( *getBusStat )		( void* ctx, MicrosdBenchBusStat& stat );
+	void*				busStatCtx;
+
+	uint8_t*			buf;				// Выравнен на 4, не менее maxSectors * 512 байт.
+	uint32_t			bufSectors;
+
+	uint32_t*			latency;			// Буфер под задержки отдельных запросов.
+	uint32_t			latencyCount;		// Он же - максимальное количество запросов в тесте.
+
+	uint32_t			firstSector;		// Область карты, отданная под тест.
+	uint32_t			areaSectors;
+
+	uint32_t			bytesPerTest;		// Объем полезных данных на один тест.
+	uint32_t			timeoutMs;
+
+	void				( *print )			( const char* line );	// Может быть nullptr.
+};
+
+struct MicrosdBenchResult {
+	EC_MICROSD_BENCH_PATTERN	pattern;
+	uint32_t					sectorsPerRequest;
+	uint32_t					requests;
+	uint32_t					errors;
+	uint64_t					payloadBytes;
+	uint32_t					totalUs;
+
+	uint32_t					mbPerSecX1000;			// МБ/с * 1000 (1 МБ = 10^6 байт).
+	uint32_t					iops;
+	uint32_t					p50Us;
+	uint32_t					p99Us;
+	uint32_t					maxUs;
+
+	bool						busStatValid;
+	uint32_t					busBytesPerPayloadX1000;
+	uint32_t					spiTransactions;
+};
+
+class MicrosdBench {
+public:
+	MicrosdBench ( const MicrosdBenchCfg* const cfg );
+
+	/// Один тест.
+	EC_SD_RESULT		run				( EC_MICROSD_BENCH_PATTERN pattern, uint32_t sectorsPerRequest, MicrosdBenchResult& result );
+
+	/// Все шаблоны для размеров запроса 1/8/64/128 секторов (если влезают в buf).
+	/// Каждый результат печатается через cfg->print.
+	EC_SD_RESULT		runAll			( void );
+
+	void				printHeader		( void );
+	void				printResult		( const MicrosdBenchResult& result );
+
+	/// Источник времени на основе тиков ОС (разрешение - 1 тик).
+	static uint32_t		osTickTimeUs	( void );
+
+private:
+	uint32_t			random			( void );
+	uint32_t			getRequestSector	( EC_MICROSD_BENCH_PATTERN pattern, uint32_t index, uint32_t sectorsPerRequest );
+	void				sortLatency		( uint32_t count );
+
+	const MicrosdBenchCfg*		const cfg;
+	uint32_t					seed		= 0x12345678;
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include "microsd_benchmark.h"
+
+#ifdef MODULE_MICROSD_BENCHMARK_ENABLED
+
+#include <stdio.h>
+
+static const uint32_t	benchSizes[]	= { 1, 8, 64, 128 };
+
+static const EC_MICROSD_BENCH_PATTERN	benchPatterns[] = {
+    EC_MICROSD_BENCH_PATTERN::SEQ_READ,
+    EC_MICROSD_BENCH_PATTERN::SEQ_WRITE,
+    EC_MICROSD_BENCH_PATTERN::RAND_READ,
+    EC_MICROSD_BENCH_PATTERN::RAND_WRITE,
+    EC_MICROSD_BENCH_PATTERN::MIXED
+};
+
+static const char*		benchPatternNames[] = {
+    "seq_read", "seq_write", "rand_read", "rand_write", "mixed"
+};
+
+MicrosdBench::MicrosdBench ( const MicrosdBenchCfg* const cfg ) : cfg( cfg ) {}
+
+uint32_t MicrosdBench::osTickTimeUs ( void ) {
+    return USER_OS_GET_TICK_COUNT() * 1000;					// Тик ОС - 1 мс.
+}
+
+// xorshift32: воспроизводимая последовательность между запусками.
+uint32_t MicrosdBench::random ( void ) {
+    this->seed ^= this->seed << 13;
+    this->seed ^= this->seed >> 17;
+    this->seed ^= this->seed << 5;
+    return this->seed;
+}
+
+uint32_t MicrosdBench::getRequestSector ( EC_MICROSD_BENCH_PATTERN pattern, uint32_t index, uint32_t sectorsPerRequest ) {
+    uint32_t slots = this->cfg->areaSectors / sectorsPerRequest;
+
+    if ( ( pattern == EC_MICROSD_BENCH_PATTERN::SEQ_READ ) || ( pattern == EC_MICROSD_BENCH_PATTERN::SEQ_WRITE ) ) {
+        return this->cfg->firstSector + ( index % slots ) * sectorsPerRequest;
+    }
+
+    return this->cfg->firstSector + ( this->random() % slots ) * sectorsPerRequest;
+}
+
+// Сортировка Шелла: без динамической памяти и без рекурсии.
+void MicrosdBench::sortLatency ( uint32_t count ) {
+    uint32_t* a = this->cfg->latency;
+    for ( uint32_t gap = count / 2; gap > 0; gap /= 2 ) {
+        for ( uint32_t i = gap; i < count; i++ ) {
+            uint32_t v = a[ i ];
+            uint32_t j = i;
+            for ( ; ( j >= gap ) && ( a[ j - gap ] > v ); j -= gap ) {
+                a[ j ] = a[ j - gap ];
+            }
+            a[ j ] = v;
+        }
+    }
+}
+
+EC_SD_RESULT MicrosdBench::run ( EC_MICROSD_BENCH_PATTERN pattern, uint32_t sectorsPerRequest, MicrosdBenchResult& result ) {
+    if ( ( sectorsPerRequest == 0 )								||
+         ( sectorsPerRequest > this->cfg->bufSectors )			||
+         ( sectorsPerRequest > this->cfg->areaSectors )			||
+         ( this->cfg->latencyCount == 0 ) ) {
+        return EC_SD_RESULT::PARERR;
+    }
+
+    uint32_t requests = this->cfg->bytesPerTest / ( sectorsPerRequest * 512 );
+    if ( requests == 0 ) requests = 1;
+    if ( requests > this->cfg->latencyCount ) requests = this->cfg->latencyCount;
+
+    result.pattern				= pattern;
+    result.sectorsPerRequest	= sectorsPerRequest;
+    result.requests				= requests;
+    result.errors				= 0;
+    result.payloadBytes			= ( uint64_t )requests * sectorsPerRequest * 512;
+    result.busStatValid			= false;
+
+    for ( uint32_t i = 0; i < sectorsPerRequest * 512; i++ ) {
+        this->cfg->buf[ i ] = ( uint8_t )i;
+    }
+
+    MicrosdBenchBusStat busStart = { 0, 0 };
+    bool busOk = ( this->cfg->getBusStat != nullptr ) && this->cfg->getBusStat( this->cfg->busStatCtx, busStart );
+
+    uint32_t timeStart = this->cfg->getTimeUs();
+
+    for ( uint32_t i = 0; i < requests; i++ ) {
+        uint32_t sector = this->getRequestSector( pattern, i, sectorsPerRequest );
+
+        bool write = ( pattern == EC_MICROSD_BENCH_PATTERN::SEQ_WRITE ) || ( pattern == EC_MICROSD_BENCH_PATTERN::RAND_WRITE );
+        if ( pattern == EC_MICROSD_BENCH_PATTERN::MIXED ) {
+            write = ( this->random() % 10 ) < 3;
+        }
+
+        uint32_t t = this->cfg->getTimeUs();
+
+        EC_SD_RESULT r;
+        if ( write ) {
+            r = this->cfg->card->writeSector( this->cfg->buf, sector, sectorsPerRequest, this->cfg->timeoutMs );
+        } else {
+            r = this->cfg->card->readSector( sector, this->cfg->buf, sectorsPerRequest, this->cfg->timeoutMs );
+        }
+
+        this->cfg->latency[ i ] = this->cfg->getTimeUs() - t;
+
+        if ( r != EC_SD_RESULT::OK ) {
+            result.errors++;
+        }
+    }
+
+    result.totalUs = this->cfg->getTimeUs() - timeStart;
+
+    if ( busOk ) {
+        MicrosdBenchBusStat busEnd;
+        if ( this->cfg->getBusStat( this->cfg->busStatCtx, busEnd ) ) {
+            result.busStatValid				= true;
+            result.spiTransactions			= busEnd.transactions - busStart.transactions;
+            result.busBytesPerPayloadX1000	= ( uint32_t )( ( uint64_t )( busEnd.bytes - busStart.bytes ) * 1000 / result.payloadBytes );
+        }
+    }
+
+    uint32_t us = ( result.totalUs != 0 ) ? result.totalUs : 1;
+    result.mbPerSecX1000	= ( uint32_t )( result.payloadBytes * 1000 / us );			// байт/мкс == МБ/с.
+    result.iops				= ( uint32_t )( ( uint64_t )requests * 1000000 / us );
+
+    this->sortLatency( requests );
+    result.p50Us	= this->cfg->latency[ ( requests - 1 ) * 50 / 100 ];
+    result.p99Us	= this->cfg->latency[ ( requests - 1 ) * 99 / 100 ];
+    result.maxUs	= this->cfg->latency[ requests - 1 ];
+
+    return ( result.errors == 0 ) ? EC_SD_RESULT::OK : EC_SD_RESULT::ERROR;
+}
+
+void MicrosdBench::printHeader ( void ) {
+    if ( this->cfg->print == nullptr ) return;
+    this->cfg->print( "pattern     sectors    MB/s       IOPS   p50_us   p99_us   max_us  bus/payload  spi_trans  errors" );
+}
+
+void MicrosdBench::printResult ( const MicrosdBenchResult& result ) {
+    if ( this->cfg->print == nullptr ) return;
+
+    char bus[ 16 ] = "-";
+    char trans[ 16 ] = "-";
+    if ( result.busStatValid ) {
+        snprintf( bus, sizeof( bus ), "%lu.%03lu",
+                  ( unsigned long )( result.busBytesPerPayloadX1000 / 1000 ),
+                  ( unsigned long )( result.busBytesPerPayloadX1000 % 1000 ) );
+        snprintf( trans, sizeof( trans ), "%lu", ( unsigned long )result.spiTransactions );
+    }
+
+    char line[ 128 ];
+    snprintf( line, sizeof( line ), "%-10s %8lu %4lu.%03lu %10lu %8lu %8lu %8lu %12s %10s %7lu",
+              benchPatternNames[ ( uint32_t )result.pattern ],
+              ( unsigned long )result.sectorsPerRequest,
+              ( unsigned long )( result.mbPerSecX1000 / 1000 ),
+              ( unsigned long )( result.mbPerSecX1000 % 1000 ),
+              ( unsigned long )result.iops,
+              ( unsigned long )result.p50Us,
+              ( unsigned long )result.p99Us,
+              ( unsigned long )result.maxUs,
+              bus, trans,
+              ( unsigned long )result.errors );
+    this->cfg->print( line );
+}
+
+EC_SD_RESULT MicrosdBench::runAll ( void ) {
+    EC_SD_RESULT rv = EC_SD_RESULT::OK;
+
+    this->printHeader();
+
+    for ( uint32_t p = 0; p < sizeof( benchPatterns ) / sizeof( benchPatterns[ 0 ] ); p++ ) {
+        for ( uint32_t s = 0; s < sizeof( benchSizes ) / sizeof( benchSizes[ 0 ] ); s++ ) {
+            MicrosdBenchResult result;
+            EC_SD_RESULT r = this->run( benchPatterns[ p ], benchSizes[ s ], result );
+            if ( r == EC_SD_RESULT::PARERR ) continue;				// Не влезает в буфер/область.
+            if ( r != EC_SD_RESULT::OK ) rv = r;
+            this->printResult( result );
+        }
+    }
+
+    return rv;
+}
+
+#endif
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "project_config.h"
+
+#ifdef MODULE_MICROSD_CACHE_ENABLED
+
+#include "user_os.h"
+#include "microsd_base.h"
+
+/*!
+ * Кэш секторов поверх любой реализации MicrosdBase (MicrosdSpi, MicrosdSdio).
+ * Поиск - по хэш-таблице, вытеснение - LRU.
+ * Вся память передается через конфигурацию (статически выделяется пользователем).
+ */
+
+// Время на запись грязных строк в initialize.
+#define MICROSD_CACHE_INIT_FLUSH_TIMEOUT_MS			( 1000 )
+
+enum class EC_MICROSD_CACHE_MODE {
+	WRITE_THROUGH		=	0,		// Запись сразу уходит на карту.
+	WRITE_BACK			=	1		// Запись оседает в кэше до вытеснения или flush().
+};
+
+/// Служебная информация строки кэша (одна строка - один сектор).
+struct MicrosdCacheLine {
+	uint32_t		sector;
+	uint16_t		hashNext;
+	uint16_t		lruPrev;
+	uint16_t		lruNext;
+	uint8_t			valid;
+	uint8_t			dirty;
+};
+
+struct MicrosdCacheCfg {
+	MicrosdBase*			card;
+	EC_MICROSD_CACHE_MODE	mode;
+
+	MicrosdCacheLine*		lines;
+	uint8_t*				data;				// lineCount * 512 байт, выравнен на 4 (требование DMA SDIO).
+	uint16_t				lineCount;			// Не более 0xFFFE.
+
+	uint16_t*				hash;				// Корзины хэш-таблицы.
+	uint16_t				hashSize;			// Степень двойки.
+
+	/// Запросы длиннее этого числа секторов идут мимо кэша
+	/// (чтобы чтение большого файла не вытесняло FAT/каталоги). 0 - кэшировать все.
+	uint32_t				bypassSectors;
+};
+
+struct MicrosdCacheStat {
+	uint32_t		hits;
+	uint32_t		misses;
+	uint32_t		evictions;
+	uint32_t		writebacks;				// Записей грязных строк на карту.
+};
+
+class MicrosdCache : public MicrosdBase {
+public:
+	MicrosdCache ( const MicrosdCacheCfg* const cfg );
+
+	/// Сначала записывает грязные строки (ERROR, если не удалось - строки сохраняются),
+	/// затем сбрасывает кэш и инициализирует карту.
+	EC_MICRO_SD_TYPE	initialize			( void );
+	EC_MICRO_SD_TYPE	getType				( void );
+	EC_SD_RESULT		readSector			( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms );
+	EC_SD_RESULT		writeSector			( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms );
+	EC_SD_STATUS		getStatus			( void );
+	EC_SD_RESULT		getSectorCount		( uint32_t& sectorCount );
+	EC_SD_RESULT		getBlockSize		( uint32_t& blockSize );
+	EC_SD_RESULT		getSdStatus			( MicrosdSdStatus& status );
+
+	/// Строки диапазона (в том числе грязные) выбрасываются без записи.
+	EC_SD_RESULT		discardSectors		( uint32_t sector, uint32_t count );
+
+	/// Записать на карту все грязные строки.
+	EC_SD_RESULT		flush				( uint32_t timeout_ms );
+
+	/// Сбросить кэш без записи (например, после смены карты: вызвать до initialize,
+	/// чтобы грязные строки старой карты не попали на новую).
+	void				invalidate			( void );
+
+	void				getStat				( MicrosdCacheStat& stat );
+	void				resetStat			( void );
+
+private:
+	uint16_t			find				( uint32_t sector );
+	uint16_t			getHash				( uint32_t sector );
+	void				hashInsert			( uint16_t line );
+	void				hashRemove			( uint16_t line );
+	void				lruUnlink			( uint16_t line );
+	void				lruPushFront		( uint16_t line );
+
+	// Освободить строку без записи (она станет первым кандидатом на вытеснение).
+	void				dropLine			( uint16_t line );
+
+	// Отдает свободную строку (при необходимости вытесняя LRU).
+	EC_SD_RESULT		allocLine			( uint32_t sector, uint16_t& line, uint32_t timeout_ms );
+	EC_SD_RESULT		writeBackLine		( uint16_t line, uint32_t timeout_ms );
+
+	// Положить копию сектора в кэш.
+	EC_SD_RESULT		put					( uint32_t sector, const uint8_t* src, bool dirty, uint32_t timeout_ms );
+
+	uint8_t*			lineData			( uint16_t line );
+
+	void				resetLines			( void );
+	EC_SD_RESULT		flushLines			( uint32_t timeout_ms );
+
+	const MicrosdCacheCfg*			const cfg;
+
+	USER_OS_STATIC_MUTEX_BUFFER		mb;
+	USER_OS_STATIC_MUTEX			m				= nullptr;
+
+	uint16_t						lruHead;		// Самая свежая строка.
+	uint16_t						lruTail;		// Кандидат на вытеснение.
+
+	MicrosdCacheStat				stat;
+};
+
+#endif
@@ -0,0 +1,353 @@
+#include "microsd_cache.h"
+
+#ifdef MODULE_MICROSD_CACHE_ENABLED
+
+#include <string.h>
+
+#define LINE_NONE			( 0xFFFF )
+
+MicrosdCache::MicrosdCache ( const MicrosdCacheCfg* const cfg ) : cfg( cfg ) {
+    this->m = USER_OS_STATIC_MUTEX_CREATE( &this->mb );
+    this->invalidate();
+    this->resetStat();
+}
+
+//**********************************************************************
+// Служебные методы (вызываются под mutex-ом).
+//**********************************************************************
+uint8_t* MicrosdCache::lineData ( uint16_t line ) {
+    return &this->cfg->data[ ( uint32_t )line * 512 ];
+}
+
+uint16_t MicrosdCache::getHash ( uint32_t sector ) {
+    return ( uint16_t )( ( sector * 2654435761UL ) >> 16 ) & ( this->cfg->hashSize - 1 );
+}
+
+uint16_t MicrosdCache::find ( uint32_t sector ) {
+    uint16_t l = this->cfg->hash[ this->getHash( sector ) ];
+    while ( l != LINE_NONE ) {
+        if ( this->cfg->lines[ l ].sector == sector ) return l;
+        l = this->cfg->lines[ l ].hashNext;
+    }
+    return LINE_NONE;
+}
+
+void MicrosdCache::hashInsert ( uint16_t line ) {
+    uint16_t h = this->getHash( this->cfg->lines[ line ].sector );
+    this->cfg->lines[ line ].hashNext = this->cfg->hash[ h ];
+    this->cfg->hash[ h ] = line;
+}
+
+void MicrosdCache::hashRemove ( uint16_t line ) {
+    uint16_t* p = &this->cfg->hash[ this->getHash( this->cfg->lines[ line ].sector ) ];
+    while ( *p != LINE_NONE ) {
+        if ( *p == line ) {
+            *p = this->cfg->lines[ line ].hashNext;
+            return;
+        }
+        p = &this->cfg->lines[ *p ].hashNext;
+    }
+}
+
+void MicrosdCache::lruUnlink ( uint16_t line ) {
+    MicrosdCacheLine* l = &this->cfg->lines[ line ];
+
+    if ( l->lruPrev != LINE_NONE ) {
+        this->cfg->lines[ l->lruPrev ].lruNext = l->lruNext;
+    } else {
+        this->lruHead = l->lruNext;
+    }
+
+    if ( l->lruNext != LINE_NONE ) {
+        this->cfg->lines[ l->lruNext ].lruPrev = l->lruPrev;
+    } else {
+        this->lruTail = l->lruPrev;
+    }
+}
+
+void MicrosdCache::lruPushFront ( uint16_t line ) {
+    MicrosdCacheLine* l = &this->cfg->lines[ line ];
+    l->lruPrev = LINE_NONE;
+    l->lruNext = this->lruHead;
+
+    if ( this->lruHead != LINE_NONE ) {
+        this->cfg->lines[ this->lruHead ].lruPrev = line;
+    } else {
+        this->lruTail = line;
+    }
+
+    this->lruHead = line;
+}
+
+void MicrosdCache::dropLine ( uint16_t line ) {
+    MicrosdCacheLine* l = &this->cfg->lines[ line ];
+
+    this->hashRemove( line );
+    l->valid = 0;
+    l->dirty = 0;
+
+    this->lruUnlink( line );
+    l->lruNext = LINE_NONE;
+    l->lruPrev = this->lruTail;
+
+    if ( this->lruTail != LINE_NONE ) {
+        this->cfg->lines[ this->lruTail ].lruNext = line;
+    } else {
+        this->lruHead = line;
+    }
+
+    this->lruTail = line;
+}
+
+EC_SD_RESULT MicrosdCache::writeBackLine ( uint16_t line, uint32_t timeout_ms ) {
+    MicrosdCacheLine* l = &this->cfg->lines[ line ];
+    EC_SD_RESULT r = this->cfg->card->writeSector( this->lineData( line ), l->sector, 1, timeout_ms );
+    if ( r == EC_SD_RESULT::OK ) {
+        l->dirty = 0;
+        this->stat.writebacks++;
+    }
+    return r;
+}
+
+EC_SD_RESULT MicrosdCache::allocLine ( uint32_t sector, uint16_t& line, uint32_t timeout_ms ) {
+    line = this->lruTail;
+    MicrosdCacheLine* l = &this->cfg->lines[ line ];
+
+    if ( l->valid ) {
+        if ( l->dirty ) {
+            EC_SD_RESULT r = this->writeBackLine( line, timeout_ms );
+            if ( r != EC_SD_RESULT::OK ) return r;
+        }
+        this->hashRemove( line );
+        this->stat.evictions++;
+    }
+
+    l->sector	= sector;
+    l->valid	= 1;
+    l->dirty	= 0;
+    this->hashInsert( line );
+
+    this->lruUnlink( line );
+    this->lruPushFront( line );
+
+    return EC_SD_RESULT::OK;
+}
+
+EC_SD_RESULT MicrosdCache::put ( uint32_t sector, const uint8_t* src, bool dirty, uint32_t timeout_ms ) {
+    uint16_t line = this->find( sector );
+
+    if ( line == LINE_NONE ) {
+        EC_SD_RESULT r = this->allocLine( sector, line, timeout_ms );
+        if ( r != EC_SD_RESULT::OK ) return r;
+    } else {
+        this->lruUnlink( line );
+        this->lruPushFront( line );
+    }
+
+    memcpy( this->lineData( line ), src, 512 );
+    this->cfg->lines[ line ].dirty = dirty ? 1 : 0;
+
+    return EC_SD_RESULT::OK;
+}
+
+void MicrosdCache::resetLines ( void ) {
+    for ( uint32_t i = 0; i < this->cfg->hashSize; i++ ) {
+        this->cfg->hash[ i ] = LINE_NONE;
+    }
+
+    this->lruHead = LINE_NONE;
+    this->lruTail = LINE_NONE;
+
+    for ( uint16_t i = 0; i < this->cfg->lineCount; i++ ) {
+        this->cfg->lines[ i ].valid = 0;
+        this->cfg->lines[ i ].dirty = 0;
+        this->lruPushFront( i );
+    }
+}
+
+EC_SD_RESULT MicrosdCache::flushLines ( uint32_t timeout_ms ) {
+    EC_SD_RESULT rv = EC_SD_RESULT::OK;
+
+    for ( uint16_t i = 0; i < this->cfg->lineCount; i++ ) {
+        if ( this->cfg->lines[ i ].valid && this->cfg->lines[ i ].dirty ) {
+            EC_SD_RESULT r = this->writeBackLine( i, timeout_ms );
+            if ( r != EC_SD_RESULT::OK ) rv = r;
+        }
+    }
+
+    return rv;
+}
+
+//**********************************************************************
+// Основной функционал.
+//**********************************************************************
+void MicrosdCache::invalidate ( void ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    this->resetLines();
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+EC_SD_RESULT MicrosdCache::flush ( uint32_t timeout_ms ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    EC_SD_RESULT r = this->flushLines( timeout_ms );
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+EC_SD_RESULT MicrosdCache::readSector ( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms ) {
+    EC_SD_RESULT r = EC_SD_RESULT::OK;
+
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    if ( ( this->cfg->bypassSectors != 0 ) && ( cout_sector > this->cfg->bypassSectors ) ) {
+        /// Мимо кэша, но грязные строки новее данных на карте.
+        r = this->cfg->card->readSector( sector, target_array, cout_sector, timeout_ms );
+        if ( r == EC_SD_RESULT::OK ) {
+            for ( uint32_t i = 0; i < cout_sector; i++ ) {
+                uint16_t line = this->find( sector + i );
+                if ( ( line != LINE_NONE ) && this->cfg->lines[ line ].dirty ) {
+                    memcpy( &target_array[ i * 512 ], this->lineData( line ), 512 );
+                }
+            }
+        }
+    } else {
+        uint32_t i = 0;
+        while ( i < cout_sector ) {
+            uint16_t line = this->find( sector + i );
+
+            if ( line != LINE_NONE ) {
+                memcpy( &target_array[ i * 512 ], this->lineData( line ), 512 );
+                this->lruUnlink( line );
+                this->lruPushFront( line );
+                this->stat.hits++;
+                i++;
+                continue;
+            }
+
+            /// Подряд идущие промахи читаем одним запросом сразу в буфер пользователя.
+            uint32_t j = i + 1;
+            while ( ( j < cout_sector ) && ( this->find( sector + j ) == LINE_NONE ) ) {
+                j++;
+            }
+
+            this->stat.misses += j - i;
+
+            r = this->cfg->card->readSector( sector + i, &target_array[ i * 512 ], j - i, timeout_ms );
+            if ( r != EC_SD_RESULT::OK ) break;
+
+            for ( ; i < j; i++ ) {
+                r = this->put( sector + i, &target_array[ i * 512 ], false, timeout_ms );
+                if ( r != EC_SD_RESULT::OK ) break;
+            }
+            if ( r != EC_SD_RESULT::OK ) break;
+        }
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+EC_SD_RESULT MicrosdCache::writeSector ( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms ) {
+    EC_SD_RESULT r = EC_SD_RESULT::OK;
+
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    bool bypass = ( this->cfg->bypassSectors != 0 ) && ( cout_sector > this->cfg->bypassSectors );
+
+    if ( bypass || ( this->cfg->mode == EC_MICROSD_CACHE_MODE::WRITE_THROUGH ) ) {
+        r = this->cfg->card->writeSector( source_array, sector, cout_sector, timeout_ms );
+        if ( r == EC_SD_RESULT::OK ) {
+            for ( uint32_t i = 0; i < cout_sector; i++ ) {
+                uint16_t line = this->find( sector + i );
+                if ( line != LINE_NONE ) {
+                    memcpy( this->lineData( line ), &source_array[ i * 512 ], 512 );
+                    this->cfg->lines[ line ].dirty = 0;
+                } else if ( !bypass ) {
+                    r = this->put( sector + i, &source_array[ i * 512 ], false, timeout_ms );
+                    if ( r != EC_SD_RESULT::OK ) break;
+                }
+            }
+        }
+    } else {
+        for ( uint32_t i = 0; i < cout_sector; i++ ) {
+            r = this->put( sector + i, &source_array[ i * 512 ], true, timeout_ms );
+            if ( r != EC_SD_RESULT::OK ) break;
+        }
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+EC_SD_RESULT MicrosdCache::discardSectors ( uint32_t sector, uint32_t count ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    for ( uint16_t i = 0; i < this->cfg->lineCount; i++ ) {
+        MicrosdCacheLine* l = &this->cfg->lines[ i ];
+        if ( l->valid && ( l->sector - sector < count ) ) {
+            this->dropLine( i );
+        }
+    }
+
+    EC_SD_RESULT r = this->cfg->card->discardSectors( sector, count );
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+// Грязные строки - записи, о которых уже отчитались успехом: сначала они
+// уходят на карту, и только затем кэш сбрасывается (карта могла смениться).
+// Если записать не удалось, строки остаются в кэше и возвращается ERROR.
+EC_MICRO_SD_TYPE MicrosdCache::initialize ( void ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    if ( this->flushLines( MICROSD_CACHE_INIT_FLUSH_TIMEOUT_MS ) != EC_SD_RESULT::OK ) {
+        USER_OS_GIVE_MUTEX( this->m );
+        return EC_MICRO_SD_TYPE::ERROR;
+    }
+
+    this->resetLines();
+    EC_MICRO_SD_TYPE type = this->cfg->card->initialize();
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return type;
+}
+
+EC_MICRO_SD_TYPE MicrosdCache::getType ( void ) {
+    return this->cfg->card->getType();
+}
+
+EC_SD_STATUS MicrosdCache::getStatus ( void ) {
+    return this->cfg->card->getStatus();
+}
+
+EC_SD_RESULT MicrosdCache::getSectorCount ( uint32_t& sectorCount ) {
+    return this->cfg->card->getSectorCount( sectorCount );
+}
+
+EC_SD_RESULT MicrosdCache::getBlockSize ( uint32_t& blockSize ) {
+    return this->cfg->card->getBlockSize( blockSize );
+}
+
+EC_SD_RESULT MicrosdCache::getSdStatus ( MicrosdSdStatus& status ) {
+    return this->cfg->card->getSdStatus( status );
+}
+
+void MicrosdCache::getStat ( MicrosdCacheStat& stat ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    stat = this->stat;
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+void MicrosdCache::resetStat ( void ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    memset( &this->stat, 0, sizeof( this->stat ) );
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+#endif
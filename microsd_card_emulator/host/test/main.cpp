@@ -0,0 +1,368 @@
+/*!
+ * Проверки MicrosdSpi и модулей над ним на MicrosdEmulator (хост, Linux).
+ *
+ * Сборка (mc_spi.h и mc_pin.h берутся из модуля интерфейсов периферии):
+ * g++ -std=c++14 -O2 -include project_config.h \
+ *     -Imicrosd_card_emulator/host/test -Imicrosd_card_emulator/host -I. \
+ *     -Imicrosd_card_spi/inc -Imicrosd_card_emulator/inc -I<mc_interfaces> \
+ *     microsd_card_emulator/host/test/main.cpp microsd_card_emulator/src/microsd_card_emulator.cpp \
+ *     microsd_card_spi/src/microsd_card_spi.cpp microsd_card_spi/src/microsd_spi_protocol.cpp \
+ *     -Imicrosd_cache/inc microsd_cache/src/microsd_cache.cpp \
+ *     -Imicrosd_prefetch/inc microsd_prefetch/src/microsd_prefetch.cpp \
+ *     -Imicrosd_coalesce/inc microsd_coalesce/src/microsd_coalesce.cpp \
+ *     -Imicrosd_scheduler/inc microsd_scheduler/src/microsd_scheduler.cpp \
+ *     -lpthread
+ *
+ * Запуск: ./a.out - по строке на проверку, код возврата 0, если все прошли.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+
+#include "microsd_card_spi.h"
+#include "microsd_card_emulator.h"
+#include "microsd_cache.h"
+#include "microsd_prefetch.h"
+#include "microsd_coalesce.h"
+#include "microsd_scheduler.h"
+
+#define CARD_SECTORS			( 4096 )
+#define AREA_SECTORS			( 256 )				// Область случайных запросов к модулям.
+#define MAX_REQUEST_SECTORS		( 32 )
+
+static uint32_t failures = 0;
+
+static void check ( bool ok, const char* name ) {
+    printf( "%-4s %s\n", ok ? "ok" : "FAIL", name );
+    if ( !ok ) {
+        failures++;
+    }
+}
+
+static void setSpiSpeed ( SpiMaster8BitBase* spi, bool speed ) {
+    spi->setPrescaler( speed ? 8 : 64 );
+}
+
+/// Шаги подбора частоты: prescaler 8, 4, 2, 1.
+static void setSpiClock ( SpiMaster8BitBase* spi, uint32_t step ) {
+    spi->setPrescaler( 8u >> step );
+}
+
+static void fillRandom ( uint8_t* buf, uint32_t len ) {
+    for ( uint32_t i = 0; i < len; i++ ) {
+        buf[ i ] = ( uint8_t )rand();
+    }
+}
+
+/// Эмулятор и драйвер над памятью карты.
+struct TestCard {
+    TestCard ( EC_MICROSD_EMULATOR_TYPE type, bool crcEnable = false ) : mem( CARD_SECTORS * 512 ),
+        ec{ type, mem.data(), CARD_SECTORS, 1, 2, 20, 3, 0, 0, 1, 0 },
+        card( &ec ), cs( &card ),
+        cfg{ &cs, &card, setSpiSpeed, 1, crcEnable, 3, 0, false, nullptr, 0, 0, false },
+        sd( &cfg ) {
+        fillRandom( this->mem.data(), this->mem.size() );
+    }
+
+    std::vector< uint8_t >		mem;
+    MicrosdEmulatorCfg			ec;
+    MicrosdEmulator				card;
+    MicrosdEmulatorCs			cs;
+    microsdSpiCfg				cfg;
+    MicrosdSpi					sd;
+};
+
+/// Случайные чтения/записи в [first; first + AREA_SECTORS) с проверкой по теневой копии.
+/// Возвращает число несовпадений и ошибок.
+static uint32_t randomOps ( MicrosdBase* dev, std::vector< uint8_t >& shadow, uint32_t first, uint32_t ops,
+                            uint32_t maxSectors = MAX_REQUEST_SECTORS ) {
+    static thread_local uint8_t buf[ MAX_REQUEST_SECTORS * 512 ];
+    uint32_t bad = 0;
+
+    for ( uint32_t i = 0; i < ops; i++ ) {
+        uint32_t n = 1 + ( ( rand() % 4 == 0 ) ? rand() % maxSectors : rand() % 4 );
+        uint32_t s = first + rand() % ( AREA_SECTORS - n );
+
+        if ( rand() % 2 ) {
+            fillRandom( buf, n * 512 );
+            if ( dev->writeSector( buf, s, n, 100 ) != EC_SD_RESULT::OK ) bad++;
+            memcpy( &shadow[ s * 512 ], buf, n * 512 );
+        } else {
+            if ( dev->readSector( s, buf, n, 100 ) != EC_SD_RESULT::OK ) bad++;
+            else if ( memcmp( buf, &shadow[ s * 512 ], n * 512 ) != 0 ) bad++;
+        }
+    }
+
+    return bad;
+}
+
+//**********************************************************************
+// Драйвер.
+//**********************************************************************
+// SD1 и SD2 (SDSC) адресуются в байтах, SDHC - в блоках: сектор должен попасть
+// в то же место памяти карты при любом типе.
+static void testAddressing ( void ) {
+    static const struct {
+        EC_MICROSD_EMULATOR_TYPE	emu;
+        EC_MICRO_SD_TYPE			expected;
+        const char*					name;
+    } types[] = {
+        { EC_MICROSD_EMULATOR_TYPE::SD1,		EC_MICRO_SD_TYPE::SD1,		"addressing SD1" },
+        { EC_MICROSD_EMULATOR_TYPE::SD2,		EC_MICRO_SD_TYPE::SD2,		"addressing SD2 (SDSC)" },
+        { EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK,
+          ( EC_MICRO_SD_TYPE )( ( uint32_t )EC_MICRO_SD_TYPE::SD2 | ( uint32_t )EC_MICRO_SD_TYPE::BLOCK ),	"addressing SDHC" }
+    };
+
+    for ( const auto& t : types ) {
+        TestCard c( t.emu );
+        bool ok = ( c.sd.initialize() == t.expected );
+
+        uint32_t count = 0;
+        ok = ok && ( c.sd.getSectorCount( count ) == EC_SD_RESULT::OK ) && ( count == CARD_SECTORS );
+
+        alignas( 4 ) static uint8_t buf[ 8 * 512 ];
+        for ( uint32_t s : { 0u, 1u, 777u, CARD_SECTORS - 8u } ) {
+            fillRandom( buf, sizeof( buf ) );
+            ok = ok && ( c.sd.writeSector( buf, s, 8, 100 ) == EC_SD_RESULT::OK );
+            ok = ok && ( memcmp( &c.mem[ s * 512 ], buf, sizeof( buf ) ) == 0 );
+            ok = ok && ( c.sd.readSector( s, buf, 1, 100 ) == EC_SD_RESULT::OK );
+            ok = ok && ( memcmp( &c.mem[ s * 512 ], buf, 512 ) == 0 );
+        }
+
+        check( ok, t.name );
+    }
+}
+
+// Каждый 7-й блок данных искажается: с CRC запросы повторяются и данные целы,
+// без CRC искажение доходит до приложения (эмулятор действительно портит данные).
+// Запросы не длиннее 4 секторов, иначе искаженный блок есть в каждом повторе.
+static void testCrcRetry ( void ) {
+    for ( bool crc : { true, false } ) {
+        TestCard c( EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK, crc );
+        c.ec.corruptEvery = 7;
+
+        bool ok = ( c.sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+        std::vector< uint8_t > shadow( c.mem );
+        uint32_t bad = 0;
+        for ( uint32_t i = 0; i < 20; i++ ) {
+            bad += randomOps( &c.sd, shadow, 0, 10, 4 );
+        }
+
+        if ( crc ) {
+            ok = ok && ( bad == 0 ) && ( c.card.getStat().crcErrors != 0 ) && ( c.mem == shadow );
+            check( ok, "crc retry (corruptEvery)" );
+        } else {
+            check( ok && ( bad != 0 ), "corruption without crc is visible" );
+        }
+    }
+}
+
+// SDSC без ERASE_BLK_EN стирает группами: данные вне диапазона не должны пострадать.
+static void testDiscard ( void ) {
+    for ( uint16_t blockLen : { 0, 1024, 2048 } ) {
+        TestCard c( EC_MICROSD_EMULATOR_TYPE::SD2 );
+        c.ec.blockLen = blockLen;
+        memset( c.mem.data(), 0xAA, c.mem.size() );
+
+        bool ok = ( c.sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+        ok = ok && ( c.sd.discardSectors( 100, 1000 ) == EC_SD_RESULT::OK );
+        ok = ok && ( c.sd.waitWriteDone( 500 ) == EC_SD_RESULT::OK );
+
+        uint32_t erased = 0;
+        for ( uint32_t s = 0; s < CARD_SECTORS; s++ ) {
+            if ( c.mem[ s * 512 ] != 0 ) continue;
+            erased++;
+            if ( ( s < 100 ) || ( s >= 1100 ) ) ok = false;
+        }
+        ok = ok && ( erased != 0 );
+
+        char name[ 64 ];
+        snprintf( name, sizeof( name ), "discard SDSC, block %u", ( blockLen != 0 ) ? blockLen : 512 );
+        check( ok, name );
+    }
+}
+
+// Плата выдерживает prescaler не меньше 2: подбор должен остановиться на шаге 2.
+static void testTuning ( void ) {
+    TestCard c( EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK, true );
+    c.ec.unstablePrescaler	= 1;
+    c.cfg.highSpeed			= true;
+    c.cfg.setSpiClock		= setSpiClock;
+    c.cfg.clockSteps		= 4;
+
+    bool ok = ( c.sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+
+    MicrosdClockTune tune;
+    c.sd.getClockTune( tune );
+    ok = ok && tune.highSpeed && tune.tuned && ( tune.setting == 2 ) && ( c.card.getPrescaler() == 2 );
+
+    std::vector< uint8_t > shadow( c.mem );
+    ok = ok && ( randomOps( &c.sd, shadow, 0, 50 ) == 0 ) && ( c.mem == shadow );
+
+    check( ok, "clock tuning (unstablePrescaler)" );
+}
+
+// Повторный initialize той же карты - без сброса, после снятия питания
+// или замены карты (другой CID) - полный.
+static void testWarmInit ( void ) {
+    TestCard c( EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK );
+    c.cfg.warmInit = true;
+
+    MicrosdInitTiming timing;
+    bool ok = ( c.sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+    c.sd.getInitTiming( timing );
+    ok = ok && !timing.warm;
+
+    alignas( 4 ) static uint8_t buf[ 4 * 512 ];
+    fillRandom( buf, sizeof( buf ) );
+    ok = ok && ( c.sd.writeSector( buf, 10, 4, 100 ) == EC_SD_RESULT::OK );
+
+    ok = ok && ( c.sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+    c.sd.getInitTiming( timing );
+    ok = ok && timing.warm;
+    ok = ok && ( c.sd.readSector( 10, buf, 4, 100 ) == EC_SD_RESULT::OK ) && ( memcmp( buf, &c.mem[ 10 * 512 ], sizeof( buf ) ) == 0 );
+
+    c.card.powerOn();
+    ok = ok && ( c.sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+    c.sd.getInitTiming( timing );
+    ok = ok && !timing.warm;
+
+    c.ec.serial = 2;
+    ok = ok && ( c.sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+    c.sd.getInitTiming( timing );
+    ok = ok && !timing.warm;
+
+    check( ok, "warm re-init" );
+}
+
+//**********************************************************************
+// Модули над драйвером.
+//**********************************************************************
+static void testCache ( void ) {
+    for ( EC_MICROSD_CACHE_MODE mode : { EC_MICROSD_CACHE_MODE::WRITE_THROUGH, EC_MICROSD_CACHE_MODE::WRITE_BACK } ) {
+        TestCard c( EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK );
+        bool ok = ( c.sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+
+        static MicrosdCacheLine			lines[ 32 ];
+        alignas( 4 ) static uint8_t		data[ 32 * 512 ];
+        static uint16_t					hash[ 64 ];
+        MicrosdCacheCfg cfg = { &c.sd, mode, lines, data, 32, hash, 64, 16 };
+        MicrosdCache cache( &cfg );
+
+        std::vector< uint8_t > shadow( c.mem );
+        ok = ok && ( randomOps( &cache, shadow, 0, 2000 ) == 0 );
+
+        // Повторный initialize записывает грязные строки, а не теряет их.
+        ok = ok && ( cache.initialize() != EC_MICRO_SD_TYPE::ERROR ) && ( c.mem == shadow );
+
+        ok = ok && ( randomOps( &cache, shadow, 0, 2000 ) == 0 );
+        ok = ok && ( cache.flush( 100 ) == EC_SD_RESULT::OK ) && ( c.mem == shadow );
+
+        check( ok, ( mode == EC_MICROSD_CACHE_MODE::WRITE_BACK ) ? "cache write-back" : "cache write-through" );
+    }
+}
+
+// Упреждение проверяется на последовательном чтении вперемешку с записями.
+static void testPrefetch ( void ) {
+    // Задача модуля не завершается: карта и модуль остаются в памяти до выхода.
+    TestCard* c = new TestCard( EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK );
+    bool ok = ( c->sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+
+    alignas( 4 ) static uint8_t pbuf[ 2 * 64 * 512 ];
+    static MicrosdPrefetchCfg cfg = { &c->sd, pbuf, 8, 64, 2, 100, 1 };
+    MicrosdPrefetch* pf = new MicrosdPrefetch( &cfg );
+
+    std::vector< uint8_t > shadow( c->mem );
+    alignas( 4 ) static uint8_t buf[ 8 * 512 ];
+    uint32_t s = 0;
+    for ( uint32_t i = 0; ( i < 3000 ) && ok; i++ ) {
+        uint32_t n = 1 + rand() % 8;
+        if ( rand() % 50 == 0 ) s = rand() % ( CARD_SECTORS - 8 );
+        if ( s + n > CARD_SECTORS ) s = 0;
+
+        if ( rand() % 20 == 0 ) {
+            fillRandom( buf, n * 512 );
+            ok = ( pf->writeSector( buf, s, n, 100 ) == EC_SD_RESULT::OK );
+            memcpy( &shadow[ s * 512 ], buf, n * 512 );
+        }
+
+        ok = ok && ( pf->readSector( s, buf, n, 100 ) == EC_SD_RESULT::OK ) && ( memcmp( buf, &shadow[ s * 512 ], n * 512 ) == 0 );
+        s += n;
+    }
+
+    MicrosdPrefetchStat st;
+    pf->getStat( st );
+    check( ok && ( st.hits != 0 ), "prefetch" );
+}
+
+static void testCoalesce ( void ) {
+    // Задача модуля не завершается: карта и модуль остаются в памяти до выхода.
+    TestCard* c = new TestCard( EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK );
+    bool ok = ( c->sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+
+    alignas( 4 ) static uint8_t buf[ 16 * 512 ];
+    static MicrosdCoalesceCfg cfg = { &c->sd, buf, 16, 5, 100, 1 };
+    MicrosdCoalesce* co = new MicrosdCoalesce( &cfg );
+
+    std::vector< uint8_t > shadow( c->mem );
+    ok = ok && ( randomOps( co, shadow, 0, 2000 ) == 0 );
+
+    // Повторный initialize записывает накопленный участок, а не теряет его.
+    ok = ok && ( co->initialize() != EC_MICRO_SD_TYPE::ERROR ) && ( c->mem == shadow );
+
+    ok = ok && ( randomOps( co, shadow, 0, 2000 ) == 0 );
+    ok = ok && ( co->flush( 100 ) == EC_SD_RESULT::OK ) && ( c->sd.waitWriteDone( 100 ) == EC_SD_RESULT::OK );
+    ok = ok && ( c->mem == shadow );
+
+    check( ok, "coalesce" );
+}
+
+// Несколько задач в своих областях через одну очередь планировщика.
+static void testScheduler ( void ) {
+    // Задача модуля не завершается: карта и модуль остаются в памяти до выхода.
+    TestCard* c = new TestCard( EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK );
+    bool ok = ( c->sd.initialize() != EC_MICRO_SD_TYPE::ERROR );
+
+    static MicrosdSchedulerCfg cfg = { &c->sd, 50, 200, 1, 1 };
+    MicrosdScheduler* q = new MicrosdScheduler( &cfg );
+
+    std::vector< uint8_t > shadow( c->mem );
+    uint32_t bad[ 4 ] = {};
+    std::vector< std::thread > th;
+    for ( uint32_t i = 0; i < 4; i++ ) {
+        th.emplace_back( [ &, i ] { bad[ i ] = randomOps( q, shadow, i * AREA_SECTORS, 300 ); } );
+    }
+    for ( auto& t : th ) {
+        t.join();
+    }
+
+    ok = ok && ( bad[ 0 ] + bad[ 1 ] + bad[ 2 ] + bad[ 3 ] == 0 );
+    ok = ok && ( c->sd.waitWriteDone( 100 ) == EC_SD_RESULT::OK ) && ( c->mem == shadow );
+
+    check( ok, "scheduler" );
+}
+
+int main ( void ) {
+    srand( 1 );
+
+    testAddressing();
+    testCrcRetry();
+    testDiscard();
+    testTuning();
+    testWarmInit();
+
+    testCache();
+    testPrefetch();
+    testCoalesce();
+    testScheduler();
+
+    printf( "%s\n", ( failures == 0 ) ? "all passed" : "FAILED" );
+
+    /// Задачи модулей не завершаются: выходим без деструкторов статических объектов.
+    fflush( stdout );
+    _exit( ( failures == 0 ) ? 0 : 1 );
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// Конфигурация для сборки проверок на хосте (Linux).
+#define MODULE_MICROSD_CARD_SPI_ENABLED
+#define MODULE_MICROSD_CARD_EMULATOR_ENABLED
+#define MODULE_MICROSD_CACHE_ENABLED
+#define MODULE_MICROSD_PREFETCH_ENABLED
+#define MODULE_MICROSD_COALESCE_ENABLED
+#define MODULE_MICROSD_SCHEDULER_ENABLED
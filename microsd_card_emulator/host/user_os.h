@@ -0,0 +1,109 @@
+#pragma once
+
+/*!
+ * Заглушка user_os.h для сборки драйверов на хосте (Linux) вместе с MicrosdEmulator.
+ * Реализует только то подмножество макросов, которое используют драйверы microsd.
+ * Каталог с этим файлом должен стоять в путях поиска раньше "настоящего" user_os.
+ */
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define pdTRUE								( 1 )
+#define pdFALSE								( 0 )
+#define portMAX_DELAY						( 0xFFFFFFFFUL )
+
+// Как и mutex FreeRTOS, не рекурсивный: повторный захват из той же задачи
+// должен зависнуть на хосте так же, как на плате.
+struct UserOsHostMutex {
+	std::timed_mutex				m;
+};
+
+typedef UserOsHostMutex				USER_OS_STATIC_MUTEX_BUFFER;
+typedef UserOsHostMutex*			USER_OS_STATIC_MUTEX;
+
+inline USER_OS_STATIC_MUTEX userOsHostMutexCreate ( USER_OS_STATIC_MUTEX_BUFFER* b ) {
+	return b;
+}
+
+inline int userOsHostTakeMutex ( USER_OS_STATIC_MUTEX m, uint32_t timeoutMs ) {
+	if ( timeoutMs == portMAX_DELAY ) {
+		m->m.lock();
+		return pdTRUE;
+	}
+	return m->m.try_lock_for( std::chrono::milliseconds( timeoutMs ) ) ? pdTRUE : pdFALSE;
+}
+
+inline void userOsHostGiveMutex ( USER_OS_STATIC_MUTEX m ) {
+	m->m.unlock();
+}
+
+inline uint32_t userOsHostGetTickCount ( void ) {
+	static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	return ( uint32_t )std::chrono::duration_cast< std::chrono::milliseconds >(
+		std::chrono::steady_clock::now() - start ).count();
+}
+
+#define USER_OS_STATIC_MUTEX_CREATE(b)		userOsHostMutexCreate( b )
+#define USER_OS_TAKE_MUTEX(m,t)				userOsHostTakeMutex( m, t )
+#define USER_OS_GIVE_MUTEX(m)				userOsHostGiveMutex( m )
+
+#define USER_OS_DELAY_MS(ms)				std::this_thread::sleep_for( std::chrono::milliseconds( ms ) )
+#define USER_OS_GET_TICK_COUNT()			userOsHostGetTickCount()
+
+//**********************************************************************
+// Двоичный семафор.
+//**********************************************************************
+struct UserOsHostBinSemaphore {
+	std::mutex					m;
+	std::condition_variable		cv;
+	bool						given		= false;
+};
+
+typedef UserOsHostBinSemaphore		USER_OS_STATIC_BIN_SEMAPHORE_BUFFER;
+typedef UserOsHostBinSemaphore*		USER_OS_STATIC_BIN_SEMAPHORE;
+
+inline int userOsHostTakeBinSemaphore ( USER_OS_STATIC_BIN_SEMAPHORE s, uint32_t timeoutMs ) {
+	std::unique_lock< std::mutex > l( s->m );
+	if ( timeoutMs == portMAX_DELAY ) {
+		s->cv.wait( l, [ s ] { return s->given; } );
+	} else if ( !s->cv.wait_for( l, std::chrono::milliseconds( timeoutMs ), [ s ] { return s->given; } ) ) {
+		return pdFALSE;
+	}
+	s->given = false;
+	return pdTRUE;
+}
+
+// notify_one под блокировкой: семафор может лежать на стеке ожидающей задачи,
+// которая сразу после пробуждения выходит из области видимости.
+inline int userOsHostGiveBinSemaphore ( USER_OS_STATIC_BIN_SEMAPHORE s ) {
+	std::lock_guard< std::mutex > l( s->m );
+	s->given = true;
+	s->cv.notify_one();
+	return pdTRUE;
+}
+
+#define USER_OS_STATIC_BIN_SEMAPHORE_CREATE(b)		( b )
+#define USER_OS_TAKE_BIN_SEMAPHORE(s,t)				userOsHostTakeBinSemaphore( s, t )
+#define USER_OS_GIVE_BIN_SEMAPHORE(s)				userOsHostGiveBinSemaphore( s )
+#define USER_OS_GIVE_BIN_SEMAPHORE_FROM_ISR(s,w)	( ( void )( w ), userOsHostGiveBinSemaphore( s ) )
+
+//**********************************************************************
+// Задачи (на хосте - потоки, стек и приоритет игнорируются).
+//**********************************************************************
+typedef uint32_t					USER_OS_STATIC_STACK_TYPE;
+typedef std::thread*				USER_OS_STATIC_TASK_STRUCT_TYPE;
+
+inline int userOsHostTaskCreate ( void ( *func )( void* ), void* param, USER_OS_STATIC_TASK_STRUCT_TYPE* task ) {
+	*task = new std::thread( func, param );
+	( *task )->detach();
+	return pdTRUE;
+}
+
+#define USER_OS_STATIC_TASK_CREATE(func,name,stackSize,param,prio,stack,task)	\
+		userOsHostTaskCreate( func, param, task )
+
+#define USER_OS_TASK_YIELD()						std::this_thread::yield()
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "project_config.h"
+
+#ifdef MODULE_MICROSD_CARD_EMULATOR_ENABLED
+
+#include "mc_spi.h"
+#include "mc_pin.h"
+
+/*!
+ * Эмулятор microsd карты в режиме SPI.
+ * Подставляется вместо SpiMaster8BitBase и PinBase (CS) в microsdSpiCfg,
+ * что позволяет запускать MicrosdSpi на хосте (без железа) и считать
+ * количество переданных по шине байт.
+ */
+
+enum class EC_MICROSD_EMULATOR_TYPE {
+	SD1				=	0,		// SD ver 1 (байтовая адресация, CMD8 не поддерживается).
+	SD2				=	1,		// SD ver 2 SDSC (байтовая адресация).
+	SD2_BLOCK		=	2		// SDHC/SDXC (блочная адресация).
+};
+
+struct MicrosdEmulatorCfg {
+	EC_MICROSD_EMULATOR_TYPE	type;
+	uint8_t*					memory;				// Содержимое карты (sectorCount * 512 байт).
+	uint32_t					sectorCount;
+
+	uint8_t						ncr;				// Сколько 0xFF отдать перед R1 (1..8).
+	uint8_t						nac;				// Сколько 0xFF отдать перед маркером данных.
+	uint16_t					busyBytes;			// Сколько байт карта держит busy после записи блока.
+	uint16_t					acmd41Count;		// Сколько ACMD41 карта отвечает "idle".
+
+	uint32_t					corruptEvery;		// Искажать каждый N-й блок данных (0 - не искажать).
+
+	/// Имитация предела частоты платы: при prescaler (setPrescaler) не больше этого
+	/// значения искажаются все блоки данных (0 - не искажать).
+	uint32_t					unstablePrescaler;
+
+	uint32_t					serial;				// Серийный номер (PSN) в CID.
+
+	/// Только SD1/SD2: блок READ_BL_LEN/WRITE_BL_LEN 1024 или 2048 байт и ERASE_BLK_EN = 0,
+	/// как у части карт 2 ГБ. CMD38 стирает целиком все группы по SECTOR_SIZE + 1 блоков,
+	/// которых касается диапазон. 0 - блок 512 байт, ERASE_BLK_EN = 1.
+	uint16_t					blockLen;
+};
+
+/// Статистика обмена. Считается с момента создания или resetStat.
+struct MicrosdEmulatorStat {
+	uint32_t		bytes;						// Байт, прошедших по шине (в обе стороны одновременно).
+	uint32_t		transactions;				// Вызовов tx/rx/txOneItem.
+	uint32_t		csAssertions;				// Сколько раз CS прижимался.
+	uint32_t		commands;					// Принятых карточкой команд.
+	uint32_t		blocksRead;
+	uint32_t		blocksWritten;
+	uint32_t		crcErrors;					// Блоков записи, отвергнутых по CRC.
+	uint32_t		blocksErased;				// CMD38 (стертые блоки заполняются 0x00).
+	uint32_t		switches;					// CMD6 с переключением в High Speed.
+};
+
+class MicrosdEmulator : public SpiMaster8BitBase {
+public:
+	MicrosdEmulator ( const MicrosdEmulatorCfg* const cfg );
+
+	BASE_RESULT		reinit				( void );
+	void			on					( void );
+	void			off					( void );
+	BASE_RESULT		tx					( const uint8_t* const txArray, uint16_t length = 1, uint32_t timeoutMs = 100 );
+	BASE_RESULT		tx					( const uint8_t* const txArray, uint8_t* rxArray, uint16_t length = 1, uint32_t timeoutMs = 100 );
+	BASE_RESULT		txOneItem			( uint8_t txByte, uint16_t count = 1, uint32_t timeoutMs = 100 );
+	BASE_RESULT		rx					( uint8_t* rxArray, uint16_t length = 1, uint32_t timeoutMs = 100, uint8_t outValue = 0xFF );
+	BASE_RESULT		setPrescaler		( uint32_t prescalerValue );
+
+	// Управление линией CS (вызывается через MicrosdEmulatorCs).
+	void			setCs				( bool state );
+
+	// Сброс карты в состояние "после подачи питания".
+	void			powerOn				( void );
+
+	const MicrosdEmulatorStat&	getStat	( void );
+	void			resetStat			( void );
+
+	uint32_t		getPrescaler		( void );
+
+private:
+	enum class STATE {
+		CMD,					// Ожидание/прием команды.
+		READ_MULTI,				// CMD18: карта непрерывно выдает блоки.
+		WRITE_WAIT_TOKEN,		// CMD24/CMD25: ожидание маркера от хоста.
+		WRITE_DATA				// Прием блока данных.
+	};
+
+	// Обмен одним байтом (MOSI -> MISO).
+	uint8_t			exchange			( uint8_t mosi );
+
+	void			execCmd				( void );
+	void			execAcmd			( uint8_t cmd, uint32_t arg );
+
+	void			pushOut				( uint8_t v );
+	void			pushFill			( uint8_t v, uint32_t count );
+	void			pushR1				( uint8_t r1 );
+	void			pushDataBlock		( const uint8_t* data, uint16_t len );
+
+	// Пора ли исказить очередной блок данных.
+	bool			corruptNext			( void );
+
+	// Частота выше той, что выдерживает "плата" (cfg->unstablePrescaler).
+	bool			unstableClock		( void );
+
+	// Блок CSD (READ_BL_LEN/WRITE_BL_LEN) в секторах: 1, 2 или 4.
+	uint32_t		getBlockSectors		( void );
+
+	// Проверяет адрес и переводит его в номер сектора.
+	bool			getSector			( uint32_t arg, uint32_t& sector );
+
+	uint8_t			getR1Idle			( void );
+
+	static uint16_t	crc16				( const uint8_t* data, uint32_t len );
+
+	const MicrosdEmulatorCfg*		const cfg;
+
+	MicrosdEmulatorStat				stat;
+
+	bool							cs				= true;
+	bool							idle			= true;
+	bool							appCmd			= false;
+	bool							crcOn			= false;		// CMD59.
+	bool							highSpeed		= false;		// CMD6.
+	uint32_t						dataBlocks		= 0;			// Для искажения каждого N-го блока.
+	uint16_t						acmd41Left		= 0;
+	uint32_t						prescaler		= 0;
+
+	STATE							state			= STATE::CMD;
+
+	uint8_t							cmdBuf[6];
+	uint8_t							cmdLen			= 0;
+
+	// Данные, которые карта отдаст на MISO.
+	static const uint32_t			OUT_SIZE		= 1024;
+	uint8_t							out[OUT_SIZE];
+	uint32_t						outHead			= 0;
+	uint32_t						outCount		= 0;
+
+	uint32_t						curSector		= 0;
+	bool							multiWrite		= false;
+
+	uint32_t						busyLeft		= 0;		// Байт до окончания busy.
+
+	// CMD32/CMD33: диапазон стирания (в секторах).
+	static const uint32_t			ERASE_NONE		= 0xFFFFFFFF;
+	uint32_t						eraseStart		= ERASE_NONE;
+	uint32_t						eraseEnd		= ERASE_NONE;
+
+	uint8_t							wrBuf[512 + 2];
+	uint16_t						wrLen			= 0;
+};
+
+/// Вывод CS эмулятора.
+class MicrosdEmulatorCs : public PinBase {
+public:
+	MicrosdEmulatorCs ( MicrosdEmulator* const card ) : card( card ) {}
+
+	void	set				( void )				{ this->state = true;	this->card->setCs( true ); }
+	void	reset			( void )				{ this->state = false;	this->card->setCs( false ); }
+	void	toggle			( void )				{ this->set( !this->state ); }
+	void	set				( bool state )			{ if ( state ) { this->set(); } else { this->reset(); } }
+	void	set				( int state )			{ this->set( state != 0 ); }
+	void	set				( uint8_t state )		{ this->set( state != 0 ); }
+	bool	read			( void )				{ return this->state; }
+
+private:
+	MicrosdEmulator*		const card;
+	bool					state		= true;
+};
+
+#endif
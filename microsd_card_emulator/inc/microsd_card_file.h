@@ -0,0 +1,37 @@
+#pragma once
+
+#include "project_config.h"
+
+#ifdef MODULE_MICROSD_CARD_FILE_ENABLED
+
+#include <stdio.h>
+#include "user_os.h"
+#include "microsd_base.h"
+
+/*!
+ * Карта поверх файла-образа (только для хоста).
+ * Нужна, чтобы прогонять верхние уровни (кэш, бенчмарк, FatFs) без эмуляции протокола.
+ */
+class MicrosdFile : public MicrosdBase {
+public:
+    MicrosdFile ( const char* path, uint32_t sectorCount );
+    ~MicrosdFile ( void );
+
+    EC_MICRO_SD_TYPE	initialize					( void );
+    EC_MICRO_SD_TYPE	getType						( void );
+    EC_SD_RESULT		readSector					( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms  );
+    EC_SD_RESULT		writeSector					( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms  );
+    EC_SD_STATUS		getStatus					( void );
+    EC_SD_RESULT		getSectorCount				( uint32_t& sectorCount );
+    EC_SD_RESULT		getBlockSize				( uint32_t& blockSize );
+
+private:
+    const char*					const path;
+    const uint32_t				sectorCount;
+    FILE*						f				= nullptr;
+
+    USER_OS_STATIC_MUTEX_BUFFER	mb;
+    USER_OS_STATIC_MUTEX		m				= nullptr;
+};
+
+#endif
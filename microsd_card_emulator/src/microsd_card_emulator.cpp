@@ -0,0 +1,607 @@
+#include "microsd_card_emulator.h"
+
+#ifdef MODULE_MICROSD_CARD_EMULATOR_ENABLED
+
+#include <string.h>
+
+#define CMD0		( 0 )
+#define CMD1		( 1 )
+#define CMD6		( 6 )
+#define CMD8		( 8 )
+#define CMD9		( 9 )
+#define CMD10		( 10 )
+#define CMD12		( 12 )
+#define CMD13		( 13 )
+#define CMD16		( 16 )
+#define CMD17		( 17 )
+#define CMD18		( 18 )
+#define CMD24		( 24 )
+#define CMD25		( 25 )
+#define CMD32		( 32 )
+#define CMD33		( 33 )
+#define CMD38		( 38 )
+#define CMD55		( 55 )
+#define CMD58		( 58 )
+#define CMD59		( 59 )
+
+#define ACMD13		( 13 )
+#define ACMD23		( 23 )
+#define ACMD41		( 41 )
+
+#define R1_IDLE						( 1 << 0 )
+#define R1_ERASE_SEQ_ERROR			( 1 << 4 )
+#define R1_ILLEGAL_COMMAND			( 1 << 2 )
+#define R1_ADDRESS_ERROR			( 1 << 5 )
+#define R1_PARAMETER_ERROR			( 1 << 6 )
+
+#define DATA_MARK					( 0xFE )
+#define CMD25_MARK					( 0xFC )
+#define STOP_TRAN_MARK				( 0xFD )
+
+#define DATA_RESPONSE_ACCEPTED		( 0x05 )
+#define DATA_RESPONSE_CRC_ERROR		( 0x0B )
+
+MicrosdEmulator::MicrosdEmulator ( const MicrosdEmulatorCfg* const cfg ) : cfg( cfg ) {
+    this->resetStat();
+    this->powerOn();
+}
+
+void MicrosdEmulator::powerOn ( void ) {
+    this->idle			= true;
+    this->appCmd		= false;
+    this->crcOn			= false;
+    this->highSpeed		= false;
+    this->acmd41Left	= this->cfg->acmd41Count;
+    this->state			= STATE::CMD;
+    this->cmdLen		= 0;
+    this->outHead		= 0;
+    this->outCount		= 0;
+    this->busyLeft		= 0;
+    this->wrLen			= 0;
+    this->eraseStart	= ERASE_NONE;
+    this->eraseEnd		= ERASE_NONE;
+}
+
+const MicrosdEmulatorStat& MicrosdEmulator::getStat ( void ) {
+    return this->stat;
+}
+
+void MicrosdEmulator::resetStat ( void ) {
+    memset( &this->stat, 0, sizeof( this->stat ) );
+}
+
+uint32_t MicrosdEmulator::getPrescaler ( void ) {
+    return this->prescaler;
+}
+
+//**********************************************************************
+// SpiMaster8BitBase.
+//**********************************************************************
+BASE_RESULT MicrosdEmulator::reinit ( void ) {
+    return BASE_RESULT::OK;
+}
+
+void MicrosdEmulator::on ( void ) {}
+void MicrosdEmulator::off ( void ) {}
+
+BASE_RESULT MicrosdEmulator::tx ( const uint8_t* const txArray, uint16_t length, uint32_t timeoutMs ) {
+    ( void )timeoutMs;
+    this->stat.transactions++;
+    this->stat.bytes += length;
+    for ( uint16_t i = 0; i < length; i++ ) {
+        this->exchange( txArray[ i ] );
+    }
+    return BASE_RESULT::OK;
+}
+
+BASE_RESULT MicrosdEmulator::tx ( const uint8_t* const txArray, uint8_t* rxArray, uint16_t length, uint32_t timeoutMs ) {
+    ( void )timeoutMs;
+    this->stat.transactions++;
+    this->stat.bytes += length;
+    for ( uint16_t i = 0; i < length; i++ ) {
+        rxArray[ i ] = this->exchange( txArray[ i ] );
+    }
+    return BASE_RESULT::OK;
+}
+
+BASE_RESULT MicrosdEmulator::txOneItem ( uint8_t txByte, uint16_t count, uint32_t timeoutMs ) {
+    ( void )timeoutMs;
+    this->stat.transactions++;
+    this->stat.bytes += count;
+    for ( uint16_t i = 0; i < count; i++ ) {
+        this->exchange( txByte );
+    }
+    return BASE_RESULT::OK;
+}
+
+BASE_RESULT MicrosdEmulator::rx ( uint8_t* rxArray, uint16_t length, uint32_t timeoutMs, uint8_t outValue ) {
+    ( void )timeoutMs;
+    this->stat.transactions++;
+    this->stat.bytes += length;
+    for ( uint16_t i = 0; i < length; i++ ) {
+        rxArray[ i ] = this->exchange( outValue );
+    }
+    return BASE_RESULT::OK;
+}
+
+BASE_RESULT MicrosdEmulator::setPrescaler ( uint32_t prescalerValue ) {
+    this->prescaler = prescalerValue;
+    return BASE_RESULT::OK;
+}
+
+void MicrosdEmulator::setCs ( bool state ) {
+    if ( this->cs && !state ) {
+        this->stat.csAssertions++;
+    }
+    this->cs = state;
+    this->cmdLen = 0;				// Недопринятая команда теряется.
+}
+
+//**********************************************************************
+// Очередь ответа карты.
+//**********************************************************************
+void MicrosdEmulator::pushOut ( uint8_t v ) {
+    if ( this->outCount == OUT_SIZE ) return;
+    this->out[ ( this->outHead + this->outCount ) % OUT_SIZE ] = v;
+    this->outCount++;
+}
+
+void MicrosdEmulator::pushFill ( uint8_t v, uint32_t count ) {
+    for ( uint32_t i = 0; i < count; i++ ) {
+        this->pushOut( v );
+    }
+}
+
+void MicrosdEmulator::pushR1 ( uint8_t r1 ) {
+    this->pushFill( 0xFF, this->cfg->ncr );
+    this->pushOut( r1 );
+}
+
+bool MicrosdEmulator::corruptNext ( void ) {
+    if ( this->cfg->corruptEvery == 0 ) return false;
+    this->dataBlocks++;
+    return ( this->dataBlocks % this->cfg->corruptEvery ) == 0;
+}
+
+uint32_t MicrosdEmulator::getBlockSectors ( void ) {
+    if ( this->cfg->type == EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK )	return 1;
+    if ( ( this->cfg->blockLen == 1024 ) || ( this->cfg->blockLen == 2048 ) )	return this->cfg->blockLen / 512;
+    return 1;
+}
+
+bool MicrosdEmulator::unstableClock ( void ) {
+    return ( this->cfg->unstablePrescaler != 0 ) && ( this->prescaler <= this->cfg->unstablePrescaler );
+}
+
+void MicrosdEmulator::pushDataBlock ( const uint8_t* data, uint16_t len ) {
+    this->pushFill( 0xFF, this->cfg->nac );
+    this->pushOut( DATA_MARK );
+    uint16_t crc = crc16( data, len );
+    bool corrupt = ( ( len == 512 ) && this->corruptNext() ) || this->unstableClock();
+    for ( uint16_t i = 0; i < len; i++ ) {
+        // Имитация помехи на линии: CRC считана с правильных данных.
+        this->pushOut( ( corrupt && ( i == len / 2 ) ) ? ( uint8_t )( data[ i ] ^ 0x10 ) : data[ i ] );
+    }
+    this->pushOut( ( uint8_t )( crc >> 8 ) );
+    this->pushOut( ( uint8_t )crc );
+}
+
+uint16_t MicrosdEmulator::crc16 ( const uint8_t* data, uint32_t len ) {
+    uint16_t crc = 0;
+    for ( uint32_t i = 0; i < len; i++ ) {
+        crc ^= ( uint16_t )data[ i ] << 8;
+        for ( int b = 0; b < 8; b++ ) {
+            crc = ( crc & 0x8000 ) ? ( uint16_t )( ( crc << 1 ) ^ 0x1021 ) : ( uint16_t )( crc << 1 );
+        }
+    }
+    return crc;
+}
+
+//**********************************************************************
+// Протокол.
+//**********************************************************************
+uint8_t MicrosdEmulator::exchange ( uint8_t mosi ) {
+    // Программирование flash идет независимо от CS.
+    if ( this->cs ) {
+        if ( ( this->outCount == 0 ) && ( this->busyLeft > 0 ) ) {
+            this->busyLeft--;
+        }
+        return 0xFF;
+    }
+
+    uint8_t miso = 0xFF;
+
+    if ( ( this->outCount == 0 ) && ( this->state == STATE::READ_MULTI ) ) {
+        if ( this->curSector < this->cfg->sectorCount ) {
+            this->pushDataBlock( &this->cfg->memory[ this->curSector * 512 ], 512 );
+            this->curSector++;
+            this->stat.blocksRead++;
+        }
+    }
+
+    if ( this->outCount ) {
+        miso = this->out[ this->outHead ];
+        this->outHead = ( this->outHead + 1 ) % OUT_SIZE;
+        this->outCount--;
+    } else if ( this->busyLeft > 0 ) {
+        this->busyLeft--;
+        miso = 0x00;
+    }
+
+    switch ( this->state ) {
+    case STATE::CMD:
+    case STATE::READ_MULTI:
+        if ( this->cmdLen == 0 ) {
+            if ( ( mosi & 0xC0 ) != 0x40 ) break;					// Старт бит + бит передачи.
+        }
+        this->cmdBuf[ this->cmdLen++ ] = mosi;
+        if ( this->cmdLen == 6 ) {
+            this->cmdLen = 0;
+            this->execCmd();
+        }
+        break;
+
+    case STATE::WRITE_WAIT_TOKEN:
+        if ( ( this->outCount != 0 ) || ( this->busyLeft != 0 ) ) break;
+        if ( ( mosi == DATA_MARK ) && !this->multiWrite ) {
+            this->state = STATE::WRITE_DATA;
+            this->wrLen = 0;
+        } else if ( ( mosi == CMD25_MARK ) && this->multiWrite ) {
+            this->state = STATE::WRITE_DATA;
+            this->wrLen = 0;
+        } else if ( ( mosi == STOP_TRAN_MARK ) && this->multiWrite ) {
+            this->pushOut( 0xFF );
+            this->busyLeft = this->cfg->busyBytes;
+            this->state = STATE::CMD;
+        }
+        break;
+
+    case STATE::WRITE_DATA:
+        this->wrBuf[ this->wrLen++ ] = mosi;
+        if ( this->wrLen == sizeof( this->wrBuf ) ) {
+            bool corrupt = this->corruptNext() || this->unstableClock();
+            if ( this->crcOn ) {
+                uint16_t crc = ( uint16_t )( ( this->wrBuf[ 512 ] << 8 ) | this->wrBuf[ 513 ] );
+                if ( crc != crc16( this->wrBuf, 512 ) ) corrupt = true;
+            } else {
+                corrupt = false;				// Без CRC искажение не обнаружить.
+            }
+
+            if ( corrupt ) {
+                this->stat.crcErrors++;
+                this->pushOut( DATA_RESPONSE_CRC_ERROR );
+                this->busyLeft = 1;
+            } else {
+                if ( this->curSector < this->cfg->sectorCount ) {
+                    memcpy( &this->cfg->memory[ this->curSector * 512 ], this->wrBuf, 512 );
+                    this->stat.blocksWritten++;
+                }
+                this->curSector++;
+                this->pushOut( DATA_RESPONSE_ACCEPTED );
+                this->busyLeft = this->cfg->busyBytes;
+            }
+            this->state = this->multiWrite ? STATE::WRITE_WAIT_TOKEN : STATE::CMD;
+        }
+        break;
+    }
+
+    return miso;
+}
+
+uint8_t MicrosdEmulator::getR1Idle ( void ) {
+    return this->idle ? R1_IDLE : 0;
+}
+
+bool MicrosdEmulator::getSector ( uint32_t arg, uint32_t& sector ) {
+    if ( this->cfg->type == EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK ) {
+        sector = arg;
+    } else {
+        if ( arg % 512 ) return false;
+        sector = arg / 512;
+    }
+    return sector < this->cfg->sectorCount;
+}
+
+// Устанавливает значение поля регистра (CSD), где bit 0 - младший бит последнего байта.
+static void setBits ( uint8_t* reg, uint32_t regLen, uint32_t start, uint32_t len, uint32_t value ) {
+    for ( uint32_t i = 0; i < len; i++ ) {
+        uint32_t bit = start + i;
+        uint32_t byte = regLen - 1 - bit / 8;
+        if ( value & ( 1UL << i ) ) {
+            reg[ byte ] |= ( uint8_t )( 1 << ( bit % 8 ) );
+        } else {
+            reg[ byte ] &= ( uint8_t )~( 1 << ( bit % 8 ) );
+        }
+    }
+}
+
+void MicrosdEmulator::execCmd ( void ) {
+    uint8_t cmd = this->cmdBuf[ 0 ] & 0x3F;
+    uint32_t arg =	( ( uint32_t )this->cmdBuf[ 1 ] << 24 ) | ( ( uint32_t )this->cmdBuf[ 2 ] << 16 ) |
+                    ( ( uint32_t )this->cmdBuf[ 3 ] << 8 ) | this->cmdBuf[ 4 ];
+
+    // Во время программирования карта команды не принимает.
+    if ( this->busyLeft ) return;
+
+    this->stat.commands++;
+
+    // Остановка CMD18 - все, что карта собиралась передать, пропадает.
+    if ( this->state == STATE::READ_MULTI ) {
+        if ( cmd != CMD12 ) return;
+        this->outHead = 0;
+        this->outCount = 0;
+        this->pushOut( 0xFF );										// "Мусорный" байт после CMD12.
+        this->pushR1( 0 );
+        this->busyLeft = 4;
+        this->state = STATE::CMD;
+        return;
+    }
+
+    if ( this->appCmd ) {
+        this->appCmd = false;
+        this->execAcmd( cmd, arg );
+        return;
+    }
+
+    uint32_t sector;
+
+    switch ( cmd ) {
+    case CMD0:
+        this->powerOn();
+        this->pushR1( R1_IDLE );
+        break;
+
+    case CMD1:
+        this->pushR1( this->getR1Idle() );
+        break;
+
+    case CMD6: {
+        /// SD1 эмулирует карту до SD 1.10 - CMD6 у нее нет.
+        if ( this->idle || ( this->cfg->type == EC_MICROSD_EMULATOR_TYPE::SD1 ) ) {
+            this->pushR1( this->getR1Idle() | R1_ILLEGAL_COMMAND );
+            break;
+        }
+        uint8_t fn = arg & 0xF;
+        uint8_t status[64] = { 0 };
+        status[ 1 ]		= 100;											// Потребление: 100 мА.
+        status[ 12 ]	= 0x80;											// Группа 1: Default и High Speed.
+        status[ 13 ]	= 0x03;
+        if ( fn == 0xF ) {
+            fn = this->highSpeed ? 1 : 0;								// Без изменения - текущая функция.
+        } else if ( fn > 1 ) {
+            fn = 0xF;
+        }
+        status[ 16 ]	= fn;
+        if ( ( arg & 0x80000000 ) && ( fn != 0xF ) ) {
+            if ( ( fn == 1 ) && !this->highSpeed ) {
+                this->stat.switches++;
+            }
+            this->highSpeed = ( fn == 1 );
+        }
+        this->pushR1( 0 );
+        this->pushDataBlock( status, 64 );
+        break;
+    }
+
+    case CMD8:
+        if ( this->cfg->type == EC_MICROSD_EMULATOR_TYPE::SD1 ) {
+            this->pushR1( this->getR1Idle() | R1_ILLEGAL_COMMAND );
+        } else {
+            this->pushR1( this->getR1Idle() );
+            this->pushOut( 0 );
+            this->pushOut( 0 );
+            this->pushOut( ( uint8_t )( ( arg >> 8 ) & 0x0F ) );
+            this->pushOut( ( uint8_t )arg );
+        }
+        break;
+
+    case CMD9: {
+        if ( this->idle ) {
+            this->pushR1( R1_IDLE | R1_ILLEGAL_COMMAND );
+            break;
+        }
+        uint32_t blockSectors = this->getBlockSectors();
+        uint32_t blLen = ( blockSectors == 4 ) ? 11 : ( ( blockSectors == 2 ) ? 10 : 9 );
+
+        uint8_t csd[16] = { 0 };
+        setBits( csd, 16, 96, 8, 0x32 );								// TRAN_SPEED: 25 МГц.
+        setBits( csd, 16, 84, 12, 0x5B5 );								// CCC.
+        setBits( csd, 16, 80, 4, blLen );								// READ_BL_LEN.
+        setBits( csd, 16, 46, 1, ( blockSectors == 1 ) ? 1 : 0 );		// ERASE_BLK_EN.
+        setBits( csd, 16, 39, 7, 0x7F );								// SECTOR_SIZE.
+        setBits( csd, 16, 22, 4, blLen );								// WRITE_BL_LEN.
+        if ( this->cfg->type == EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK ) {
+            setBits( csd, 16, 126, 2, 1 );								// CSD ver 2.0.
+            setBits( csd, 16, 48, 22, this->cfg->sectorCount / 1024 - 1 );	// C_SIZE (блоки по 512 КиБ).
+        } else {
+            setBits( csd, 16, 47, 3, 7 );								// C_SIZE_MULT: 512.
+            setBits( csd, 16, 62, 12, this->cfg->sectorCount / ( 512 * blockSectors ) - 1 );
+        }
+        csd[ 15 ] = 1;
+        this->pushR1( 0 );
+        this->pushDataBlock( csd, 16 );
+        break;
+    }
+
+    case CMD10: {
+        if ( this->idle ) {
+            this->pushR1( R1_IDLE | R1_ILLEGAL_COMMAND );
+            break;
+        }
+        uint8_t cid[16] = { 0x03, 'E', 'M', 'E', 'M', 'U', 'S', 'D', 0x10 };	// MID, OID, PNM, PRV.
+        cid[ 9 ]	= ( uint8_t )( this->cfg->serial >> 24 );					// PSN.
+        cid[ 10 ]	= ( uint8_t )( this->cfg->serial >> 16 );
+        cid[ 11 ]	= ( uint8_t )( this->cfg->serial >> 8 );
+        cid[ 12 ]	= ( uint8_t )this->cfg->serial;
+        cid[ 15 ]	= 1;
+        this->pushR1( 0 );
+        this->pushDataBlock( cid, 16 );
+        break;
+    }
+
+    case CMD12:
+        this->pushR1( this->getR1Idle() );
+        break;
+
+    case CMD13:
+        this->pushR1( this->getR1Idle() );
+        this->pushOut( 0 );
+        break;
+
+    case CMD16:
+        this->pushR1( ( arg == 512 ) ? this->getR1Idle() : ( this->getR1Idle() | R1_PARAMETER_ERROR ) );
+        break;
+
+    case CMD17:
+    case CMD18:
+        if ( this->idle ) {
+            this->pushR1( R1_IDLE | R1_ILLEGAL_COMMAND );
+            break;
+        }
+        if ( !this->getSector( arg, sector ) ) {
+            this->pushR1( R1_ADDRESS_ERROR );
+            break;
+        }
+        this->pushR1( 0 );
+        if ( cmd == CMD17 ) {
+            this->pushDataBlock( &this->cfg->memory[ sector * 512 ], 512 );
+            this->stat.blocksRead++;
+        } else {
+            this->curSector = sector;
+            this->state = STATE::READ_MULTI;
+        }
+        break;
+
+    case CMD24:
+    case CMD25:
+        if ( this->idle ) {
+            this->pushR1( R1_IDLE | R1_ILLEGAL_COMMAND );
+            break;
+        }
+        if ( !this->getSector( arg, sector ) ) {
+            this->pushR1( R1_ADDRESS_ERROR );
+            break;
+        }
+        this->pushR1( 0 );
+        this->curSector = sector;
+        this->multiWrite = ( cmd == CMD25 );
+        this->state = STATE::WRITE_WAIT_TOKEN;
+        break;
+
+    case CMD32:
+    case CMD33:
+        if ( this->idle ) {
+            this->pushR1( R1_IDLE | R1_ILLEGAL_COMMAND );
+            break;
+        }
+        if ( !this->getSector( arg, sector ) ) {
+            this->pushR1( R1_ADDRESS_ERROR );
+            break;
+        }
+        if ( cmd == CMD32 ) {
+            this->eraseStart	= sector;
+            this->eraseEnd		= ERASE_NONE;
+        } else {
+            this->eraseEnd		= sector;
+        }
+        this->pushR1( 0 );
+        break;
+
+    case CMD38:
+        if ( ( this->eraseStart == ERASE_NONE ) || ( this->eraseEnd == ERASE_NONE ) ||
+             ( this->eraseEnd < this->eraseStart ) ) {
+            this->pushR1( R1_ERASE_SEQ_ERROR );
+            break;
+        }
+        /// Без ERASE_BLK_EN карта стирает группы целиком.
+        if ( this->getBlockSectors() != 1 ) {
+            uint32_t group = 128 * this->getBlockSectors();
+            this->eraseStart	= this->eraseStart / group * group;
+            this->eraseEnd		= this->eraseEnd / group * group + group - 1;
+            if ( this->eraseEnd >= this->cfg->sectorCount ) {
+                this->eraseEnd = this->cfg->sectorCount - 1;
+            }
+        }
+        memset( &this->cfg->memory[ this->eraseStart * 512 ], 0, ( this->eraseEnd - this->eraseStart + 1 ) * 512 );
+        this->stat.blocksErased += this->eraseEnd - this->eraseStart + 1;
+        this->eraseStart	= ERASE_NONE;
+        this->eraseEnd		= ERASE_NONE;
+        this->pushR1( 0 );
+        this->busyLeft = this->cfg->busyBytes;						// R1b.
+        break;
+
+    case CMD59:
+        this->crcOn = ( arg & 1 ) != 0;
+        this->pushR1( this->getR1Idle() );
+        break;
+
+    case CMD55:
+        this->appCmd = true;
+        this->pushR1( this->getR1Idle() );
+        break;
+
+    case CMD58: {
+        uint32_t ocr = 0x00FF8000;
+        if ( !this->idle ) {
+            ocr |= 1UL << 31;
+            if ( this->cfg->type == EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK ) {
+                ocr |= 1UL << 30;
+            }
+        }
+        this->pushR1( this->getR1Idle() );
+        this->pushOut( ( uint8_t )( ocr >> 24 ) );
+        this->pushOut( ( uint8_t )( ocr >> 16 ) );
+        this->pushOut( ( uint8_t )( ocr >> 8 ) );
+        this->pushOut( ( uint8_t )ocr );
+        break;
+    }
+
+    default:
+        this->pushR1( this->getR1Idle() | R1_ILLEGAL_COMMAND );
+        break;
+    }
+}
+
+void MicrosdEmulator::execAcmd ( uint8_t cmd, uint32_t arg ) {
+    switch ( cmd ) {
+    case ACMD41:
+        // SDHC без HCS никогда не выйдет из idle.
+        if ( ( this->cfg->type == EC_MICROSD_EMULATOR_TYPE::SD2_BLOCK ) && !( arg & ( 1UL << 30 ) ) ) {
+            this->pushR1( R1_IDLE );
+            break;
+        }
+        if ( this->acmd41Left ) {
+            this->acmd41Left--;
+        } else {
+            this->idle = false;
+        }
+        this->pushR1( this->getR1Idle() );
+        break;
+
+    case ACMD23:
+        this->pushR1( this->getR1Idle() );
+        break;
+
+    case ACMD13: {
+        if ( this->idle ) {
+            this->pushR1( R1_IDLE | R1_ILLEGAL_COMMAND );
+            break;
+        }
+        uint8_t sdStatus[64] = { 0 };
+        sdStatus[ 8 ]	= 0x02;											// SPEED_CLASS: class 4.
+        sdStatus[ 10 ]	= 0x90;											// AU_SIZE: 4 МиБ.
+        sdStatus[ 12 ]	= 0x01;											// ERASE_SIZE: 1 AU.
+        sdStatus[ 13 ]	= ( 1 << 2 ) | 1;								// ERASE_TIMEOUT: 1 с, ERASE_OFFSET: 1 с.
+        this->pushR1( 0 );
+        this->pushOut( 0 );												// Второй байт R2.
+        this->pushDataBlock( sdStatus, 64 );
+        break;
+    }
+
+    default:
+        this->pushR1( this->getR1Idle() | R1_ILLEGAL_COMMAND );
+        break;
+    }
+}
+
+#endif
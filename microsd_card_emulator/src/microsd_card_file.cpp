@@ -0,0 +1,87 @@
+#include "microsd_card_file.h"
+
+#ifdef MODULE_MICROSD_CARD_FILE_ENABLED
+
+MicrosdFile::MicrosdFile ( const char* path, uint32_t sectorCount ) : path( path ), sectorCount( sectorCount ) {
+    this->m = USER_OS_STATIC_MUTEX_CREATE( &this->mb );
+}
+
+MicrosdFile::~MicrosdFile ( void ) {
+    if ( this->f != nullptr ) {
+        fclose( this->f );
+    }
+}
+
+EC_MICRO_SD_TYPE MicrosdFile::initialize ( void ) {
+    if ( this->f == nullptr ) {
+        this->f = fopen( this->path, "r+b" );
+    }
+    if ( this->f == nullptr ) {
+        this->f = fopen( this->path, "w+b" );
+    }
+    return this->getType();
+}
+
+EC_MICRO_SD_TYPE MicrosdFile::getType ( void ) {
+    if ( this->f == nullptr ) return EC_MICRO_SD_TYPE::ERROR;
+    return ( EC_MICRO_SD_TYPE )( ( uint32_t )EC_MICRO_SD_TYPE::SD2 | ( uint32_t )EC_MICRO_SD_TYPE::BLOCK );
+}
+
+EC_SD_RESULT MicrosdFile::readSector ( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms ) {
+    ( void )timeout_ms;
+    if ( this->f == nullptr )								return EC_SD_RESULT::NOTRDY;
+    if ( sector + cout_sector > this->sectorCount )			return EC_SD_RESULT::PARERR;
+
+    EC_SD_RESULT r = EC_SD_RESULT::ERROR;
+
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    if ( fseek( this->f, ( long )sector * 512, SEEK_SET ) == 0 ) {
+        // За концом файла - "чистая" карта.
+        size_t n = fread( target_array, 1, cout_sector * 512, this->f );
+        for ( size_t i = n; i < cout_sector * 512; i++ ) {
+            target_array[ i ] = 0xFF;
+        }
+        r = EC_SD_RESULT::OK;
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+EC_SD_RESULT MicrosdFile::writeSector ( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms ) {
+    ( void )timeout_ms;
+    if ( this->f == nullptr )								return EC_SD_RESULT::NOTRDY;
+    if ( sector + cout_sector > this->sectorCount )			return EC_SD_RESULT::PARERR;
+
+    EC_SD_RESULT r = EC_SD_RESULT::ERROR;
+
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    if ( fseek( this->f, ( long )sector * 512, SEEK_SET ) == 0 ) {
+        if ( fwrite( source_array, 1, cout_sector * 512, this->f ) == cout_sector * 512 ) {
+            r = EC_SD_RESULT::OK;
+        }
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+EC_SD_STATUS MicrosdFile::getStatus ( void ) {
+    return ( this->f != nullptr ) ? EC_SD_STATUS::OK : EC_SD_STATUS::NOINIT;
+}
+
+EC_SD_RESULT MicrosdFile::getSectorCount ( uint32_t& sectorCount ) {
+    sectorCount = this->sectorCount;
+    return EC_SD_RESULT::OK;
+}
+
+EC_SD_RESULT MicrosdFile::getBlockSize ( uint32_t& blockSize ) {
+    blockSize = 512;
+    return EC_SD_RESULT::OK;
+}
+
+#endif
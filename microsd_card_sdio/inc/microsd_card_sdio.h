@@ -8,6 +8,21 @@
 #include "user_os.h"
 #include "microsd_base.h"
 
+#ifdef MODULE_MICROSD_STAT_ENABLED
+#include "microsd_stat.h"
+#else
+// Статистика не подключена: ее вызовы в драйвере пустые.
+#define MICROSD_STAT_START(stat,var)
+#define MICROSD_STAT(stat,call)				do {} while ( 0 )
+#endif
+
+#ifdef MODULE_MICROSD_TRACE_ENABLED
+#include "microsd_trace.h"
+#else
+// Трасса не подключена: ее вызовы в драйвере пустые.
+#define MICROSD_TRACE(trace,...)			do {} while ( 0 )
+#endif
+
 #ifdef STM32F2
 #include "stm32f2xx_hal_sd.h"
 #endif
@@ -21,6 +36,30 @@
 #include "dma.h"
 #include "mc_clk.h"
 
+/// Промежуточный буфер для невыравненных (или недоступных DMA) буферов пользователя, в секторах.
+/// Больше буфер - меньше отдельных передач при копировании через него.
+#define MICROSD_SDIO_BOUNCE_SECTORS             ( 4 )
+
+/// Выравнивание промежуточного буфера (строка кэша Cortex-M7, для F2/F4 достаточно 4).
+#define MICROSD_SDIO_BOUNCE_ALIGN               ( 32 )
+
+/// Подбор делителя: эталон и проверочное чтение лежат в промежуточном буфере (по половине).
+#define MICROSD_SDIO_TUNE_SECTORS               ( MICROSD_SDIO_BOUNCE_SECTORS / 2 )
+#define MICROSD_SDIO_TUNE_PASSES                ( 4 )
+
+/// Ожидание блока статуса CMD6.
+#define MICROSD_SDIO_SWITCH_TIMEOUT_MS          ( 100 )
+
+/// Срок инициализации (повторы HAL_SD_InitCard) и пауза между попытками.
+#define MICROSD_SDIO_INIT_TIMEOUT_MS            ( 1000 )
+#define MICROSD_SDIO_INIT_RETRY_MS              ( 10 )
+
+/// Сколько ждать окончания записи при проверке карты перед повторной инициализацией.
+#define MICROSD_SDIO_WARM_BUSY_MS               ( 250 )
+
+/// Стек задачи, запускающей запросы submit.
+#define MICROSD_SDIO_ASYNC_TASK_STACK_SIZE      ( 200 )
+
 struct MicrosdSdioCfg {
     uint32_t wide;                /// SDIO_BUS_WIDE_1B, SDIO_BUS_WIDE_4B, SDIO_BUS_WIDE_8B.
     uint32_t div;
@@ -28,6 +67,35 @@ struct MicrosdSdioCfg {
     DMA_Stream_TypeDef *dmaRx;                /// Из мерии DMAx_Streamx.
     uint32_t dmaRxCh;            /// Из серии DMA_CHANNEL_x.
     uint8_t dmaRxIrqPrio;
+    
+    DMA_Stream_TypeDef *dmaTx;                /// Из мерии DMAx_Streamx.
+    uint32_t dmaTxCh;            /// Из серии DMA_CHANNEL_x.
+    uint8_t dmaTxIrqPrio;
+    
+    uint8_t sdioIrqPrio;        /// Окончание записи по DMA сообщается прерыванием SDIO (DATAEND).
+    
+    bool highSpeed;             /// Перевести карту в High Speed (CMD6), если она это поддерживает.
+    
+    /// Подбор частоты при initialize: делитель уменьшается от div до tuneDiv, пока чтения
+    /// первых секторов совпадают с прочитанными на div (tuneDiv >= div - без подбора).
+    /// SDIO_CK = SDIOCLK / (ClockDiv + 2), т.е. при 48 МГц не более 24 МГц.
+    uint32_t tuneDiv;
+    
+    uint32_t initTimeoutMs;     /// 0 - MICROSD_SDIO_INIT_TIMEOUT_MS.
+    
+    /// Повторный initialize не сбрасывает карту, если она осталась в transfer под
+    /// выданным ей RCA (питание не снималось, карту не меняли).
+    bool warmInit;
+    
+    uint32_t asyncTaskPrio;     /// Приоритет задачи, запускающей запросы submit.
+
+#ifdef MODULE_MICROSD_STAT_ENABLED
+    MicrosdStat *stat;          /// Статистика обмена (может быть nullptr). Асинхронные запросы не учитываются.
+#endif
+
+#ifdef MODULE_MICROSD_TRACE_ENABLED
+    MicrosdTrace *trace;        /// Трасса событий (может быть nullptr), пишется в том числе из прерывания.
+#endif
 };
 
 
@@ -49,30 +117,128 @@ public:
                               uint32_t cout_sector,
                               uint32_t timeout_ms);
     
+    /// Фрагменты - подряд под одним захватом SDIO, каждый по DMA прямо в свой буфер
+    /// (невыравненные на 4 и лежащие в CCM - через промежуточный буфер драйвера).
+    EC_SD_RESULT readSectors (uint32_t sector, const MicrosdSegment *seg, uint32_t segCount, uint32_t timeoutMs);
+    
+    EC_SD_RESULT writeSectors (uint32_t sector, const MicrosdSegment *seg, uint32_t segCount, uint32_t timeoutMs);
+    
     EC_SD_STATUS getStatus (void);
     
     EC_SD_RESULT getSectorCount (uint32_t &sectorCount);
     
     EC_SD_RESULT getBlockSize (uint32_t &blockSize);
     
+    /// SD Status (ACMD13) разбирается драйвером: HAL_SD_GetCardStatus не знает полей UHS/Video.
+    EC_SD_RESULT getSdStatus (MicrosdSdStatus &status);
+    
+    /// HAL_SD_Erase, затем ожидание окончания стирания (таймаут - по SD Status).
+    EC_SD_RESULT discardSectors (uint32_t sector, uint32_t count);
+    
     void dmaRxHandler (void);
     
-    void giveSemaphore (void);         // Отдать симафор из прерывания (внутренняя функция.
+    void dmaTxHandler (void);
+    
+    void sdioHandler (void);
+    
+    /// Запрос ставится в очередь драйвера, submit возвращается сразу.
+    /// Задача драйвера (создается при первом submit) запускает запросы по очереди:
+    /// ждет окончания предыдущего обмена и готовности карты, затем запускает DMA.
+    /// callback вызывается из прерывания окончания DMA, при ошибке запуска - из задачи драйвера.
+    /// Буфер запроса должен быть доступен DMA напрямую (выравнен на 4, не CCM), иначе - POINTERR.
+    EC_SD_RESULT submit (MicrosdRequest *req);
+    
+    void transferCompleteFromIsr (EC_SD_RESULT result);         // Окончание обмена (внутренняя функция).
+    
+    /// Результат CMD6 и подбора делителя последнего initialize.
+    void getClockTune (MicrosdClockTune &tune);
+    
+    /// Время этапов последнего initialize.
+    void getInitTiming (MicrosdInitTiming &timing);
 
 private:
-    EC_SD_RESULT waitReadySd (void);
+    EC_SD_RESULT waitReadySd (uint32_t timeoutMs = 1000);
+    
+    EC_SD_RESULT startTransfer (MicrosdRequest *req);
+    
+    void abortTransfer (void);
+    
+    EC_SD_RESULT transferBlocking (EC_SD_REQUEST_TYPE type, uint32_t sector, const MicrosdSegment *seg,
+                                   uint32_t segCount, uint32_t timeoutMs);
+    
+    EC_SD_RESULT transferSegment (EC_SD_REQUEST_TYPE type, uint32_t sector, uint8_t *buf, uint32_t count,
+                                  uint32_t timeoutMs);
+    
+    EC_SD_RESULT transferBounced (EC_SD_REQUEST_TYPE type, uint32_t sector, uint8_t *buf, uint32_t count,
+                                  uint32_t timeoutMs);
+    
+    static bool isDmaSafe (const uint8_t *buf, uint32_t count);
+    
+    static void blockingDone (MicrosdRequest *req);
+    
+    static void asyncTask (void *obj);
+    
+    void asyncLoop (void);
+    
+    /// HAL_SD_Init (первый запуск) или HAL_SD_InitCard с повторами до срока.
+    bool initCard (bool first, uint32_t start);
+    
+    /// Карта отвечает на CMD13 под прежним RCA и находится в transfer.
+    bool checkWarm (void);
+    
+    /// CMD6 и подбор делителя после инициализации карты.
+    void setupClock (void);
+    
+    /// cmd: 6 - CMD6 (SWITCH_FUNC) с аргументом arg, 13 - ACMD13 (SD Status).
+    EC_SD_RESULT readStatusBlock (uint8_t cmd, uint32_t arg, uint8_t *status);
+    
+    EC_SD_RESULT switchFunction (bool set, uint8_t accessMode, uint8_t *status);
+    
+    bool enableHighSpeed (void);
+    
+    void tuneClock (void);
+    
+    void setClockDiv (uint32_t div);
 
 private:
     const MicrosdSdioCfg *const cfg;
     
     SD_HandleTypeDef handle;
     DMA_HandleTypeDef dmaRx;
+    DMA_HandleTypeDef dmaTx;
     
     USER_OS_STATIC_MUTEX m = nullptr;
     USER_OS_STATIC_MUTEX_BUFFER mb;
     
     USER_OS_STATIC_BIN_SEMAPHORE_BUFFER sb;
     USER_OS_STATIC_BIN_SEMAPHORE s = nullptr;
+    
+    /// Владение SDIO: отдается из прерывания окончания обмена.
+    USER_OS_STATIC_BIN_SEMAPHORE_BUFFER busyb;
+    USER_OS_STATIC_BIN_SEMAPHORE busy = nullptr;
+    
+    MicrosdRequest *volatile current = nullptr;
+    
+    /// Очередь запросов submit (односвязный список).
+    USER_OS_STATIC_MUTEX_BUFFER qmb;
+    USER_OS_STATIC_MUTEX qm = nullptr;
+    MicrosdRequest *qHead = nullptr;
+    MicrosdRequest *qTail = nullptr;
+    
+    USER_OS_STATIC_BIN_SEMAPHORE_BUFFER qsb;
+    USER_OS_STATIC_BIN_SEMAPHORE qs = nullptr;
+    
+    USER_OS_STATIC_STACK_TYPE asyncStack[MICROSD_SDIO_ASYNC_TASK_STACK_SIZE];
+    USER_OS_STATIC_TASK_STRUCT_TYPE asyncTaskStruct;
+    bool asyncStarted = false;
+    
+    MicrosdClockTune tune = {};
+    MicrosdInitTiming timing = {};
+    
+    bool cardReady = false;     /// Последний initialize успешен (RCA и CID в handle действительны).
+    
+    /// Используется только под mutex m (блокирующие readSector/writeSector).
+    alignas(MICROSD_SDIO_BOUNCE_ALIGN) uint8_t bounce[MICROSD_SDIO_BOUNCE_SECTORS][512];
 };
 
 #endif
@@ -2,6 +2,8 @@
 
 #ifdef MODULE_MICROSD_CARD_SDIO_ENABLED
 
+#include <string.h>
+
 #define checkResult(r)                                    \
         if ( r != 0 ) return EC_MICRO_SD_TYPE::ERROR;
 
@@ -17,10 +19,10 @@ MicrosdSdio::MicrosdSdio (const MicrosdSdioCfg *const cfg) : cfg(cfg) {
     this->handle.obj = this;
     
     this->handle.hdmarx = &this->dmaRx;
-    this->handle.hdmatx = nullptr;
+    this->handle.hdmatx = &this->dmaTx;
     
     this->handle.hdmarx->Parent = &this->handle;
-    this->handle.hdmatx->Parent = nullptr;
+    this->handle.hdmatx->Parent = &this->handle;
     
     this->handle.hdmarx->Instance = this->cfg->dmaRx;
     this->handle.hdmarx->Init.Channel = this->cfg->dmaRxCh;
@@ -36,49 +38,342 @@ MicrosdSdio::MicrosdSdio (const MicrosdSdioCfg *const cfg) : cfg(cfg) {
     this->handle.hdmarx->Init.MemBurst = DMA_MBURST_INC4;
     this->handle.hdmarx->Init.PeriphBurst = DMA_PBURST_INC4;
     
+    this->handle.hdmatx->Instance = this->cfg->dmaTx;
+    this->handle.hdmatx->Init.Channel = this->cfg->dmaTxCh;
+    this->handle.hdmatx->Init.Direction = DMA_MEMORY_TO_PERIPH;
+    this->handle.hdmatx->Init.PeriphInc = DMA_PINC_DISABLE;
+    this->handle.hdmatx->Init.MemInc = DMA_MINC_ENABLE;
+    this->handle.hdmatx->Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    this->handle.hdmatx->Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    this->handle.hdmatx->Init.Mode = DMA_PFCTRL;
+    this->handle.hdmatx->Init.Priority = DMA_PRIORITY_LOW;
+    this->handle.hdmatx->Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+    this->handle.hdmatx->Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+    this->handle.hdmatx->Init.MemBurst = DMA_MBURST_INC4;
+    this->handle.hdmatx->Init.PeriphBurst = DMA_PBURST_INC4;
+    
     this->m = USER_OS_STATIC_MUTEX_CREATE(&mb);
     this->s = USER_OS_STATIC_BIN_SEMAPHORE_CREATE(&this->sb);
+    this->busy = USER_OS_STATIC_BIN_SEMAPHORE_CREATE(&this->busyb);
+    xSemaphoreGive (this->busy);                /// SDIO свободен.
+    
+    this->qm = USER_OS_STATIC_MUTEX_CREATE(&this->qmb);
+    this->qs = USER_OS_STATIC_BIN_SEMAPHORE_CREATE(&this->qsb);
 }
 
-EC_SD_RESULT MicrosdSdio::waitReadySd (void) {
-    uint32_t timeout_flag = 1000;
+EC_SD_RESULT MicrosdSdio::waitReadySd (uint32_t timeoutMs) {
+    MICROSD_STAT_START(this->cfg->stat, t);
+    EC_SD_RESULT rv = EC_SD_RESULT::ERROR;
+    uint32_t timeout_flag = timeoutMs;
     while (timeout_flag) {
         if (HAL_SD_GetCardState(&this->handle) != HAL_SD_CARD_TRANSFER) {
             USER_OS_DELAY_MS(1);
             timeout_flag--;
         } else {
-            return EC_SD_RESULT::OK;
+            rv = EC_SD_RESULT::OK;
+            break;
         }
     }
-    return EC_SD_RESULT::ERROR;
+    MICROSD_STAT(this->cfg->stat, spins(timeoutMs - timeout_flag));
+    MICROSD_STAT(this->cfg->stat, busy(t));
+    MICROSD_TRACE(this->cfg->trace, EC_MICROSD_TRACE_EVENT::BUSY_END, (uint8_t)rv);
+    return rv;
 }
 
 void MicrosdSdio::dmaRxHandler (void) {
     HAL_DMA_IRQHandler(&this->dmaRx);
 }
 
+void MicrosdSdio::dmaTxHandler (void) {
+    HAL_DMA_IRQHandler(&this->dmaTx);
+}
+
+void MicrosdSdio::sdioHandler (void) {
+    HAL_SD_IRQHandler(&this->handle);
+}
+
 EC_MICRO_SD_TYPE MicrosdSdio::initialize (void) {
-    if (HAL_SD_GetState(&this->handle) == HAL_SD_STATE_RESET) {        /// Первый запуск.
+    const uint32_t start = HAL_GetTick();
+    this->timing = {};
+    
+    /// Та же карта без сброса: ширина шины, High Speed и делитель остаются прежними.
+    if (this->cfg->warmInit && this->cardReady && this->checkWarm()) {
+        this->timing.warm = true;
+        this->timing.resetMs = HAL_GetTick() - start;
+        this->timing.totalMs = this->timing.resetMs;
+        return this->getType();
+    }
+    
+    this->cardReady = false;
+    
+    /// Карта после инициализации снова в Default Speed.
+    this->tune = {};
+    this->handle.Init.ClockDiv = this->cfg->div;
+    
+    bool first = (HAL_SD_GetState(&this->handle) == HAL_SD_STATE_RESET);
+    
+    if (first) {        /// Первый запуск.
         __HAL_RCC_SYSCFG_CLK_ENABLE();
         __HAL_RCC_PWR_CLK_ENABLE();
         __HAL_RCC_SDIO_CLK_ENABLE();
         
         mc::dmaClkOn(this->cfg->dmaRx);
+        mc::dmaClkOn(this->cfg->dmaTx);
         
         checkResult(HAL_DMA_DeInit(&this->dmaRx));
         checkResult(HAL_DMA_Init(&this->dmaRx));
+        checkResult(HAL_DMA_DeInit(&this->dmaTx));
+        checkResult(HAL_DMA_Init(&this->dmaTx));
         
         mc::dmaIrqOn(this->cfg->dmaRx, this->cfg->dmaRxIrqPrio);
+        mc::dmaIrqOn(this->cfg->dmaTx, this->cfg->dmaTxIrqPrio);
         
-        checkResult(HAL_SD_DeInit(&this->handle));
-        checkResult(HAL_SD_Init(&this->handle));
-        checkResult(HAL_SD_ConfigWideBusOperation(&this->handle, this->cfg->wide));
+        NVIC_SetPriority(SDIO_IRQn, this->cfg->sdioIrqPrio);
+        NVIC_EnableIRQ(SDIO_IRQn);
+    }
+    
+    if (!this->initCard(first, start)) return EC_MICRO_SD_TYPE::ERROR;
+    
+    uint32_t phase = HAL_GetTick();
+    this->timing.readyMs = phase - start;
+    
+    /// HAL_SD_InitCard оставляет SDIO на частоте инициализации и шине 1 бит,
+    /// рабочие ClockDiv и ширину выставляет ConfigWideBusOperation.
+    checkResult(HAL_SD_ConfigWideBusOperation(&this->handle, this->cfg->wide));
+    this->timing.configMs = HAL_GetTick() - phase;
+    
+    this->setupClock();
+    
+    this->cardReady = true;
+    this->timing.totalMs = HAL_GetTick() - start;
+    
+    return this->getType();
+}
+
+// HAL_SD_InitCard опрашивает ACMD41 ограниченное число раз без пауз. Не успевшая
+// карта (например, только что вставленная) получает повторную попытку до срока.
+bool MicrosdSdio::initCard (bool first, uint32_t start) {
+    const uint32_t timeoutMs = (this->cfg->initTimeoutMs != 0) ? this->cfg->initTimeoutMs : MICROSD_SDIO_INIT_TIMEOUT_MS;
+    
+    while (true) {
+        HAL_StatusTypeDef r;
         
-        return this->getType();
-    } else {
-        checkResult(HAL_SD_InitCard(&this->handle));
-        return this->getType();
+        this->timing.attempts++;
+        if (first) {
+            /// HAL_SD_Init вызывает HAL_SD_MspInit только из состояния RESET.
+            r = HAL_SD_DeInit(&this->handle);
+            if (r == HAL_OK) r = HAL_SD_Init(&this->handle);
+        } else {
+            r = HAL_SD_InitCard(&this->handle);
+        }
+        
+        if (r == HAL_OK) return true;
+        if ((HAL_GetTick() - start) >= timeoutMs) return false;
+        
+        USER_OS_DELAY_MS(MICROSD_SDIO_INIT_RETRY_MS);
+    }
+}
+
+// CID карты (CMD10) в transfer не запросить, но он и не нужен: RCA выдается карте
+// при идентификации (CMD2 с CID, CMD3). Карта, у которой снимали питание, или другая
+// карта находится в idle и на CMD13 с прежним RCA не ответит.
+bool MicrosdSdio::checkWarm (void) {
+    USER_OS_TAKE_MUTEX(this->m, portMAX_DELAY);
+    xSemaphoreTake (this->busy, portMAX_DELAY);
+    
+    HAL_SD_CardStateTypeDef s = HAL_SD_GetCardState(&this->handle);
+    
+    /// Карта еще программирует записанное - ждем, как перед обычным обменом.
+    if ((s == HAL_SD_CARD_PROGRAMMING) && (this->waitReadySd(MICROSD_SDIO_WARM_BUSY_MS) == EC_SD_RESULT::OK)) {
+        s = HAL_SD_CARD_TRANSFER;
+    }
+    
+    xSemaphoreGive (this->busy);
+    USER_OS_GIVE_MUTEX(this->m);
+    
+    return s == HAL_SD_CARD_TRANSFER;
+}
+
+void MicrosdSdio::setClockDiv (uint32_t div) {
+    this->handle.Init.ClockDiv = div;
+    MODIFY_REG(this->handle.Instance->CLKCR, SDIO_CLKCR_CLKDIV, div);
+}
+
+// Блок 64 байта (статус CMD6 или SD Status по ACMD13) принимается опросом FIFO
+// (как HAL читает SCR), DMA на такой короткий блок не нужен. SDIO уже занят вызывающим (busy).
+EC_SD_RESULT MicrosdSdio::readStatusBlock (uint8_t cmd, uint32_t arg, uint8_t *status) {
+    uint32_t words[16];
+    uint32_t n = 0;
+    
+    if (this->waitReadySd() != EC_SD_RESULT::OK) return EC_SD_RESULT::ERROR;
+    
+    if (SDMMC_CmdBlockLength(this->handle.Instance, 64) != HAL_SD_ERROR_NONE) return EC_SD_RESULT::ERROR;
+    
+    if (cmd == 13) {
+        MICROSD_STAT(this->cfg->stat, cmd(55));
+        if (SDMMC_CmdAppCommand(this->handle.Instance, this->handle.SdCard.RelCardAdd << 16) != HAL_SD_ERROR_NONE) {
+            SDMMC_CmdBlockLength(this->handle.Instance, 512);
+            return EC_SD_RESULT::ERROR;
+        }
+    }
+    
+    SDIO_DataInitTypeDef config;
+    config.DataTimeOut = SDMMC_DATATIMEOUT;
+    config.DataLength = 64;
+    config.DataBlockSize = SDIO_DATABLOCK_SIZE_64B;
+    config.TransferDir = SDIO_TRANSFER_DIR_TO_SDIO;
+    config.TransferMode = SDIO_TRANSFER_MODE_BLOCK;
+    config.DPSM = SDIO_DPSM_ENABLE;
+    SDIO_ConfigData(this->handle.Instance, &config);
+    
+    EC_SD_RESULT rv = EC_SD_RESULT::ERROR;
+    
+    do {
+        MICROSD_STAT(this->cfg->stat, cmd(cmd));
+        MICROSD_TRACE(this->cfg->trace, EC_MICROSD_TRACE_EVENT::CMD, cmd, 0, arg);
+        uint32_t err = (cmd == 13) ? SDMMC_CmdStatusRegister(this->handle.Instance) :
+                       SDMMC_CmdSwitch(this->handle.Instance, arg);
+        if (err != HAL_SD_ERROR_NONE) break;
+        
+        uint32_t tick = HAL_GetTick();
+        bool timeout = false;
+        while (!__HAL_SD_GET_FLAG(&this->handle, SDIO_FLAG_RXOVERR | SDIO_FLAG_DCRCFAIL | SDIO_FLAG_DTIMEOUT |
+                                                 SDIO_FLAG_DBCKEND)) {
+            if (__HAL_SD_GET_FLAG(&this->handle, SDIO_FLAG_RXDAVL) && (n < 16)) {
+                words[n++] = SDIO_ReadFIFO(this->handle.Instance);
+            }
+            
+            if ((HAL_GetTick() - tick) >= MICROSD_SDIO_SWITCH_TIMEOUT_MS) {
+                timeout = true;
+                break;
+            }
+        }
+        
+        if (timeout) break;
+        if (__HAL_SD_GET_FLAG(&this->handle, SDIO_FLAG_RXOVERR | SDIO_FLAG_DCRCFAIL | SDIO_FLAG_DTIMEOUT)) break;
+        
+        /// Последние слова могут остаться в FIFO к моменту DBCKEND.
+        while (__HAL_SD_GET_FLAG(&this->handle, SDIO_FLAG_RXDAVL) && (n < 16)) {
+            words[n++] = SDIO_ReadFIFO(this->handle.Instance);
+        }
+        
+        if (n != 16) break;
+        
+        /// Первый принятый байт - младший байт первого слова FIFO.
+        memcpy(status, words, 64);
+        rv = EC_SD_RESULT::OK;
+    } while (false);
+    
+    __HAL_SD_CLEAR_FLAG(&this->handle, SDIO_STATIC_FLAGS);
+    
+    if (SDMMC_CmdBlockLength(this->handle.Instance, 512) != HAL_SD_ERROR_NONE) {
+        rv = EC_SD_RESULT::ERROR;
     }
+    
+    return rv;
+}
+
+EC_SD_RESULT MicrosdSdio::switchFunction (bool set, uint8_t accessMode, uint8_t *status) {
+    return this->readStatusBlock(6, microsdGetSwitchArg(set, accessMode), status);
+}
+
+EC_SD_RESULT MicrosdSdio::getSdStatus (MicrosdSdStatus &status) {
+    if (this->handle.State == HAL_SD_STATE_RESET) {
+        return EC_SD_RESULT::NOTRDY;
+    }
+    
+    uint8_t reg[64];
+    
+    USER_OS_TAKE_MUTEX(this->m, portMAX_DELAY);
+    xSemaphoreTake (this->busy, portMAX_DELAY);
+    EC_SD_RESULT rv = this->readStatusBlock(13, 0, reg);
+    xSemaphoreGive (this->busy);
+    USER_OS_GIVE_MUTEX(this->m);
+    
+    if (rv == EC_SD_RESULT::OK) {
+        microsdParseSdStatus(reg, status);
+    }
+    
+    return rv;
+}
+
+// Сначала проверка (карта сообщает, что выбрала бы), затем переключение.
+bool MicrosdSdio::enableHighSpeed (void) {
+    uint8_t status[64];
+    
+    if (this->switchFunction(false, MICROSD_SWITCH_ACCESS_HIGH_SPEED, status) != EC_SD_RESULT::OK) return false;
+    if (!microsdSwitchSupported(status, MICROSD_SWITCH_ACCESS_HIGH_SPEED)) return false;
+    if (microsdSwitchSelected(status) != MICROSD_SWITCH_ACCESS_HIGH_SPEED) return false;
+    
+    if (this->switchFunction(true, MICROSD_SWITCH_ACCESS_HIGH_SPEED, status) != EC_SD_RESULT::OK) return false;
+    return microsdSwitchSelected(status) == MICROSD_SWITCH_ACCESS_HIGH_SPEED;
+}
+
+// Эталон - первые секторы, считанные на cfg->div. Делитель уменьшается по одному,
+// пока MICROSD_SDIO_TUNE_PASSES чтений подряд совпадают с эталоном
+// (CRC данных SDIO проверяет сам - искаженное чтение просто не проходит).
+// Буферы - половины промежуточного буфера (mutex m захвачен).
+void MicrosdSdio::tuneClock (void) {
+    uint8_t *ref = this->bounce[0];
+    uint8_t *buf = this->bounce[MICROSD_SDIO_TUNE_SECTORS];
+    
+    if (this->transferSegment(EC_SD_REQUEST_TYPE::READ, 0, ref, MICROSD_SDIO_TUNE_SECTORS, 100) != EC_SD_RESULT::OK) {
+        return;
+    }
+    
+    for (uint32_t div = this->cfg->div; div > this->cfg->tuneDiv;) {
+        div--;
+        this->setClockDiv(div);
+        this->tune.checked++;
+        
+        bool ok = true;
+        for (uint32_t pass = 0; (pass < MICROSD_SDIO_TUNE_PASSES) && ok; pass++) {
+            ok = (this->transferSegment(EC_SD_REQUEST_TYPE::READ, 0, buf, MICROSD_SDIO_TUNE_SECTORS, 100) ==
+                  EC_SD_RESULT::OK) && (memcmp(buf, ref, MICROSD_SDIO_TUNE_SECTORS * 512) == 0);
+        }
+        
+        if (!ok) break;
+        
+        this->tune.tuned = true;
+        this->tune.setting = div;
+    }
+    
+    this->setClockDiv(this->tune.tuned ? this->tune.setting : this->cfg->div);
+}
+
+void MicrosdSdio::setupClock (void) {
+    if (!this->cfg->highSpeed && (this->cfg->tuneDiv >= this->cfg->div)) return;
+    
+    USER_OS_TAKE_MUTEX(this->m, portMAX_DELAY);
+    
+    /// CMD6 есть у SD начиная с 1.10, более старые карты его отвергнут.
+    if (this->cfg->highSpeed) {
+        uint32_t phase = HAL_GetTick();
+        xSemaphoreTake (this->busy, portMAX_DELAY);
+        this->tune.highSpeed = this->enableHighSpeed();
+        xSemaphoreGive (this->busy);
+        this->timing.configMs += HAL_GetTick() - phase;
+    }
+    
+    if (this->cfg->tuneDiv < this->cfg->div) {
+        uint32_t phase = HAL_GetTick();
+        this->tuneClock();
+        this->timing.tuneMs = HAL_GetTick() - phase;
+    }
+    
+    USER_OS_GIVE_MUTEX(this->m);
+}
+
+void MicrosdSdio::getClockTune (MicrosdClockTune &tune) {
+    USER_OS_TAKE_MUTEX(this->m, portMAX_DELAY);
+    tune = this->tune;
+    USER_OS_GIVE_MUTEX(this->m);
+}
+
+void MicrosdSdio::getInitTiming (MicrosdInitTiming &timing) {
+    USER_OS_TAKE_MUTEX(this->m, portMAX_DELAY);
+    timing = this->timing;
+    USER_OS_GIVE_MUTEX(this->m);
 }
 
 EC_MICRO_SD_TYPE MicrosdSdio::getType (void) {
@@ -91,68 +386,316 @@ EC_MICRO_SD_TYPE MicrosdSdio::getType (void) {
     return t;
 }
 
-EC_SD_RESULT MicrosdSdio::readSector (uint32_t sector, uint8_t *targetArray, uint32_t countSector, uint32_t timeoutMs) {
-    if ((uint32_t)targetArray & 0b11)            /// Указатель должен быть выравнен на 4.
+// Занимает SDIO и запускает обмен по DMA.
+// Окончание обмена - в transferCompleteFromIsr (прерывание).
+EC_SD_RESULT MicrosdSdio::startTransfer (MicrosdRequest *req) {
+    if (!MicrosdSdio::isDmaSafe(req->buf, req->count))     /// Асинхронный запрос - только напрямую по DMA.
         return EC_SD_RESULT::POINTERR;
     
-    EC_SD_RESULT rv = EC_SD_RESULT::ERROR;
+    /// Предыдущий обмен (в том числе асинхронный) еще не закончен.
+    if (xSemaphoreTake (this->busy, req->timeoutMs) != pdTRUE) {
+        return EC_SD_RESULT::NOTRDY;
+    }
     
-    USER_OS_TAKE_MUTEX(this->m, portMAX_DELAY);
+    MICROSD_TRACE(this->cfg->trace, EC_MICROSD_TRACE_EVENT::OP_START,
+                  (uint8_t)((req->type == EC_SD_REQUEST_TYPE::READ) ? EC_MICROSD_TRACE_OP::READ : EC_MICROSD_TRACE_OP::WRITE),
+                  (uint16_t)req->count, req->sector);
+    
+    if (this->waitReadySd() != EC_SD_RESULT::OK) {
+        MICROSD_TRACE(this->cfg->trace, EC_MICROSD_TRACE_EVENT::OP_END, (uint8_t)EC_SD_RESULT::ERROR);
+        xSemaphoreGive (this->busy);
+        return EC_SD_RESULT::ERROR;
+    }
+    
+    this->current = req;
+    
+    MICROSD_STAT(this->cfg->stat, cmd((req->type == EC_SD_REQUEST_TYPE::READ) ? ((req->count > 1) ? 18 : 17) :
+                                                                                ((req->count > 1) ? 25 : 24)));
+    if (req->count > 1) {
+        MICROSD_STAT(this->cfg->stat, cmd(12));
+    }
+    
+    /// Команду и фазу данных HAL выполняет целиком, отмечается только запуск.
+    MICROSD_TRACE(this->cfg->trace, EC_MICROSD_TRACE_EVENT::CMD,
+                  (req->type == EC_SD_REQUEST_TYPE::READ) ? ((req->count > 1) ? 18 : 17) : ((req->count > 1) ? 25 : 24),
+                  0, req->sector);
+    MICROSD_TRACE(this->cfg->trace, EC_MICROSD_TRACE_EVENT::DATA_START, 0, (uint16_t)req->count);
+    
+    HAL_StatusTypeDef res;
+    if (req->type == EC_SD_REQUEST_TYPE::READ) {
+        res = HAL_SD_ReadBlocks_DMA(&this->handle, req->buf, req->sector, req->count);
+    } else {
+        res = HAL_SD_WriteBlocks_DMA(&this->handle, req->buf, req->sector, req->count);
+    }
+    
+    if (res != HAL_OK) {
+        MICROSD_TRACE(this->cfg->trace, EC_MICROSD_TRACE_EVENT::OP_END, (uint8_t)EC_SD_RESULT::ERROR);
+        this->current = nullptr;
+        xSemaphoreGive (this->busy);
+        return EC_SD_RESULT::ERROR;
+    }
+    
+    return EC_SD_RESULT::OK;
+}
+
+// Прерывать зависший обмен (по таймауту блокирующего вызова).
+void MicrosdSdio::abortTransfer (void) {
+    HAL_SD_Abort(&this->handle);
+    
+    taskENTER_CRITICAL();
+    bool stillOwned = (this->current != nullptr);
+    this->current = nullptr;
+    taskEXIT_CRITICAL();
+    
+    if (stillOwned) {
+        MICROSD_TRACE(this->cfg->trace, EC_MICROSD_TRACE_EVENT::OP_END, (uint8_t)EC_SD_RESULT::ERROR);
+        xSemaphoreGive (this->busy);
+    }
+}
+
+void MicrosdSdio::blockingDone (MicrosdRequest *req) {
+    MicrosdSdio *o = (MicrosdSdio *)req->ctx;
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    xSemaphoreGiveFromISR (o->s, &xHigherPriorityTaskWoken);
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+// DMA SDIO работает словами (MemDataAlignment WORD): буфер должен быть выравнен на 4.
+// CCM (F4) к шине DMA не подключена вовсе.
+bool MicrosdSdio::isDmaSafe (const uint8_t *buf, uint32_t count) {
+    if ((uint32_t)buf & 0b11) {
+        return false;
+    }
+    
+#ifdef CCMDATARAM_BASE
+    uint32_t start = (uint32_t)buf;
+    uint32_t end = start + count * 512;
+    if ((start <= CCMDATARAM_END) && (end > CCMDATARAM_BASE)) {
+        return false;
+    }
+#else
+    (void)count;
+#endif
+    
+    return true;
+}
+
+// Одна многоблочная передача по DMA (mutex уже захвачен).
+EC_SD_RESULT MicrosdSdio::transferSegment (EC_SD_REQUEST_TYPE type, uint32_t sector, uint8_t *buf, uint32_t count,
+                                           uint32_t timeoutMs) {
+    MicrosdRequest req;
+    req.type = type;
+    req.sector = sector;
+    req.buf = buf;
+    req.count = count;
+    req.timeoutMs = timeoutMs;
+    req.callback = MicrosdSdio::blockingDone;
+    req.ctx = this;
+    req.result = EC_SD_RESULT::ERROR;
     
     xSemaphoreTake (this->s, 0);
     
-    if (this->waitReadySd() == EC_SD_RESULT::OK) {
+    EC_SD_RESULT rv = this->startTransfer(&req);
+    
+    if (rv == EC_SD_RESULT::OK) {
+        if (xSemaphoreTake (this->s, timeoutMs) == pdTRUE) {
+            rv = req.result;
+        } else {
+            this->abortTransfer();
+            rv = EC_SD_RESULT::ERROR;
+        }
+    }
+    
+    return rv;
+}
+
+// Буфер, недоступный DMA, передается частями по MICROSD_SDIO_BOUNCE_SECTORS
+// через промежуточный буфер драйвера.
+// При невыравненном начале невыравнен и каждый следующий сектор (512 кратно 4),
+// поэтому копируется весь фрагмент, а не только его края.
+EC_SD_RESULT MicrosdSdio::transferBounced (EC_SD_REQUEST_TYPE type, uint32_t sector, uint8_t *buf, uint32_t count,
+                                           uint32_t timeoutMs) {
+    MICROSD_STAT(this->cfg->stat, bounce(count));
+    
+    EC_SD_RESULT rv = EC_SD_RESULT::OK;
+    
+    while ((count != 0) && (rv == EC_SD_RESULT::OK)) {
+        uint32_t n = (count < MICROSD_SDIO_BOUNCE_SECTORS) ? count : MICROSD_SDIO_BOUNCE_SECTORS;
+        
+        if (type == EC_SD_REQUEST_TYPE::WRITE) {
+            memcpy(this->bounce, buf, n * 512);
+        }
+        
+        rv = this->transferSegment(type, sector, &this->bounce[0][0], n, timeoutMs);
+        
+        if ((rv == EC_SD_RESULT::OK) && (type == EC_SD_REQUEST_TYPE::READ)) {
+            memcpy(buf, this->bounce, n * 512);
+        }
+        
+        buf += n * 512;
+        sector += n;
+        count -= n;
+    }
+    
+    return rv;
+}
+
+// Фрагменты передаются подряд, не отпуская mutex.
+// Связанных цепочек DMA у F2/F4 нет (SDIO - flow controller, double buffer недоступен),
+// поэтому каждый фрагмент - своя многоблочная передача по DMA прямо в буфер фрагмента.
+// Через промежуточный буфер идут только фрагменты, недоступные DMA.
+EC_SD_RESULT MicrosdSdio::transferBlocking (EC_SD_REQUEST_TYPE type, uint32_t sector, const MicrosdSegment *seg,
+                                            uint32_t segCount, uint32_t timeoutMs) {
+    MICROSD_STAT_START(this->cfg->stat, t);
+    USER_OS_TAKE_MUTEX(this->m, portMAX_DELAY);
+    MICROSD_STAT(this->cfg->stat, mutexWait(t));
+    
+    EC_SD_RESULT rv = EC_SD_RESULT::OK;
+    
+    for (uint32_t i = 0; (i < segCount) && (rv == EC_SD_RESULT::OK); i++) {
+        if (seg[i].count == 0) continue;
         
-        if (HAL_SD_ReadBlocks_DMA(&this->handle, targetArray, sector, countSector) == HAL_OK) {
-            if (xSemaphoreTake (this->s, timeoutMs) == pdTRUE) {
-                rv = EC_SD_RESULT::OK;
-            };
+        if (MicrosdSdio::isDmaSafe(seg[i].buf, seg[i].count)) {
+            MICROSD_STAT(this->cfg->stat, zeroCopy(seg[i].count));
+            rv = this->transferSegment(type, sector, seg[i].buf, seg[i].count, timeoutMs);
+        } else {
+            rv = this->transferBounced(type, sector, seg[i].buf, seg[i].count, timeoutMs);
         }
         
+        sector += seg[i].count;
     }
     
+    MICROSD_STAT(this->cfg->stat, op((type == EC_SD_REQUEST_TYPE::READ) ? EC_MICROSD_STAT_OP::READ :
+                                                                        EC_MICROSD_STAT_OP::WRITE, t));
+    MICROSD_STAT(this->cfg->stat, result(rv));
+    
     USER_OS_GIVE_MUTEX(this->m);
     
     return rv;
 }
 
+EC_SD_RESULT MicrosdSdio::readSector (uint32_t sector, uint8_t *targetArray, uint32_t countSector, uint32_t timeoutMs) {
+    MicrosdSegment seg = {targetArray, countSector};
+    return this->transferBlocking(EC_SD_REQUEST_TYPE::READ, sector, &seg, 1, timeoutMs);
+}
+
 EC_SD_RESULT
 MicrosdSdio::writeSector (const uint8_t *const sourceArray, uint32_t sector, uint32_t countSector, uint32_t timeoutMs) {
-    if ((uint32_t)sourceArray & 0b11)            /// Указатель должен быть выравнен на 4.
+    MicrosdSegment seg = {(uint8_t *)sourceArray, countSector};
+    return this->transferBlocking(EC_SD_REQUEST_TYPE::WRITE, sector, &seg, 1, timeoutMs);
+}
+
+EC_SD_RESULT MicrosdSdio::readSectors (uint32_t sector, const MicrosdSegment *seg, uint32_t segCount, uint32_t timeoutMs) {
+    return this->transferBlocking(EC_SD_REQUEST_TYPE::READ, sector, seg, segCount, timeoutMs);
+}
+
+EC_SD_RESULT MicrosdSdio::writeSectors (uint32_t sector, const MicrosdSegment *seg, uint32_t segCount, uint32_t timeoutMs) {
+    return this->transferBlocking(EC_SD_REQUEST_TYPE::WRITE, sector, seg, segCount, timeoutMs);
+}
+
+//**********************************************************************
+// Асинхронные запросы.
+// Ожидание предыдущего обмена и готовности карты (программирование после записи)
+// идет в задаче драйвера, а не в задаче, поставившей запрос.
+//**********************************************************************
+EC_SD_RESULT MicrosdSdio::submit (MicrosdRequest *req) {
+    if (!MicrosdSdio::isDmaSafe(req->buf, req->count))
         return EC_SD_RESULT::POINTERR;
     
-    EC_SD_RESULT rv = EC_SD_RESULT::ERROR;
+    req->next = nullptr;
     
-    USER_OS_TAKE_MUTEX(this->m, portMAX_DELAY);
+    USER_OS_TAKE_MUTEX(this->qm, portMAX_DELAY);
     
-    if (this->waitReadySd() == EC_SD_RESULT::OK) {
-        
-        HAL_StatusTypeDef res;
-        res = HAL_SD_WriteBlocks(&this->handle, (uint8_t *)sourceArray, sector, countSector, timeoutMs);
-        
-        if (res == HAL_OK) {
-            rv = EC_SD_RESULT::OK;
-        }
-        
+    if (!this->asyncStarted) {
+        USER_OS_STATIC_TASK_CREATE(MicrosdSdio::asyncTask, "sdSdioAsync", MICROSD_SDIO_ASYNC_TASK_STACK_SIZE, this,
+                                   this->cfg->asyncTaskPrio, this->asyncStack, &this->asyncTaskStruct);
+        this->asyncStarted = true;
     }
     
-    USER_OS_GIVE_MUTEX(this->m);
+    if (this->qTail != nullptr) {
+        this->qTail->next = req;
+    } else {
+        this->qHead = req;
+    }
+    this->qTail = req;
     
-    return rv;
+    USER_OS_GIVE_MUTEX(this->qm);
+    
+    USER_OS_GIVE_BIN_SEMAPHORE(this->qs);
+    
+    return EC_SD_RESULT::OK;
+}
+
+void MicrosdSdio::asyncTask (void *obj) {
+    ((MicrosdSdio *)obj)->asyncLoop();
 }
 
-void MicrosdSdio::giveSemaphore (void) {
-    if (this->s) {
-        BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-        xSemaphoreGiveFromISR (this->s, &xHigherPriorityTaskWoken);
+// Следующий запрос запускается, как только SDIO освободится (startTransfer ждет busy),
+// так что за DMA текущего запроса всегда стоит готовый к запуску следующий.
+void MicrosdSdio::asyncLoop (void) {
+    while (true) {
+        USER_OS_TAKE_BIN_SEMAPHORE(this->qs, portMAX_DELAY);
+        
+        while (true) {
+            USER_OS_TAKE_MUTEX(this->qm, portMAX_DELAY);
+            MicrosdRequest *req = this->qHead;
+            if (req != nullptr) {
+                this->qHead = req->next;
+                if (this->qHead == nullptr) {
+                    this->qTail = nullptr;
+                }
+            }
+            USER_OS_GIVE_MUTEX(this->qm);
+            
+            if (req == nullptr) break;
+            
+            EC_SD_RESULT rv = this->startTransfer(req);
+            if (rv != EC_SD_RESULT::OK) {
+                req->result = rv;
+                if (req->callback != nullptr) {
+                    req->callback(req);
+                }
+            }
+        }
     }
 }
 
+void MicrosdSdio::transferCompleteFromIsr (EC_SD_RESULT result) {
+    MicrosdRequest *req = this->current;
+    this->current = nullptr;
+    
+    if (req == nullptr) {
+        return;             /// Обмен уже был прерван по таймауту.
+    }
+    
+    MICROSD_TRACE(this->cfg->trace, EC_MICROSD_TRACE_EVENT::DMA_DONE, (uint8_t)result);
+    MICROSD_TRACE(this->cfg->trace, EC_MICROSD_TRACE_EVENT::OP_END, (uint8_t)result);
+    
+    req->result = result;
+    if (req->callback != nullptr) {
+        req->callback(req);
+    }
+    
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    xSemaphoreGiveFromISR (this->busy, &xHigherPriorityTaskWoken);
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
 extern "C" {
 
 void HAL_SD_RxCpltCallback (SD_HandleTypeDef *hsd) {
     MicrosdSdio *o = (MicrosdSdio *)hsd->obj;
-    o->giveSemaphore();
+    o->transferCompleteFromIsr(EC_SD_RESULT::OK);
+}
+
+void HAL_SD_TxCpltCallback (SD_HandleTypeDef *hsd) {
+    MicrosdSdio *o = (MicrosdSdio *)hsd->obj;
+    o->transferCompleteFromIsr(EC_SD_RESULT::OK);
+}
+
+void HAL_SD_ErrorCallback (SD_HandleTypeDef *hsd) {
+    MicrosdSdio *o = (MicrosdSdio *)hsd->obj;
+    o->transferCompleteFromIsr(EC_SD_RESULT::ERROR);
 }
 
 }
@@ -197,4 +740,55 @@ EC_SD_RESULT MicrosdSdio::getBlockSize (uint32_t &blockSize) {
     return EC_SD_RESULT::OK;
 }
 
+// Стирание [sector; sector + count). Адреса HAL пересчитывает сам (SDSC - в байты).
+EC_SD_RESULT MicrosdSdio::discardSectors (uint32_t sector, uint32_t count) {
+    if (this->handle.State == HAL_SD_STATE_RESET) {
+        return EC_SD_RESULT::NOTRDY;
+    }
+    
+    HAL_SD_CardCSDTypeDef csd;
+    if (HAL_SD_GetCardCSD(&this->handle, &csd) != HAL_OK) {
+        return EC_SD_RESULT::ERROR;
+    }
+    
+    /// SDSC с ERASE_BLK_EN == 0 (EraseGrSize в HAL) стирает только группами по SECTOR_SIZE + 1 блоков
+    /// размером WRITE_BL_LEN (у карт 2 ГБ бывает 1024 и 2048 байт).
+    uint32_t blockShift = (csd.WrBlockLen > 9) ? (uint32_t)(csd.WrBlockLen - 9) : 0;
+    uint32_t eraseSectors = ((uint32_t)csd.EraseGrMul + 1) << blockShift;
+    if (!microsdAlignEraseRange(sector, count, csd.EraseGrSize != 0, eraseSectors)) {
+        return EC_SD_RESULT::OK;
+    }
+    
+    EC_SD_RESULT rv = EC_SD_RESULT::ERROR;
+    
+    USER_OS_TAKE_MUTEX(this->m, portMAX_DELAY);
+    
+    /// Асинхронный обмен мог еще не закончиться.
+    xSemaphoreTake (this->busy, portMAX_DELAY);
+    
+    do {
+        if (this->waitReadySd() != EC_SD_RESULT::OK) break;
+        
+        /// Без SD Status (старые карты) - по 250 мс на блок.
+        uint8_t reg[64];
+        MicrosdSdStatus st = {};
+        if (this->readStatusBlock(13, 0, reg) == EC_SD_RESULT::OK) {
+            microsdParseSdStatus(reg, st);
+        }
+        
+        uint32_t timeoutMs = microsdGetEraseTimeoutMs(sector, count, st.eraseSize, st.eraseTimeout, st.eraseOffset,
+                                                      st.auSize);
+        
+        if (HAL_SD_Erase(&this->handle, sector, sector + count - 1) != HAL_OK) break;
+        
+        /// Стирание идет в состоянии PROGRAMMING, готовность - по возврату в TRANSFER.
+        rv = this->waitReadySd(timeoutMs);
+    } while (false);
+    
+    xSemaphoreGive (this->busy);
+    USER_OS_GIVE_MUTEX(this->m);
+    
+    return rv;
+}
+
 #endif
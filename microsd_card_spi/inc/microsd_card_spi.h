@@ -6,6 +6,7 @@
 #include "mc_pin.h"
 #include "user_os.h"
 #include "microsd_base.h"
+#include "microsd_spi_core.h"
 
 struct microsdSpiCfg {
     PinBase*					const cs;			 // Вывод CS, подключенный к microsd.
@@ -14,8 +15,93 @@ struct microsdSpiCfg {
     /// speed ( true == fast )
     /// speed ( false == true )
     void	( *setSpiSpeed )	( SpiMaster8BitBase* spi, bool speed );
+
+    /// Приоритет задачи, обслуживающей submit (MODULE_MICROSD_CARD_SPI_ASYNC_ENABLED).
+    uint32_t	asyncTaskPrio;
+
+    /// Включить проверку CRC (CMD59): CRC16 каждого блока данных проверяется/передается.
+    bool		crcEnable;
+    /// Сколько раз повторять запрос при ошибке CRC.
+    uint8_t		crcRetries;
+
+    /// Сколько байт ожидания (маркер/busy) опрашивать подряд, прежде чем уступить
+    /// процессор другим задачам. 0 - MICROSD_SPI_SPIN_BUDGET_DEFAULT.
+    uint32_t	spinBudget;
+
+    /// Перевести карту в High Speed (CMD6), если она это поддерживает.
+    /// Частоту выше 25 МГц после этого выставляет setSpiSpeed/setSpiClock.
+    bool		highSpeed;
+
+    /// Подбор частоты при initialize (может быть nullptr - всегда setSpiSpeed( true )).
+    /// step 0..clockSteps - 1 - по возрастанию частоты. Шаги проверяются по порядку
+    /// чтением первых секторов карты, рабочим остается последний прошедший проверку
+    /// (выставляется вместо setSpiSpeed( true )). Подбор берет ~600 байт стека initialize.
+    void	( *setSpiClock )	( SpiMaster8BitBase* spi, uint32_t step );
+    uint32_t	clockSteps;
+
+    /// Срок инициализации (CMD0..ACMD41). 0 - MICROSD_SPI_INIT_TIMEOUT_MS.
+    uint32_t	initTimeoutMs;
+
+    /// Повторный initialize не сбрасывает карту, если она осталась инициализированной
+    /// и ее CID совпал с запомненным (питание не снималось, карту не меняли).
+    bool		warmInit;
+
+#ifdef MODULE_MICROSD_STAT_ENABLED
+    /// Статистика обмена (может быть nullptr).
+    MicrosdStat*	stat;
+#endif
+
+#ifdef MODULE_MICROSD_TRACE_ENABLED
+    /// Трасса событий шины (может быть nullptr).
+    MicrosdTrace*	trace;
+#endif
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+    /// Общая с другими устройствами шина (может быть nullptr - SPI только у этой карты).
+    /// s должен быть тем же SPI, что у шины. setSpiSpeed вызывается шиной только
+    /// при смене устройства или скорости.
+    MicrosdSpiBus*	bus;
+#endif
+};
+
+#define MICROSD_SPI_ASYNC_TASK_STACK_SIZE				( 200 )
+
+/// Параметры MicrosdSpiCore, прочитанные из microsdSpiCfg при выполнении.
+class MicrosdSpiCfgPolicy {
+public:
+    MicrosdSpiCfgPolicy ( const microsdSpiCfg* const cfg ) : cfg( cfg ) {}
+
+    void			setSpeed			( SpiMaster8BitBase& spi, bool fast )		{ this->cfg->setSpiSpeed( &spi, fast ); }
+    void			setClock			( SpiMaster8BitBase& spi, uint32_t step )	{ this->cfg->setSpiClock( &spi, step ); }
+    uint32_t		clockSteps			( void )	{ return ( this->cfg->setSpiClock != nullptr ) ? this->cfg->clockSteps : 0; }
+    bool			crc					( void )	{ return this->cfg->crcEnable; }
+    uint8_t			crcRetries			( void )	{ return this->cfg->crcRetries; }
+    uint32_t		spinBudget			( void )	{ return ( this->cfg->spinBudget != 0 ) ? this->cfg->spinBudget : MICROSD_SPI_SPIN_BUDGET_DEFAULT; }
+    bool			highSpeed			( void )	{ return this->cfg->highSpeed; }
+    uint32_t		initTimeoutMs		( void )	{ return ( this->cfg->initTimeoutMs != 0 ) ? this->cfg->initTimeoutMs : MICROSD_SPI_INIT_TIMEOUT_MS; }
+    bool			warmInit			( void )	{ return this->cfg->warmInit; }
+
+#ifdef MODULE_MICROSD_STAT_ENABLED
+    MicrosdStat*	stat				( void )	{ return this->cfg->stat; }
+#endif
+
+#ifdef MODULE_MICROSD_TRACE_ENABLED
+    MicrosdTrace*	trace				( void )	{ return this->cfg->trace; }
+#endif
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+    MicrosdSpiBus*	bus					( void )	{ return this->cfg->bus; }
+#endif
+
+private:
+    const microsdSpiCfg*	const cfg;
 };
 
+/*!
+ * Драйвер microsd по SPI, настраиваемый при выполнении (microsdSpiCfg).
+ * Протокол - MicrosdSpiCore над виртуальными SpiMaster8BitBase/PinBase,
+ * здесь только MicrosdBase и асинхронные запросы.
+ */
 class MicrosdSpi : public MicrosdBase {
 public:
     MicrosdSpi ( const microsdSpiCfg* const cfg );
@@ -24,64 +110,58 @@ public:
     EC_MICRO_SD_TYPE	getType						( void );
     EC_SD_RESULT		readSector					( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms  );
     EC_SD_RESULT		writeSector					( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms  );
+
+    // Все фрагменты - одной командой CMD18/CMD25, без копирования.
+    EC_SD_RESULT		readSectors					( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t timeout_ms );
+    EC_SD_RESULT		writeSectors				( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t timeout_ms );
     EC_SD_STATUS		getStatus					( void );
     EC_SD_RESULT		getSectorCount				( uint32_t& sectorCount );
     EC_SD_RESULT		getBlockSize				( uint32_t& blockSize );
-private:
-    // Переключение CS.
-    void			csLow							( void );		 // CS = 0, GND.
-    void			csHigh							( void );		 // CS = 1, VDD.
-
-    // Передать count пустых байт (шлем 0xFF).
-    EC_SD_RES	sendEmptyPackage					( const uint16_t count );
-
-    // Передача 1 пустого байта. Требуется после каждой команды для ОЧЕНЬ старых карт.
-    EC_SD_RES	sendWaitOnePackage					( void );
-
-    // Пропускаем count приших байт.
-    EC_SD_RES	losePackage							( const uint16_t count );
-
-    // Считывает приходящий пакет в буффер.
-    EC_SD_RES	readDataPackage						( uint8_t* buf, const uint16_t count );
+    EC_SD_RESULT		getSdStatus					( MicrosdSdStatus& status );
 
-    // Ждем от команды специального маркера.
-    EC_SD_RES	waitMark							( const uint8_t mark );
+    // Стирание CMD32/CMD33/CMD38. Окончания стирания не ждем: его (с таймаутом
+    // по SD Status) дождется следующая команда или waitWriteDone.
+    EC_SD_RESULT		discardSectors				( uint32_t sector, uint32_t count );
 
-    // Сами отправляем маркер.
-    EC_SD_RES	sendMark							( const uint8_t mark );
+    // Дождаться, пока карта закончит программировать записанные данные
+    // (writeSector не ждет этого, см. busyPending).
+    EC_SD_RESULT		waitWriteDone				( uint32_t timeout_ms );
 
-    // Просто передача команды.
-    EC_SD_RES	sendCmd								( const uint8_t cmd, const uint32_t arg, const uint8_t crc );
+    // Результат CMD6 и подбора частоты последнего initialize.
+    void				getClockTune				( MicrosdClockTune& tune );
 
-    // Получаем адресс сектора (для аргумента команды чтения/записи).
-    uint32_t	getArgAddress						( const uint32_t sector );
+    // Время этапов последнего initialize.
+    void				getInitTiming				( MicrosdInitTiming& timing );
 
-    // Отправить ACMD.
-    EC_SD_RES	sendAcmd							( const uint8_t acmd, const uint32_t arg, const uint8_t crc );
-
-
-    // Ждать R1 (если r1 != nullptr, то еще вернуть R1 ).
-    EC_SD_RES	waitR1								( uint8_t* r1 = nullptr );
-
-    EC_SD_RES	waitR2								( uint16_t* const r2 );
-
-    // Принимаем R3 (регистр OCR).
-    EC_SD_RES	waitR3								( uint32_t* const r3 );
-
-    // Принимаем r7.
-    EC_SD_RES	waitR7								( uint32_t* const r7 );
+#ifdef MODULE_MICROSD_CARD_SPI_ASYNC_ENABLED
+    // Запрос выполняется задачей драйвера, callback вызывается из нее же.
+    EC_SD_RESULT		submit						( MicrosdRequest* req );
+#endif
 
-    void		generateCrcTable					( void );
-    uint8_t		getCrc7								( const uint8_t cmd, const uint32_t commandData );
+private:
+#ifdef MODULE_MICROSD_CARD_SPI_ASYNC_ENABLED
+    static void		asyncTask						( void* obj );
+    void			asyncLoop						( void );
+#endif
 
     const microsdSpiCfg*			const cfg;
 
-    USER_OS_STATIC_MUTEX_BUFFER		mb;
-    USER_OS_STATIC_MUTEX			m				= nullptr;
+    MicrosdSpiCore< SpiMaster8BitBase, PinBase, MicrosdSpiCfgPolicy >	core;
 
-    EC_MICRO_SD_TYPE				typeMicrosd		= EC_MICRO_SD_TYPE::ERROR;			 // Тип microSD.
+#ifdef MODULE_MICROSD_CARD_SPI_ASYNC_ENABLED
+    // Очередь запросов submit (односвязный список).
+    USER_OS_STATIC_MUTEX_BUFFER		qmb;
+    USER_OS_STATIC_MUTEX			qm				= nullptr;
+    MicrosdRequest*					qHead			= nullptr;
+    MicrosdRequest*					qTail			= nullptr;
 
-    uint8_t							CRCTable[256];
+    USER_OS_STATIC_BIN_SEMAPHORE_BUFFER		qsb;
+    USER_OS_STATIC_BIN_SEMAPHORE			qs		= nullptr;
+
+    USER_OS_STATIC_STACK_TYPE		asyncStack[ MICROSD_SPI_ASYNC_TASK_STACK_SIZE ];
+    USER_OS_STATIC_TASK_STRUCT_TYPE	asyncTaskStruct;
+    bool							asyncStarted	= false;
+#endif
 };
 
 #endif
@@ -0,0 +1,1540 @@
+#pragma once
+
+#include "project_config.h"
+
+#if defined( MODULE_MICROSD_CARD_SPI_ENABLED ) || defined( MODULE_MICROSD_CARD_SPI_T_ENABLED )
+
+#include <string.h>
+#include <type_traits>
+#include "mc_spi.h"
+#include "user_os.h"
+#include "microsd_base.h"
+#include "microsd_spi_protocol.h"
+
+#ifdef MODULE_MICROSD_STAT_ENABLED
+#include "microsd_stat.h"
+#else
+// Статистика не подключена: ее вызовы в драйвере пустые.
+#define MICROSD_STAT_START(stat,var)
+#define MICROSD_STAT(stat,call)				do {} while ( 0 )
+#endif
+
+#ifdef MODULE_MICROSD_TRACE_ENABLED
+#include "microsd_trace.h"
+#else
+// Трасса не подключена: ее вызовы в драйвере пустые.
+#define MICROSD_TRACE(trace,...)			do {} while ( 0 )
+#endif
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+#include "microsd_spi_bus.h"
+#endif
+
+/*!
+ * Протокол SD в режиме SPI - единственная его реализация: команды и ответы,
+ * чтение и запись (в том числе фрагментами), повтор при ошибке CRC, стирание,
+ * SD Status, High Speed, подбор частоты, повторная инициализация без сброса.
+ * - MicrosdSpi - MicrosdSpiCore< SpiMaster8BitBase, PinBase, MicrosdSpiCfgPolicy >:
+ *   обмен через виртуальные методы, параметры берутся из microsdSpiCfg при выполнении.
+ * - MicrosdSpiT - тот же шаблон над конкретными классами SPI и CS и политикой
+ *   с постоянными параметрами: методы Spi и Cs вызываются без таблицы виртуальных
+ *   функций, а отключенные политикой ветви (CRC, подбор частоты, шина, статистика)
+ *   компилятор выбрасывает.
+ *
+ * Spi		- SpiMaster8BitBase или класс с его методами tx, rx, txOneItem.
+ * Cs		- PinBase или класс с методами set() и reset().
+ * Policy	- параметры драйвера (методы могут быть статическими):
+ *			  void			setSpeed		( Spi& spi, bool fast );		// Низкая / высокая скорость.
+ *			  void			setClock		( Spi& spi, uint32_t step );	// Шаг подбора частоты.
+ *			  uint32_t		clockSteps		( void );						// 0 - без подбора.
+ *			  bool			crc				( void );						// CMD59, CRC16 блоков.
+ *			  uint8_t		crcRetries		( void );						// Повторов запроса при ошибке CRC.
+ *			  uint32_t		spinBudget		( void );						// См. MICROSD_SPI_SPIN_BUDGET_DEFAULT.
+ *			  bool			highSpeed		( void );						// CMD6 High Speed.
+ *			  uint32_t		initTimeoutMs	( void );
+ *			  bool			warmInit		( void );						// Повторный initialize по CID.
+ *			  MicrosdStat*	stat			( void );						// MODULE_MICROSD_STAT_ENABLED.
+ *			  MicrosdTrace*	trace			( void );						// MODULE_MICROSD_TRACE_ENABLED.
+ *			  MicrosdSpiBus*	bus			( void );						// MODULE_MICROSD_SPI_BUS_ENABLED.
+ *			  (stat, trace и bus могут вернуть nullptr.)
+ */
+
+// Ожидание маркера/busy ведется кусками по столько байт.
+#define MICROSD_SPI_SCAN_CHUNK							( 16 )
+#define MICROSD_SPI_SPIN_BUDGET_DEFAULT					( 512 )
+
+// Кадр команды: 6 байт команды + мусорный байт CMD12 + NCR + R1 + R3/R7.
+#define MICROSD_SPI_CMD_FRAME_MAX						( 6 + 1 + MICROSD_SPI_NCR_MAX + 1 + 4 )
+// CMD55 + пауза + ACMD.
+#define MICROSD_SPI_ACMD_FRAME_MAX						( 6 + MICROSD_SPI_NCR_MAX + 1 + 1 + 6 + MICROSD_SPI_NCR_MAX + 1 + 4 )
+
+// Подбор частоты: сколько секторов (с 0) и сколько раз читать на каждом шаге.
+#define MICROSD_SPI_TUNE_SECTORS						( 2 )
+#define MICROSD_SPI_TUNE_PASSES							( 4 )
+
+/// Обращения к Spi и Cs. Конкретный класс вызывается квалифицированно (s.T::rx) -
+/// без таблицы виртуальных функций, так что компилятор может встроить вызов.
+/// Абстрактные SpiMaster8BitBase/PinBase (MicrosdSpi) - обычным виртуальным вызовом.
+template < class T, bool virt = std::is_abstract< T >::value >
+struct MicrosdSpiIo {
+    static BASE_RESULT	tx			( T& s, const uint8_t* buf, uint16_t count, uint32_t timeoutMs )				{ return s.T::tx( buf, count, timeoutMs ); }
+    static BASE_RESULT	tx			( T& s, const uint8_t* tx, uint8_t* rx, uint16_t count, uint32_t timeoutMs )	{ return s.T::tx( tx, rx, count, timeoutMs ); }
+    static BASE_RESULT	rx			( T& s, uint8_t* buf, uint16_t count, uint32_t timeoutMs )						{ return s.T::rx( buf, count, timeoutMs, 0xFF ); }
+    static BASE_RESULT	txOneItem	( T& s, uint8_t item, uint16_t count, uint32_t timeoutMs )						{ return s.T::txOneItem( item, count, timeoutMs ); }
+    static void			set			( T& p )																		{ p.T::set(); }
+    static void			reset		( T& p )																		{ p.T::reset(); }
+};
+
+template < class T >
+struct MicrosdSpiIo< T, true > {
+    static BASE_RESULT	tx			( T& s, const uint8_t* buf, uint16_t count, uint32_t timeoutMs )				{ return s.tx( buf, count, timeoutMs ); }
+    static BASE_RESULT	tx			( T& s, const uint8_t* tx, uint8_t* rx, uint16_t count, uint32_t timeoutMs )	{ return s.tx( tx, rx, count, timeoutMs ); }
+    static BASE_RESULT	rx			( T& s, uint8_t* buf, uint16_t count, uint32_t timeoutMs )						{ return s.rx( buf, count, timeoutMs, 0xFF ); }
+    static BASE_RESULT	txOneItem	( T& s, uint8_t item, uint16_t count, uint32_t timeoutMs )						{ return s.txOneItem( item, count, timeoutMs ); }
+    static void			set			( T& p )																		{ p.set(); }
+    static void			reset		( T& p )																		{ p.reset(); }
+};
+
+template < class Spi, class Cs, class Policy >
+class MicrosdSpiCore {
+public:
+    MicrosdSpiCore ( Spi& spi, Cs& cs, const Policy& policy = Policy() );
+
+    EC_MICRO_SD_TYPE	initialize					( void );
+    EC_MICRO_SD_TYPE	getType						( void );
+    EC_SD_RESULT		readSector					( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms  );
+    EC_SD_RESULT		writeSector					( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms  );
+
+    // Все фрагменты - одной командой CMD18/CMD25, без копирования.
+    EC_SD_RESULT		readSectors					( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t timeout_ms );
+    EC_SD_RESULT		writeSectors				( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t timeout_ms );
+    EC_SD_STATUS		getStatus					( void );
+    EC_SD_RESULT		getSectorCount				( uint32_t& sectorCount );
+    EC_SD_RESULT		getBlockSize				( uint32_t& blockSize );
+    EC_SD_RESULT		getSdStatus					( MicrosdSdStatus& status );
+
+    // Стирание CMD32/CMD33/CMD38. Окончания стирания не ждем: его (с таймаутом
+    // по SD Status) дождется следующая команда или waitWriteDone.
+    EC_SD_RESULT		discardSectors				( uint32_t sector, uint32_t count );
+
+    // Дождаться, пока карта закончит программировать записанные данные
+    // (writeSector не ждет этого, см. busyPending).
+    EC_SD_RESULT		waitWriteDone				( uint32_t timeout_ms );
+
+    // Результат CMD6 и подбора частоты последнего initialize.
+    void				getClockTune				( MicrosdClockTune& tune );
+
+    // Время этапов последнего initialize.
+    void				getInitTiming				( MicrosdInitTiming& timing );
+
+private:
+    typedef MicrosdSpiIo< Spi >		SpiIo;
+    typedef MicrosdSpiIo< Cs >		CsIo;
+
+    /*!
+     * Сеанс обмена с картой: на время жизни объекта захвачен mutex драйвера
+     * (и общая шина, если она задана), выставлена скорость SPI и прижат CS. Все шаги одной логической операции
+     * (команда, ответ, данные, следующая команда) выполняются внутри одного сеанса,
+     * без промежуточных переключений CS.
+     */
+    class Session {
+    public:
+        Session ( MicrosdSpiCore* const sd, bool fast, uint32_t timeoutMs = portMAX_DELAY );
+        ~Session ( void );
+
+        // false - mutex не удалось захватить за timeoutMs, с картой работать нельзя.
+        bool			isOpen				( void );
+
+    private:
+        MicrosdSpiCore*	const sd;
+        bool			open;
+    };
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+    static void		busConfigure					( SpiMaster8BitBase* spi, void* ctx, uint32_t mode );
+
+    // Пока карта занята (CS снят), отдать шину ждущим ее устройствам.
+    void			yieldBus						( void );
+#endif
+
+    // Время с начала этапа phase (мс), следующий этап начинается сейчас.
+    static uint32_t	phaseMs							( uint32_t& phase );
+
+    // Полная инициализация: сброс CMD0, ACMD41, настройка (внутри сеанса initialize).
+    void			initCold						( uint32_t start );
+
+    // Повторяет CMD0, пока карта не ответит idle или не выйдет срок.
+    bool			resetCard						( uint32_t start, uint32_t timeoutMs );
+
+    // ACMD41 с аргументом arg до выхода карты из idle. false - ошибка или вышел срок.
+    bool			waitCardReady					( uint32_t arg, uint32_t start, uint32_t timeoutMs );
+
+    // Карта без сброса отвечает (CMD13 не в idle) и ее CID совпадает с запомненным.
+    bool			checkWarm						( void );
+
+    // CMD10: 16 байт CID.
+    EC_SD_RES		readCid							( uint8_t* cid );
+
+    // Выставить скорость SPI: высокая - подобранный шаг setClock, если подбор был.
+    void			applySpeed						( bool fast );
+
+    // CMD6 с приемом 64 байт статуса.
+    EC_SD_RES		switchFunction					( bool set, uint8_t accessMode, uint8_t* status );
+
+    // Проверка и переключение в High Speed. true - карта переключилась.
+    bool			enableHighSpeed					( void );
+
+    // Подбор шага setClock (внутри сеанса initialize).
+    void			tuneClock						( void );
+    EC_SD_RESULT	readTuneSector					( uint32_t sector, uint8_t* buf );
+
+    // Переключение CS.
+    void			csLow							( void );		 // CS = 0, GND.
+    void			csHigh							( void );		 // CS = 1, VDD.
+
+    // Что ищем в потоке от карты.
+    enum class SCAN {
+        MARK			=	0,			// Конкретный байт-маркер.
+        R1				=	1,			// Байт со сброшенным старшим битом.
+        NOT_BUSY		=	2			// Любой ненулевой байт.
+    };
+
+    // Ищет в потоке от карты нужный байт, читая кусками по chunk байт.
+    // Байты, пришедшие после найденного, остаются в scanBuf и будут выданы
+    // следующему readDataPackage (например, начало блока данных после маркера).
+    // limitBytes == 0 - без ограничения по количеству байт (только по времени).
+    EC_SD_RES	scan								( SCAN what, uint8_t mark, uint8_t* value, uint16_t chunk,
+                                                      uint32_t limitBytes, uint32_t timeoutMs );
+
+    // Считывает приходящий пакет в буффер (с учетом уже считанных scan байт).
+    EC_SD_RES	readDataPackage						( uint8_t* buf, uint16_t count, uint32_t timeoutMs = 10 );
+
+    // Передача (ранее считанные, но не востребованные байты отбрасываются).
+    EC_SD_RES	sendDataPackage						( const uint8_t* buf, uint16_t count, uint32_t timeoutMs = 10 );
+
+    // Полнодуплексный обмен одним вызовом драйвера SPI (может идти через DMA).
+    EC_SD_RES	exchangeDataPackage					( const uint8_t* tx, uint8_t* rx, uint16_t count, uint32_t timeoutMs = 10 );
+
+    // Передать count пустых байт (шлем 0xFF).
+    EC_SD_RES	sendEmptyPackage					( const uint16_t count );
+
+    // Ждем от команды специального маркера.
+    EC_SD_RES	waitMark							( const uint8_t mark );
+
+    // Сами отправляем маркер.
+    EC_SD_RES	sendMark							( const uint8_t mark );
+
+    // Передача команды и прием R1 одной полнодуплексной передачей.
+    // tail - сколько байт продолжения ответа (R3/R7) принять в той же передаче,
+    // их выдаст следующий readDataPackage.
+    EC_SD_RES	sendCmd								( const uint8_t cmd, const uint32_t arg, const uint8_t crc,
+                                                      uint8_t* r1 = nullptr, uint8_t tail = 0 );
+
+    // Кадр команды + окно window байт 0xFF под ответ. Возвращает полную длину.
+    uint16_t	fillCmdFrame						( uint8_t* frame, uint8_t cmd, uint32_t arg, uint8_t crc, uint16_t window );
+
+    // Поиск R1 в принятом окне, остаток окна уходит в scanBuf.
+    EC_SD_RES	parseR1								( const uint8_t* rx, uint16_t from, uint16_t len, uint8_t* r1 );
+
+    // Получаем адресс сектора (для аргумента команды чтения/записи).
+    uint32_t	getArgAddress						( const uint32_t sector );
+
+    // Отправить CMD55 + ACMD (одной передачей) и принять R1 на ACMD.
+    EC_SD_RES	sendAcmd							( const uint8_t acmd, const uint32_t arg, const uint8_t crc,
+                                                      uint8_t* r1 = nullptr, uint8_t tail = 0 );
+
+    // Ждать окончания busy (линия данных в 0).
+    EC_SD_RES	waitNotBusy							( uint32_t timeoutMs = MICROSD_SPI_BUSY_TIMEOUT_MS );
+
+    // Ждать busy, только если он остался от предыдущей записи/стирания.
+    EC_SD_RES	waitBusyPending						( void );
+
+    // Принять блок регистра (CSD, SD Status) после R1: маркер, len байт, CRC.
+    EC_SD_RES	readRegister						( uint8_t* buf, uint16_t len );
+
+    // CMD9 + CSD (внутри сеанса).
+    EC_SD_RES	readCsd								( uint8_t* csd );
+
+    // ACMD13: 64 байта SD Status (внутри сеанса).
+    EC_SD_RES	readSdStatus						( uint8_t* reg );
+
+    // Чтение по одному сектору (CMD17).
+    EC_SD_RESULT	readSingleBlocks				( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount );
+
+    // Чтение нескольких секторов одной транзакцией (CMD18 + CMD12).
+    EC_SD_RESULT	readMultipleBlock				( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, bool& rejected );
+
+    // Передача блока данных с проверкой ответа карты и ожиданием окончания записи.
+    EC_SD_RES	sendDataBlock						( const uint8_t* p_buf );
+
+    // Прием 512 байт блока и его CRC (маркер уже принят).
+    EC_SD_RES	readDataBlock						( uint8_t* p_buf );
+
+    EC_SD_RESULT	readSectorOnce					( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t cout_sector );
+    EC_SD_RESULT	writeSectorOnce					( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t cout_sector );
+
+    // Запись по одному сектору (CMD24).
+    EC_SD_RESULT	writeSingleBlocks				( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount );
+
+    // Запись нескольких секторов одной транзакцией (ACMD23 + CMD25).
+    EC_SD_RESULT	writeMultipleBlock				( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t cout_sector, bool& rejected );
+
+    Spi&							spi;
+    Cs&								cs;
+    Policy							policy;
+
+    USER_OS_STATIC_MUTEX_BUFFER		mb;
+    USER_OS_STATIC_MUTEX			m				= nullptr;
+
+    EC_MICRO_SD_TYPE				typeMicrosd		= EC_MICRO_SD_TYPE::ERROR;			 // Тип microSD.
+
+    bool							crcActive		= false;			// Карта приняла CMD59.
+    bool							crcFailed		= false;			// В последнем обмене не сошлась CRC.
+    bool							busyPending		= false;			// Карта может еще программировать flash.
+    uint32_t						busyTimeoutMs	= MICROSD_SPI_BUSY_TIMEOUT_MS;	// Сколько ждать этот busy.
+
+    MicrosdClockTune				tune			= {};
+    MicrosdInitTiming				timing			= {};
+
+    uint8_t							cid[16];
+    bool							cidValid		= false;			// cid прочитан при последней полной инициализации.
+
+    // Считанные при поиске маркера/R1, но еще не востребованные байты.
+    uint8_t							scanBuf[ MICROSD_SPI_SCAN_CHUNK ];
+    uint8_t							scanPos			= 0;
+    uint8_t							scanLen			= 0;
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+    MicrosdSpiBusDevice				busDev			{ MicrosdSpiCore::busConfigure, this };
+#endif
+};
+
+//**********************************************************************
+// Реализация.
+//**********************************************************************
+template < class Spi, class Cs, class Policy >
+MicrosdSpiCore< Spi, Cs, Policy >::MicrosdSpiCore ( Spi& spi, Cs& cs, const Policy& policy ) :
+    spi( spi ), cs( cs ), policy( policy ) {
+    this->m = USER_OS_STATIC_MUTEX_CREATE( &this->mb );
+    microsdSpiCrcInit();
+}
+
+//**********************************************************************
+// Низкоуровневые функции.
+//**********************************************************************
+
+// Управление линией CS.
+template < class Spi, class Cs, class Policy >
+void MicrosdSpiCore< Spi, Cs, Policy >::csLow ( void ) {
+    CsIo::reset( this->cs );
+}
+
+template < class Spi, class Cs, class Policy >
+void MicrosdSpiCore< Spi, Cs, Policy >::csHigh ( void ) {
+    CsIo::set( this->cs );
+}
+
+//**********************************************************************
+// Сеанс обмена.
+//**********************************************************************
+template < class Spi, class Cs, class Policy >
+MicrosdSpiCore< Spi, Cs, Policy >::Session::Session ( MicrosdSpiCore* const sd, bool fast, uint32_t timeoutMs ) : sd( sd ) {
+    MICROSD_STAT_START( this->sd->policy.stat(), t );
+    this->open = ( USER_OS_TAKE_MUTEX( this->sd->m, timeoutMs ) == pdTRUE );
+    MICROSD_STAT( this->sd->policy.stat(), mutexWait( t ) );
+    if ( !this->open ) return;
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+    if ( this->sd->policy.bus() != nullptr ) {
+        /// Скорость выставит шина, если SPI перед этим работал с другим устройством/скоростью.
+        if ( !this->sd->policy.bus()->acquire( &this->sd->busDev, fast ? 1 : 0, timeoutMs ) ) {
+            USER_OS_GIVE_MUTEX( this->sd->m );
+            this->open = false;
+            return;
+        }
+    } else {
+        this->sd->applySpeed( fast );
+    }
+#else
+    this->sd->applySpeed( fast );
+#endif
+
+    this->sd->csLow();
+}
+
+template < class Spi, class Cs, class Policy >
+MicrosdSpiCore< Spi, Cs, Policy >::Session::~Session ( void ) {
+    if ( !this->open ) return;
+
+    this->sd->csHigh();
+    this->sd->sendEmptyPackage( 1 );				// Карта отпускает MISO только по фронту SCLK.
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+    if ( this->sd->policy.bus() != nullptr ) {
+        this->sd->policy.bus()->release( &this->sd->busDev );
+    }
+#endif
+
+    USER_OS_GIVE_MUTEX( this->sd->m );
+}
+
+template < class Spi, class Cs, class Policy >
+bool MicrosdSpiCore< Spi, Cs, Policy >::Session::isOpen ( void ) {
+    return this->open;
+}
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+// SPI шины - тот же, что у карты, поэтому скорость выставляется через свой spi.
+template < class Spi, class Cs, class Policy >
+void MicrosdSpiCore< Spi, Cs, Policy >::busConfigure ( SpiMaster8BitBase* spi, void* ctx, uint32_t mode ) {
+    ( void )spi;
+    ( ( MicrosdSpiCore* )ctx )->applySpeed( mode != 0 );
+}
+
+// Карта продолжает программирование и при снятом CS, а при повторном
+// выборе снова выдает busy, так что ожидание просто продолжается.
+template < class Spi, class Cs, class Policy >
+void MicrosdSpiCore< Spi, Cs, Policy >::yieldBus ( void ) {
+    this->csHigh();
+    this->sendEmptyPackage( 1 );
+    this->policy.bus()->yield( &this->busDev );
+    this->csLow();
+}
+#endif
+
+template < class Spi, class Cs, class Policy >
+void MicrosdSpiCore< Spi, Cs, Policy >::applySpeed ( bool fast ) {
+    if ( fast && this->tune.tuned ) {
+        this->policy.setClock( this->spi, this->tune.setting );
+    } else {
+        this->policy.setSpeed( this->spi, fast );
+    }
+}
+
+// Передать count 0xFF.
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::sendEmptyPackage ( const uint16_t count ) {
+    this->scanPos = this->scanLen = 0;
+    if ( SpiIo::txOneItem( this->spi, 0xFF, count, 10 ) == BASE_RESULT::OK ) {
+        return EC_SD_RES::OK;
+    } else {
+        return EC_SD_RES::IO_ERROR;
+    }
+}
+
+// Сначала отдаем байты, оставшиеся от scan, остальное дочитываем с шины.
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::readDataPackage ( uint8_t* buf, uint16_t count, uint32_t timeoutMs ) {
+    while ( ( count != 0 ) && ( this->scanPos < this->scanLen ) ) {
+        *buf++ = this->scanBuf[ this->scanPos++ ];
+        count--;
+    }
+
+    if ( count == 0 ) return EC_SD_RES::OK;
+
+    if ( SpiIo::rx( this->spi, buf, count, timeoutMs ) != BASE_RESULT::OK ) {
+        MICROSD_STAT( this->policy.stat(), res( EC_SD_RES::IO_ERROR ) );
+        return EC_SD_RES::IO_ERROR;
+    }
+
+    return EC_SD_RES::OK;
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::exchangeDataPackage ( const uint8_t* tx, uint8_t* rx, uint16_t count, uint32_t timeoutMs ) {
+    this->scanPos = this->scanLen = 0;
+
+    if ( SpiIo::tx( this->spi, tx, rx, count, timeoutMs ) != BASE_RESULT::OK ) {
+        MICROSD_STAT( this->policy.stat(), res( EC_SD_RES::IO_ERROR ) );
+        return EC_SD_RES::IO_ERROR;
+    }
+
+    return EC_SD_RES::OK;
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::sendDataPackage ( const uint8_t* buf, uint16_t count, uint32_t timeoutMs ) {
+    // Все, что карта прислала до этого момента, уже не относится к ответу на передачу.
+    this->scanPos = this->scanLen = 0;
+
+    if ( SpiIo::tx( this->spi, buf, count, timeoutMs ) != BASE_RESULT::OK ) {
+        MICROSD_STAT( this->policy.stat(), res( EC_SD_RES::IO_ERROR ) );
+        return EC_SD_RES::IO_ERROR;
+    }
+
+    return EC_SD_RES::OK;
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::scan ( SCAN what, uint8_t mark, uint8_t* value, uint16_t chunk,
+                                                    uint32_t limitBytes, uint32_t timeoutMs ) {
+    uint32_t budget		= this->policy.spinBudget();
+    uint32_t start		= USER_OS_GET_TICK_COUNT();
+    uint32_t spin		= 0;
+    uint32_t total		= 0;
+    EC_SD_RES r			= EC_SD_RES::TIMEOUT;
+
+    if ( chunk > MICROSD_SPI_SCAN_CHUNK ) chunk = MICROSD_SPI_SCAN_CHUNK;
+
+    while ( true ) {
+        if ( this->scanPos == this->scanLen ) {
+            uint32_t n = chunk;
+            if ( ( limitBytes != 0 ) && ( ( limitBytes - total ) < n ) ) {
+                n = limitBytes - total;
+            }
+
+            this->scanPos = this->scanLen = 0;
+            if ( SpiIo::rx( this->spi, this->scanBuf, ( uint16_t )n, 10 ) != BASE_RESULT::OK ) {
+                r = EC_SD_RES::IO_ERROR;
+                break;
+            }
+            this->scanLen = ( uint8_t )n;
+        }
+
+        while ( this->scanPos < this->scanLen ) {
+            uint8_t b = this->scanBuf[ this->scanPos++ ];
+            total++;
+            spin++;
+
+            bool found;
+            switch ( what ) {
+            case SCAN::MARK:		found = ( b == mark );				break;
+            case SCAN::R1:			found = ( ( b & ( 1 << 7 ) ) == 0 );	break;
+            default:				found = ( b != 0 );					break;
+            }
+
+            if ( found ) {
+                if ( value != nullptr ) {
+                    *value = b;
+                }
+                r = EC_SD_RES::OK;
+                break;
+            }
+
+            if ( ( limitBytes != 0 ) && ( total >= limitBytes ) ) break;
+        }
+
+        if ( r == EC_SD_RES::OK ) break;
+        if ( ( limitBytes != 0 ) && ( total >= limitBytes ) ) break;
+
+        // Отдаем процессор только после исчерпания бюджета опроса,
+        // короткие ожидания обслуживаются без переключения задач.
+        if ( spin >= budget ) {
+            spin = 0;
+            if ( ( uint32_t )( USER_OS_GET_TICK_COUNT() - start ) >= timeoutMs ) break;
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+            /// Пока карта программирует flash, шина нужнее другим устройствам.
+            if ( ( what == SCAN::NOT_BUSY ) && ( this->policy.bus() != nullptr ) && this->policy.bus()->hasWaiters() ) {
+                this->yieldBus();
+                MICROSD_STAT( this->policy.stat(), yield() );
+                continue;
+            }
+#endif
+
+            USER_OS_TASK_YIELD();
+            MICROSD_STAT( this->policy.stat(), yield() );
+        }
+    }
+
+    MICROSD_STAT( this->policy.stat(), spins( total ) );
+    if ( r != EC_SD_RES::OK ) {
+        MICROSD_STAT( this->policy.stat(), res( r ) );
+    }
+
+    return r;
+}
+
+// Ждем от карты "маркер"
+// - специальный байт, показывающий, что далее идет команда/данные.
+// Пришедшие следом за маркером байты данных остаются в scanBuf.
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::waitMark ( uint8_t mark ) {
+    EC_SD_RES r = this->scan( SCAN::MARK, mark, nullptr, MICROSD_SPI_SCAN_CHUNK, 0, MICROSD_SPI_MARK_TIMEOUT_MS );
+    if ( r == EC_SD_RES::OK ) {
+        MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::TOKEN, mark );
+    }
+    return r;
+}
+
+// Кадр команды (6 байт) + окно под ответ, заполненное 0xFF.
+// Возвращает длину кадра вместе с окном.
+template < class Spi, class Cs, class Policy >
+uint16_t MicrosdSpiCore< Spi, Cs, Policy >::fillCmdFrame ( uint8_t* frame, uint8_t cmd, uint32_t arg, uint8_t crc, uint16_t window ) {
+    microsdSpiFillCmd( frame, cmd, arg, crc );
+
+    for ( uint16_t i = 0; i < window; i++ ) {
+        frame[ 6 + i ] = 0xFF;
+    }
+
+    return 6 + window;
+}
+
+// Ищет R1 в окне NCR, начиная с from.
+// Байты после R1 (R3/R7, начало данных) перекладываются в scanBuf.
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::parseR1 ( const uint8_t* rx, uint16_t from, uint16_t len, uint8_t* r1 ) {
+    uint16_t i = microsdSpiFindR1( rx, from, len );
+    if ( i == len ) {
+        MICROSD_STAT( this->policy.stat(), res( EC_SD_RES::TIMEOUT ) );
+        return EC_SD_RES::TIMEOUT;
+    }
+
+    if ( r1 != nullptr ) {
+        *r1 = rx[ i ];
+    }
+
+    this->scanPos = this->scanLen = 0;
+    for ( i++; i < len; i++ ) {
+        this->scanBuf[ this->scanLen++ ] = rx[ i ];
+    }
+
+    return EC_SD_RES::OK;
+}
+
+// Передача команды и прием R1 одной полнодуплексной передачей:
+// кадр команды + NCR + R1 + tail байт продолжения ответа (4 для R3/R7).
+// Продолжение ответа забирается readDataPackage.
+// Если карта еще программирует ранее записанные данные - сначала дожидаемся ее.
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::sendCmd ( uint8_t cmd, uint32_t arg, uint8_t crc, uint8_t* r1, uint8_t tail ) {
+    EC_SD_RES r = this->waitBusyPending();
+    if ( r != EC_SD_RES::OK ) return r;
+
+    // После CMD12 карта выдает 1 "мусорный" байт (он может быть похож на R1).
+    uint16_t skip = ( cmd == MICROSD_SPI_CMD( 12 ) ) ? 1 : 0;
+
+    uint8_t tx[ MICROSD_SPI_CMD_FRAME_MAX ];
+    uint8_t rx[ MICROSD_SPI_CMD_FRAME_MAX ];
+    uint16_t len = this->fillCmdFrame( tx, cmd, arg, crc, skip + MICROSD_SPI_NCR_MAX + 1 + tail );
+
+    MICROSD_STAT( this->policy.stat(), cmd( cmd & 0x3F ) );
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::CMD, cmd & 0x3F, 0, arg );
+
+    r = this->exchangeDataPackage( tx, rx, len );
+    if ( r != EC_SD_RES::OK ) return r;
+
+    uint8_t resp = 0xFF;
+    r = this->parseR1( rx, 6 + skip, len, &resp );
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::RESPONSE, resp );
+    if ( ( r == EC_SD_RES::OK ) && ( r1 != nullptr ) ) {
+        *r1 = resp;
+    }
+
+    return r;
+}
+
+// Сами отправляем маркер (нужно, например, для записи).
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::sendMark ( uint8_t mark ) {
+    return this->sendDataPackage( &mark, 1 );
+}
+
+// Ждем, пока карта держит линию в 0 (busy после R1b или записи).
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::waitNotBusy ( uint32_t timeoutMs ) {
+    MICROSD_STAT_START( this->policy.stat(), t );
+    EC_SD_RES r = this->scan( SCAN::NOT_BUSY, 0, nullptr, MICROSD_SPI_SCAN_CHUNK, 0, timeoutMs );
+    MICROSD_STAT( this->policy.stat(), busy( t ) );
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::BUSY_END, ( uint8_t )r );
+    return r;
+}
+
+// Отложенное ожидание окончания записи.
+// При снятом CS карта отпускает линию, при повторном выборе снова выдает busy,
+// так что проверка корректна в любой момент сеанса.
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::waitBusyPending ( void ) {
+    if ( !this->busyPending ) return EC_SD_RES::OK;
+    this->busyPending = false;						// Даже при таймауте не ждем повторно.
+    uint32_t timeoutMs = this->busyTimeoutMs;
+    this->busyTimeoutMs = MICROSD_SPI_BUSY_TIMEOUT_MS;
+    return this->waitNotBusy( timeoutMs );
+}
+
+// Блок регистра приходит как обычный блок данных (маркер 0xFE + данные + CRC16).
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::readRegister ( uint8_t* buf, uint16_t len ) {
+    EC_SD_RES r = this->waitMark( MICROSD_SPI_TOKEN_BLOCK );
+    if ( r != EC_SD_RES::OK )	return r;
+
+    r = this->readDataPackage( buf, len );
+    if ( r != EC_SD_RES::OK )	return r;
+
+    uint8_t crc_in[2];
+    r = this->readDataPackage( crc_in, 2 );
+    if ( r != EC_SD_RES::OK )	return r;
+
+    if ( this->crcActive ) {
+        if ( ( uint16_t )( ( crc_in[ 0 ] << 8 ) | crc_in[ 1 ] ) != microsdSpiCrc16( buf, len ) ) {
+            MICROSD_STAT( this->policy.stat(), res( EC_SD_RES::CRC_ERROR ) );
+            return EC_SD_RES::CRC_ERROR;
+        }
+    }
+
+    return EC_SD_RES::OK;
+}
+
+// CMD55 и ACMD одной полнодуплексной передачей.
+// ACMD ставится в кадр сразу за окном ответа CMD55 (+1 байт паузы NRC):
+// R1 на CMD55 к этому моменту уже гарантированно пришел.
+// Если CMD55 не принята - информируем об ошибке (ответ на ACMD игнорируется).
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::sendAcmd ( uint8_t acmd, uint32_t arg, uint8_t crc, uint8_t* r1, uint8_t tail ) {
+    EC_SD_RES r = this->waitBusyPending();
+    if ( r != EC_SD_RES::OK ) return r;
+
+    uint8_t tx[ MICROSD_SPI_ACMD_FRAME_MAX ];
+    uint8_t rx[ MICROSD_SPI_ACMD_FRAME_MAX ];
+    uint16_t first	= this->fillCmdFrame( tx, MICROSD_SPI_CMD( 55 ), 0, microsdSpiCrc7( MICROSD_SPI_CMD( 55 ), 0 ), MICROSD_SPI_NCR_MAX + 1 + 1 );
+    uint16_t len	= first + this->fillCmdFrame( &tx[ first ], acmd, arg, crc, MICROSD_SPI_NCR_MAX + 1 + tail );
+
+    MICROSD_STAT( this->policy.stat(), cmd( 55 ) );
+    MICROSD_STAT( this->policy.stat(), acmd( acmd & 0x3F ) );
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::CMD, ( acmd & 0x3F ) | MICROSD_TRACE_ACMD_FLAG, 0, arg );
+
+    r = this->exchangeDataPackage( tx, rx, len );
+    if ( r != EC_SD_RES::OK )				return r;
+
+    uint8_t r1_55;
+    r = this->parseR1( rx, 6, first, &r1_55 );
+    if ( r != EC_SD_RES::OK )				return r;
+    if ( r1_55 & ~MICROSD_SPI_R1_IDLE ) {
+        MICROSD_STAT( this->policy.stat(), res( EC_SD_RES::R1_ILLEGAL_COMMAND ) );
+        return EC_SD_RES::R1_ILLEGAL_COMMAND;
+    }
+
+    uint8_t resp = 0xFF;
+    r = this->parseR1( rx, first + 6, len, &resp );
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::RESPONSE, resp );
+    if ( ( r == EC_SD_RES::OK ) && ( r1 != nullptr ) ) {
+        *r1 = resp;
+    }
+
+    return r;
+}
+
+// Получая сектор, возвращает адресс, который следует отправить с параметром карты.
+// Иначе говоря, в зависимости от типа адресации либо возвращает тот же номер сектора,
+// либо номер первого байта.
+template < class Spi, class Cs, class Policy >
+uint32_t MicrosdSpiCore< Spi, Cs, Policy >::getArgAddress ( uint32_t sector ) {
+    if ( !( ( uint32_t )this->typeMicrosd & ( uint32_t )EC_MICRO_SD_TYPE::BLOCK ) )
+        sector *= 512;
+    return sector;
+}
+
+//**********************************************************************
+// Основной функционал.
+//**********************************************************************
+template < class Spi, class Cs, class Policy >
+uint32_t MicrosdSpiCore< Spi, Cs, Policy >::phaseMs ( uint32_t& phase ) {
+    uint32_t now = USER_OS_GET_TICK_COUNT();
+    uint32_t ms = now - phase;
+    phase = now;
+    return ms;
+}
+
+// Определяем тип карты и инициализируем ее.
+template < class Spi, class Cs, class Policy >
+EC_MICRO_SD_TYPE MicrosdSpiCore< Spi, Cs, Policy >::initialize ( void ) {
+    MICROSD_STAT_START( this->policy.stat(), t );
+    Session session( this, false );
+
+    const uint32_t start = USER_OS_GET_TICK_COUNT();
+    uint32_t phase = start;
+    this->timing = {};
+
+    /// Та же карта без сброса: тип, CRC, High Speed и подобранная частота остаются прежними.
+    if ( this->policy.warmInit() && this->cidValid && ( this->typeMicrosd != EC_MICRO_SD_TYPE::ERROR ) &&
+         this->checkWarm() ) {
+        this->timing.warm		= true;
+        this->timing.resetMs	= phaseMs( phase );
+    } else {
+        this->initCold( start );
+    }
+
+    // Теперь с SD можно работать на высоких скоростях.
+    // С общей шиной скорость выставит шина при следующем сеансе (этот открыт на низкой).
+    if ( this->typeMicrosd != EC_MICRO_SD_TYPE::ERROR ) {
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+        if ( this->policy.bus() == nullptr ) {
+            this->applySpeed( true );
+        }
+#else
+        this->applySpeed( true );
+#endif
+    }
+
+    this->timing.totalMs = USER_OS_GET_TICK_COUNT() - start;
+
+    MICROSD_STAT( this->policy.stat(), op( EC_MICROSD_STAT_OP::OTHER, t ) );
+
+    return this->typeMicrosd;
+}
+
+template < class Spi, class Cs, class Policy >
+void MicrosdSpiCore< Spi, Cs, Policy >::initCold ( uint32_t start ) {
+    const uint32_t timeoutMs = this->policy.initTimeoutMs();
+    uint32_t phase = USER_OS_GET_TICK_COUNT();
+    uint8_t r1;
+
+    this->typeMicrosd = EC_MICRO_SD_TYPE::ERROR;
+    this->tune = {};								// После CMD0 карта снова в Default Speed.
+    this->busyPending = false;						// Карта сбрасывается CMD0.
+    this->busyTimeoutMs = MICROSD_SPI_BUSY_TIMEOUT_MS;
+    this->crcActive = false;
+    this->cidValid = false;
+
+    // Перед CMD0 карте нужно не менее 74 тактов при снятом CS.
+    this->csHigh();
+    this->sendEmptyPackage( 10 );
+    this->csLow();
+
+    if ( !this->resetCard( start, timeoutMs ) )								return;
+    this->timing.resetMs = phaseMs( phase );
+
+    if ( this->sendCmd( MICROSD_SPI_CMD( 8 ), 0x1AA, 0x87, &r1, 4 )	!= EC_SD_RES::OK )			return;
+
+    /// CMD8 поддерживается.
+    if ( !( r1 & MICROSD_SPI_R1_ILLEGAL_COMMAND ) ) {
+        uint8_t	ocr[4];
+        if ( this->readDataPackage( ocr, 4 ) != EC_SD_RES::OK )					return;
+        if ( !( ocr[2] == 0x01 && ocr[3] == 0xAA ) )							return;
+
+        if ( !this->waitCardReady( MICROSD_SPI_ACMD41_HCS, start, timeoutMs ) )	return;
+        this->timing.readyMs = phaseMs( phase );
+
+        if ( this->sendCmd( MICROSD_SPI_CMD( 58 ), 0, microsdSpiCrc7( MICROSD_SPI_CMD( 58 ), 0 ), &r1, 4 ) != EC_SD_RES::OK )	return;
+        if ( this->readDataPackage( ocr, 4 ) != EC_SD_RES::OK )					return;
+
+        if ( ocr[0] & 0x40 ) {
+            this->typeMicrosd = ( EC_MICRO_SD_TYPE )( ( uint32_t )EC_MICRO_SD_TYPE::SD2 | ( uint32_t )EC_MICRO_SD_TYPE::BLOCK );
+        } else {
+            this->typeMicrosd = EC_MICRO_SD_TYPE::SD2;
+        }
+    } else {
+        /// SD ver 1. MMC (ACMD41 - illegal command) не поддерживается.
+        if ( !this->waitCardReady( 0, start, timeoutMs ) )						return;
+        this->timing.readyMs = phaseMs( phase );
+
+        if ( this->sendCmd( MICROSD_SPI_CMD( 16 ), 512, microsdSpiCrc7( MICROSD_SPI_CMD( 16 ), 512 ) ) != EC_SD_RES::OK )		return;
+        this->typeMicrosd = EC_MICRO_SD_TYPE::SD1;
+    }
+
+    /// Включаем проверку CRC, если карта ее поддерживает.
+    if ( this->policy.crc() ) {
+        if ( ( this->sendCmd( MICROSD_SPI_CMD( 59 ), 1, microsdSpiCrc7( MICROSD_SPI_CMD( 59 ), 1 ), &r1 ) == EC_SD_RES::OK ) && ( r1 == 0 ) ) {
+            this->crcActive = true;
+        }
+    }
+
+    /// CID нужен только для узнавания карты при повторном initialize.
+    if ( this->policy.warmInit() ) {
+        this->cidValid = ( this->readCid( this->cid ) == EC_SD_RES::OK );
+    }
+
+    /// CMD6 есть только у SD (начиная с 1.10, более старые ответят illegal command).
+    if ( ( ( uint32_t )this->typeMicrosd & ( uint32_t )EC_MICRO_SD_TYPE::SDC ) && this->policy.highSpeed() ) {
+        this->tune.highSpeed = this->enableHighSpeed();
+    }
+    this->timing.configMs = phaseMs( phase );
+
+    if ( this->policy.clockSteps() != 0 ) {
+        this->tuneClock();
+        this->timing.tuneMs = phaseMs( phase );
+    }
+}
+
+// Первый CMD0 карта может пропустить (например, сразу после установки
+// или посреди прерванного обмена), поэтому повторяем его до срока.
+template < class Spi, class Cs, class Policy >
+bool MicrosdSpiCore< Spi, Cs, Policy >::resetCard ( uint32_t start, uint32_t timeoutMs ) {
+    uint8_t r1;
+
+    while ( ( this->sendCmd( MICROSD_SPI_CMD( 0 ), 0, 0x95, &r1 ) != EC_SD_RES::OK ) || ( r1 != MICROSD_SPI_R1_IDLE ) ) {
+        if ( ( USER_OS_GET_TICK_COUNT() - start ) >= timeoutMs ) return false;
+        USER_OS_DELAY_MS( 1 );
+    }
+
+    return true;
+}
+
+// Ожидание ограничено сроком, а не числом запросов: время готовности
+// не зависит от частоты SPI, а опрос с паузами не занимает процессор.
+template < class Spi, class Cs, class Policy >
+bool MicrosdSpiCore< Spi, Cs, Policy >::waitCardReady ( uint32_t arg, uint32_t start, uint32_t timeoutMs ) {
+    uint32_t pause = 1;
+    uint8_t r1;
+
+    while ( true ) {
+        if ( this->sendAcmd( MICROSD_SPI_CMD( 41 ), arg, microsdSpiCrc7( MICROSD_SPI_CMD( 41 ), arg ), &r1 ) != EC_SD_RES::OK )	return false;
+        this->timing.attempts++;
+
+        if ( r1 == 0 )								return true;
+        if ( r1 != MICROSD_SPI_R1_IDLE )			return false;
+        if ( ( USER_OS_GET_TICK_COUNT() - start ) >= timeoutMs )	return false;
+
+        if ( this->timing.attempts >= MICROSD_SPI_INIT_FAST_POLLS ) {
+            USER_OS_DELAY_MS( pause );
+            if ( pause < MICROSD_SPI_INIT_PAUSE_MAX_MS ) {
+                pause *= 2;
+            }
+        }
+    }
+}
+
+// Карта, у которой снимали питание, находится в режиме SD и на CMD13 не ответит,
+// сброшенная - ответит idle. Замененную (или переставленную) отличит CID.
+template < class Spi, class Cs, class Policy >
+bool MicrosdSpiCore< Spi, Cs, Policy >::checkWarm ( void ) {
+    uint8_t r1, r2;
+
+    if ( this->sendCmd( MICROSD_SPI_CMD( 13 ), 0, microsdSpiCrc7( MICROSD_SPI_CMD( 13 ), 0 ), &r1, 1 ) != EC_SD_RES::OK )	return false;
+    if ( this->readDataPackage( &r2, 1 ) != EC_SD_RES::OK )									return false;
+    if ( ( r1 != 0 ) || ( r2 != 0 ) )															return false;
+
+    uint8_t cid[16];
+    if ( this->readCid( cid ) != EC_SD_RES::OK )												return false;
+
+    return memcmp( cid, this->cid, sizeof( cid ) ) == 0;
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::readCid ( uint8_t* cid ) {
+    uint8_t r1;
+    EC_SD_RES r = this->sendCmd( MICROSD_SPI_CMD( 10 ), 0, microsdSpiCrc7( MICROSD_SPI_CMD( 10 ), 0 ), &r1 );
+    if ( r != EC_SD_RES::OK )	return r;
+    if ( r1 != 0 )				return EC_SD_RES::IO_ERROR;
+
+    return this->readRegister( cid, 16 );
+}
+
+// Статус CMD6 приходит блоком данных 64 байта.
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::switchFunction ( bool set, uint8_t accessMode, uint8_t* status ) {
+    uint32_t arg = microsdGetSwitchArg( set, accessMode );
+
+    uint8_t r1;
+    EC_SD_RES r = this->sendCmd( MICROSD_SPI_CMD( 6 ), arg, microsdSpiCrc7( MICROSD_SPI_CMD( 6 ), arg ), &r1 );
+    if ( r != EC_SD_RES::OK )						return r;
+    if ( r1 & MICROSD_SPI_R1_ILLEGAL_COMMAND )		return EC_SD_RES::R1_ILLEGAL_COMMAND;
+    if ( r1 != 0 )									return EC_SD_RES::IO_ERROR;
+
+    return this->readRegister( status, 64 );
+}
+
+// Сначала проверка (карта сообщает, что выбрала бы), затем переключение.
+// Новый режим действует через 8 тактов после статуса - их даст следующая команда.
+template < class Spi, class Cs, class Policy >
+bool MicrosdSpiCore< Spi, Cs, Policy >::enableHighSpeed ( void ) {
+    uint8_t status[ 64 ];
+
+    if ( this->switchFunction( false, MICROSD_SWITCH_ACCESS_HIGH_SPEED, status ) != EC_SD_RES::OK )	return false;
+    if ( !microsdSwitchSupported( status, MICROSD_SWITCH_ACCESS_HIGH_SPEED ) )							return false;
+    if ( microsdSwitchSelected( status ) != MICROSD_SWITCH_ACCESS_HIGH_SPEED )							return false;
+
+    if ( this->switchFunction( true, MICROSD_SWITCH_ACCESS_HIGH_SPEED, status ) != EC_SD_RES::OK )	return false;
+    return microsdSwitchSelected( status ) == MICROSD_SWITCH_ACCESS_HIGH_SPEED;
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::readTuneSector ( uint32_t sector, uint8_t* buf ) {
+    MicrosdSegment seg = { buf, 1 };
+    this->crcFailed = false;
+    EC_SD_RESULT r = this->readSingleBlocks( sector, &seg, 1 );
+    return this->crcFailed ? EC_SD_RESULT::ERROR : r;
+}
+
+// Эталон - CRC16 первых секторов, считанных на низкой скорости. На каждом шаге
+// они читаются MICROSD_SPI_TUNE_PASSES раз и должны совпасть с эталоном
+// (при включенном CMD59 искажение к тому же ловится CRC блока).
+// Шаги проверяются по возрастанию до первого сбоя.
+template < class Spi, class Cs, class Policy >
+void MicrosdSpiCore< Spi, Cs, Policy >::tuneClock ( void ) {
+    uint8_t buf[ 512 ];
+    uint16_t ref[ MICROSD_SPI_TUNE_SECTORS ];
+
+    for ( uint32_t s = 0; s < MICROSD_SPI_TUNE_SECTORS; s++ ) {
+        if ( this->readTuneSector( s, buf ) != EC_SD_RESULT::OK ) return;
+        ref[ s ] = microsdSpiCrc16( buf, 512 );
+    }
+
+    for ( uint32_t step = 0; step < this->policy.clockSteps(); step++ ) {
+        this->policy.setClock( this->spi, step );
+        this->tune.checked++;
+
+        bool ok = true;
+        for ( uint32_t pass = 0; ( pass < MICROSD_SPI_TUNE_PASSES ) && ok; pass++ ) {
+            for ( uint32_t s = 0; ( s < MICROSD_SPI_TUNE_SECTORS ) && ok; s++ ) {
+                ok = ( this->readTuneSector( s, buf ) == EC_SD_RESULT::OK ) && ( microsdSpiCrc16( buf, 512 ) == ref[ s ] );
+            }
+        }
+
+        if ( !ok ) {
+            /// Карта могла остаться посреди блока - дочитываем его на низкой скорости.
+            this->policy.setSpeed( this->spi, false );
+            this->sendEmptyPackage( 512 + 2 + MICROSD_SPI_NCR_MAX );
+            break;
+        }
+
+        this->tune.tuned	= true;
+        this->tune.setting	= step;
+    }
+
+    /// До конца initialize сеанс остается на низкой скорости.
+    this->policy.setSpeed( this->spi, false );
+}
+
+template < class Spi, class Cs, class Policy >
+void MicrosdSpiCore< Spi, Cs, Policy >::getClockTune ( MicrosdClockTune& tune ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    tune = this->tune;
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+template < class Spi, class Cs, class Policy >
+void MicrosdSpiCore< Spi, Cs, Policy >::getInitTiming ( MicrosdInitTiming& timing ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    timing = this->timing;
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_STATUS MicrosdSpiCore< Spi, Cs, Policy >::getStatus ( void ) {
+    if ( this->getType() == EC_MICRO_SD_TYPE::ERROR ) {
+        return EC_SD_STATUS::NOINIT;
+    }
+
+    Session session( this, true );
+
+    uint8_t r1;
+    if ( this->sendCmd( MICROSD_SPI_CMD( 1 ), 0, microsdSpiCrc7( MICROSD_SPI_CMD( 1 ), 0 ), &r1 )	!= EC_SD_RES::OK ) {
+        return EC_SD_STATUS::NOINIT;
+    }
+
+    if ( r1 != 0 ) {
+        return EC_SD_STATUS::NOINIT;
+    }
+
+    return EC_SD_STATUS::OK;
+}
+
+template < class Spi, class Cs, class Policy >
+EC_MICRO_SD_TYPE MicrosdSpiCore< Spi, Cs, Policy >::getType ( void ) {
+    return this->typeMicrosd;
+}
+
+// Считать сектор.
+// dst - указатель на массив, куда считать 512 байт.
+// sector - требуемый сектор, с 0.
+// Предполагается, что с картой все хорошо (она определена, инициализирована).
+// Выравнивание буфера не требуется: обмен идет через побайтовый SPI.
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::readSector ( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms	) {
+    MicrosdSegment seg = { target_array, cout_sector };
+    return this->readSectors( sector, &seg, 1, timeout_ms );
+}
+
+// Все фрагменты читаются одной командой CMD18.
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::readSectors ( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t timeout_ms ) {
+    ( void )timeout_ms;
+
+    EC_SD_RESULT r = EC_SD_RESULT::ERROR;
+    uint32_t cout_sector = microsdGetSegmentsSectors( seg, segCount );
+
+    MICROSD_STAT_START( this->policy.stat(), t );
+    Session session( this, true );
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::OP_START, ( uint8_t )EC_MICROSD_TRACE_OP::READ, ( uint16_t )cout_sector, sector );
+
+    /// При ошибке CRC запрос повторяется целиком.
+    for ( uint32_t attempt = 0; attempt <= this->policy.crcRetries(); attempt++ ) {
+        if ( attempt != 0 ) {
+            MICROSD_STAT( this->policy.stat(), retry() );
+        }
+        this->crcFailed = false;
+        r = this->readSectorOnce( sector, seg, segCount, cout_sector );
+        if ( !this->crcFailed ) break;
+    }
+
+    MICROSD_STAT( this->policy.stat(), op( EC_MICROSD_STAT_OP::READ, t ) );
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::OP_END, ( uint8_t )r );
+    MICROSD_STAT( this->policy.stat(), result( r ) );
+
+    return r;
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::readSectorOnce ( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t cout_sector ) {
+    EC_SD_RESULT r = EC_SD_RESULT::ERROR;
+
+    /// Несколько секторов читаем одной командой CMD18 (если карта ее понимает).
+    bool multiRejected = false;
+    if ( cout_sector > 1 ) {
+        r = this->readMultipleBlock( sector, seg, segCount, multiRejected );
+    }
+
+    if ( ( cout_sector == 1 ) || multiRejected ) {
+        r = this->readSingleBlocks( sector, seg, segCount );
+    }
+
+    return r;
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::readDataBlock ( uint8_t* p_buf ) {
+    EC_SD_RES r = EC_SD_RES::IO_ERROR;
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::DATA_START, 0, 1 );
+
+    do {
+        if ( this->readDataPackage( p_buf, 512, 100 )	!= EC_SD_RES::OK )	break;
+        uint8_t crc_in[2] = {0xFF, 0xFF};
+        if ( this->readDataPackage( crc_in, 2 )			!= EC_SD_RES::OK )	break;
+
+        if ( this->crcActive ) {
+            uint16_t crc = ( uint16_t )( ( crc_in[ 0 ] << 8 ) | crc_in[ 1 ] );
+            if ( crc != microsdSpiCrc16( p_buf, 512 ) ) {
+                MICROSD_STAT( this->policy.stat(), res( EC_SD_RES::CRC_ERROR ) );
+                this->crcFailed = true;
+                r = EC_SD_RES::CRC_ERROR;
+                break;
+            }
+        }
+
+        r = EC_SD_RES::OK;
+    } while( false );
+
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::DATA_END, ( uint8_t )r );
+    return r;
+}
+
+// Чтение по одному сектору командой CMD17.
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::readSingleBlocks ( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount ) {
+    EC_SD_RESULT r = EC_SD_RESULT::ERROR;
+    uint32_t address;
+
+    MicrosdSegmentCursor blocks( seg, segCount );
+    uint8_t* p_buf = blocks.next();
+
+    do {
+        address = this->getArgAddress( sector );									// В зависимости от типа карты - адресация может быть побайтовая или поблочная
+                                                                                    // (блок - 512 байт).
+
+        uint8_t r1;
+        if ( this->sendCmd( MICROSD_SPI_CMD( 17 ), address, microsdSpiCrc7( MICROSD_SPI_CMD( 17 ), address ), &r1 )	!= EC_SD_RES::OK ) break;			// Отправляем CMD17.
+        if ( r1 != 0 ) break;
+        if ( this->waitMark( MICROSD_SPI_TOKEN_BLOCK )	!= EC_SD_RES::OK ) break;
+
+        // Считываем 512 байт.
+        if ( this->readDataBlock( p_buf )			!= EC_SD_RES::OK ) break;
+        if ( this->sendEmptyPackage( 1 )			!= EC_SD_RES::OK ) break;
+
+        p_buf = blocks.next();				// 512 байт уже считали.
+
+        if ( p_buf == nullptr ) {
+            r = EC_SD_RESULT::OK;
+            break;
+        } else {
+            sector++;							// Будем читать следующий сектор.
+        }
+
+    }	while ( true );
+
+    return r;
+}
+
+// Чтение cout_sector секторов одной командой CMD18 с остановкой CMD12.
+// Если карта не поддерживает CMD18 (часть MMC/SD1) - rejected = true,
+// и чтение следует повторить по одному сектору.
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::readMultipleBlock ( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, bool& rejected ) {
+    EC_SD_RESULT r = EC_SD_RESULT::ERROR;
+    uint32_t address = this->getArgAddress( sector );
+
+    rejected = false;
+
+    do {
+        uint8_t r1;
+        if ( this->sendCmd( MICROSD_SPI_CMD( 18 ), address, microsdSpiCrc7( MICROSD_SPI_CMD( 18 ), address ), &r1 )	!= EC_SD_RES::OK ) break;
+        if ( r1 & MICROSD_SPI_R1_ILLEGAL_COMMAND ) {
+            rejected = true;
+            break;
+        }
+        if ( r1 != 0 ) break;
+
+        bool dataOk = true;
+        MicrosdSegmentCursor blocks( seg, segCount );
+        uint8_t* p_buf;
+        while ( ( p_buf = blocks.next() ) != nullptr ) {
+            if ( this->waitMark( MICROSD_SPI_TOKEN_BLOCK )		!= EC_SD_RES::OK ) { dataOk = false; break; }
+            if ( this->readDataBlock( p_buf )					!= EC_SD_RES::OK ) { dataOk = false; break; }
+        }
+
+        // Останавливаем передачу в любом случае (даже после ошибки).
+        // После CMD12 карта выдает 1 "мусорный" байт (пропускает sendCmd), затем R1b.
+        if ( this->sendCmd( MICROSD_SPI_CMD( 12 ), 0, microsdSpiCrc7( MICROSD_SPI_CMD( 12 ), 0 ) )	!= EC_SD_RES::OK ) break;
+        if ( this->waitNotBusy()									!= EC_SD_RES::OK ) break;
+
+        if ( dataOk ) {
+            r = EC_SD_RESULT::OK;
+        }
+    } while ( false );
+
+    return r;
+}
+
+// Записать по адресу address массив src длинной 512 байт.
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::writeSector ( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms	) {
+    MicrosdSegment seg = { ( uint8_t* )source_array, cout_sector };
+    return this->writeSectors( sector, &seg, 1, timeout_ms );
+}
+
+// Все фрагменты пишутся одной командой CMD25.
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::writeSectors ( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t timeout_ms ) {
+    ( void )timeout_ms;
+
+    EC_SD_RESULT r = EC_SD_RESULT::ERROR;
+    uint32_t cout_sector = microsdGetSegmentsSectors( seg, segCount );
+
+    MICROSD_STAT_START( this->policy.stat(), t );
+    Session session( this, true );
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::OP_START, ( uint8_t )EC_MICROSD_TRACE_OP::WRITE, ( uint16_t )cout_sector, sector );
+
+    /// При ошибке CRC (карта отвечает 0b1011) запрос повторяется целиком.
+    for ( uint32_t attempt = 0; attempt <= this->policy.crcRetries(); attempt++ ) {
+        if ( attempt != 0 ) {
+            MICROSD_STAT( this->policy.stat(), retry() );
+        }
+        this->crcFailed = false;
+        r = this->writeSectorOnce( sector, seg, segCount, cout_sector );
+        if ( !this->crcFailed ) break;
+    }
+
+    MICROSD_STAT( this->policy.stat(), op( EC_MICROSD_STAT_OP::WRITE, t ) );
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::OP_END, ( uint8_t )r );
+    MICROSD_STAT( this->policy.stat(), result( r ) );
+
+    return r;
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::writeSectorOnce ( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t cout_sector ) {
+    EC_SD_RESULT r = EC_SD_RESULT::ERROR;
+
+    /// Несколько секторов пишем одной командой CMD25 (если карта ее понимает).
+    bool multiRejected = false;
+    if ( cout_sector > 1 ) {
+        r = this->writeMultipleBlock( sector, seg, segCount, cout_sector, multiRejected );
+    }
+
+    if ( ( cout_sector == 1 ) || multiRejected ) {
+        r = this->writeSingleBlocks( sector, seg, segCount );
+    }
+
+    return r;
+}
+
+// Передает 512 байт блока и CRC, после чего проверяет ответ карты о приеме данных.
+// Окончания программирования не ждем (busyPending).
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::sendDataBlock ( const uint8_t* p_buf ) {
+    EC_SD_RES r = EC_SD_RES::IO_ERROR;
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::DATA_START, 0, 1 );
+
+    do {
+        if ( this->sendDataPackage( p_buf, 512, 100 )	!= EC_SD_RES::OK )	break;
+        uint8_t crc_out[2] = { 0 };						// Без CRC режима отправляем любой CRC.
+        if ( this->crcActive ) {
+            uint16_t crc = microsdSpiCrc16( p_buf, 512 );
+            crc_out[ 0 ] = ( uint8_t )( crc >> 8 );
+            crc_out[ 1 ] = ( uint8_t )crc;
+        }
+        if ( this->sendDataPackage( crc_out, 2, 100 )	!= EC_SD_RES::OK )	break;
+
+        // Сразу же должен прийти ответ - принята ли команда записи.
+        uint8_t answer_write_commend_in;
+        if ( this->readDataPackage( &answer_write_commend_in, 1 ) != EC_SD_RES::OK )	break;
+        if ( ( answer_write_commend_in & ( 1 << 4 ) ) != 0 )	break;
+        answer_write_commend_in &= 0b1111;
+
+        // После ответа карта держит busy в любом случае.
+        this->busyPending = true;
+
+        if ( answer_write_commend_in == MICROSD_SPI_DATA_CRC_ERROR ) {						// Карта не приняла CRC.
+            MICROSD_STAT( this->policy.stat(), res( EC_SD_RES::CRC_ERROR ) );
+            this->crcFailed = true;
+            r = EC_SD_RES::CRC_ERROR;
+            break;
+        }
+        if ( answer_write_commend_in != MICROSD_SPI_DATA_ACCEPTED )	break;		// Если не успех - выходим.
+
+        r = EC_SD_RES::OK;
+    } while( false );
+
+    MICROSD_TRACE( this->policy.trace(), EC_MICROSD_TRACE_EVENT::DATA_END, ( uint8_t )r );
+    return r;
+}
+
+// Запись по одному сектору командой CMD24.
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::writeSingleBlocks ( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount ) {
+    EC_SD_RESULT r = EC_SD_RESULT::ERROR;
+    uint32_t address;
+
+    MicrosdSegmentCursor blocks( seg, segCount );
+    const uint8_t* p_buf = blocks.next();
+
+    do {
+        address = this->getArgAddress( sector );		// В зависимости от типа карты - адресация может быть побайтовая или поблочная
+                                                            // (блок - 512 байт).
+
+        uint8_t r1;
+        if ( this->sendCmd( MICROSD_SPI_CMD( 24 ), address, microsdSpiCrc7( MICROSD_SPI_CMD( 24 ), address ), &r1 )	!= EC_SD_RES::OK )
+            break;					// Отправляем CMD24.
+
+        if ( r1 != 0 ) break;
+        if ( this->sendEmptyPackage( 1 )						!= EC_SD_RES::OK ) break;					// Обязательно ждем 1 пакет.
+        if ( this->sendMark( MICROSD_SPI_TOKEN_BLOCK )			!= EC_SD_RES::OK ) break;
+
+        // Пишем 512 байт.
+        if ( this->sendDataBlock( p_buf )						!= EC_SD_RES::OK ) break;
+        if ( this->sendEmptyPackage( 1 )						!= EC_SD_RES::OK ) break;
+
+        p_buf = blocks.next();				// 512 байт уже записали.
+
+        if ( p_buf == nullptr ) {
+            r = EC_SD_RESULT::OK;
+            break;
+        } else {
+            sector++;							// Будем писать следующий сектор.
+        }
+    } while ( true );
+
+    return r;
+}
+
+// Запись cout_sector секторов одной командой CMD25.
+// SD картам предварительно сообщаем количество блоков (ACMD23),
+// чтобы карта могла заранее стереть область.
+// Если карта не поддерживает CMD25 - rejected = true,
+// и запись следует повторить по одному сектору.
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::writeMultipleBlock ( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t cout_sector, bool& rejected ) {
+    EC_SD_RESULT r = EC_SD_RESULT::ERROR;
+    uint32_t address = this->getArgAddress( sector );
+    uint8_t r1;
+
+    rejected = false;
+
+    /// ACMD23 носит рекомендательный характер, поэтому его ошибку игнорируем.
+    if ( ( uint32_t )this->typeMicrosd & ( uint32_t )EC_MICRO_SD_TYPE::SDC ) {
+        this->sendAcmd( MICROSD_SPI_CMD( 23 ), cout_sector, microsdSpiCrc7( MICROSD_SPI_CMD( 23 ), cout_sector ) );
+    }
+
+    do {
+        if ( this->sendCmd( MICROSD_SPI_CMD( 25 ), address, microsdSpiCrc7( MICROSD_SPI_CMD( 25 ), address ), &r1 )	!= EC_SD_RES::OK ) break;
+        if ( r1 & MICROSD_SPI_R1_ILLEGAL_COMMAND ) {
+            rejected = true;
+            break;
+        }
+        if ( r1 != 0 ) break;
+
+        bool dataOk = true;
+        MicrosdSegmentCursor blocks( seg, segCount );
+        const uint8_t* p_buf;
+        while ( ( p_buf = blocks.next() ) != nullptr ) {
+            // Внутри CMD25 следующий маркер можно передавать только после окончания busy.
+            if ( this->waitBusyPending()						!= EC_SD_RES::OK ) { dataOk = false; break; }
+            if ( this->sendEmptyPackage( 1 )					!= EC_SD_RES::OK ) { dataOk = false; break; }
+            if ( this->sendMark( MICROSD_SPI_TOKEN_MULTI_WRITE )	!= EC_SD_RES::OK ) { dataOk = false; break; }
+            if ( this->sendDataBlock( p_buf )					!= EC_SD_RES::OK ) { dataOk = false; break; }
+        }
+
+        // Завершаем передачу в любом случае (даже после ошибки).
+        // Окончания busy после STOP_TRAN ждем перед следующей командой.
+        if ( this->waitBusyPending()							!= EC_SD_RES::OK ) break;
+        uint8_t stop[2] = { 0xFF, MICROSD_SPI_TOKEN_STOP_TRAN };
+        if ( this->sendDataPackage( stop, 2 )					!= EC_SD_RES::OK ) break;
+        if ( this->sendEmptyPackage( 1 )						!= EC_SD_RES::OK ) break;
+        this->busyPending = true;
+
+        if ( dataOk ) {
+            r = EC_SD_RESULT::OK;
+        }
+    } while ( false );
+
+    return r;
+}
+
+// writeSector возвращается сразу после приема данных картой,
+// программирование flash проверяется только перед следующей командой.
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::waitWriteDone ( uint32_t timeout_ms ) {
+    Session session( this, true, timeout_ms );
+    if ( !session.isOpen() ) {
+        return EC_SD_RESULT::NOTRDY;
+    }
+
+    EC_SD_RES r = this->waitBusyPending();
+
+    return ( r == EC_SD_RES::OK ) ? EC_SD_RESULT::OK : EC_SD_RESULT::ERROR;
+}
+
+// CSD приходит блоком данных 16 байт.
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::readCsd ( uint8_t* csd ) {
+    uint8_t r1;
+    EC_SD_RES r = this->sendCmd( MICROSD_SPI_CMD( 9 ), 0, microsdSpiCrc7( MICROSD_SPI_CMD( 9 ), 0 ), &r1 );
+    if ( r != EC_SD_RES::OK )	return r;
+    if ( r1 != 0 )				return EC_SD_RES::IO_ERROR;
+
+    return this->readRegister( csd, 16 );
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::getSectorCount ( uint32_t& sectorCount ) {
+    if ( this->typeMicrosd == EC_MICRO_SD_TYPE::ERROR )	return EC_SD_RESULT::NOTRDY;
+
+    Session session( this, true );
+    if ( !session.isOpen() )							return EC_SD_RESULT::NOTRDY;
+
+    uint8_t	csd[16];
+    if ( this->readCsd( csd ) != EC_SD_RES::OK )
+        return EC_SD_RESULT::ERROR;
+
+    sectorCount = microsdSpiCsdSectorCount( csd );
+
+    return EC_SD_RESULT::OK;
+}
+
+// Размер блока стирания в секторах (FatFs GET_BLOCK_SIZE): у SD2 - AU из SD Status,
+// у SD1, MMC и карт, не сообщающих AU, - группа стирания из CSD.
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::getBlockSize ( uint32_t& blockSize ) {
+    if ( this->typeMicrosd == EC_MICRO_SD_TYPE::ERROR )	return EC_SD_RESULT::NOTRDY;
+
+    Session session( this, true );
+    if ( !session.isOpen() )							return EC_SD_RESULT::NOTRDY;
+
+    if ( ( uint32_t )this->typeMicrosd & ( uint32_t )EC_MICRO_SD_TYPE::SD2 ) {
+        uint8_t reg[64];
+        if ( this->readSdStatus( reg ) == EC_SD_RES::OK ) {
+            MicrosdSdStatus st;
+            microsdParseSdStatus( reg, st );
+            if ( st.auSectors != 0 ) {
+                blockSize = st.auSectors;
+                return EC_SD_RESULT::OK;
+            }
+        }
+    }
+
+    uint8_t	csd[16];
+    if ( this->readCsd( csd ) != EC_SD_RES::OK )
+        return EC_SD_RESULT::ERROR;
+
+    blockSize = microsdSpiCsdEraseSectors( csd, ( uint32_t )this->typeMicrosd & ( uint32_t )EC_MICRO_SD_TYPE::SDC );
+
+    return EC_SD_RESULT::OK;
+}
+
+// SD Status - ответ R2 (R1 + байт статуса) и блок данных 64 байта.
+template < class Spi, class Cs, class Policy >
+EC_SD_RES MicrosdSpiCore< Spi, Cs, Policy >::readSdStatus ( uint8_t* reg ) {
+    uint8_t r1;
+    EC_SD_RES r = this->sendAcmd( MICROSD_SPI_CMD( 13 ), 0, microsdSpiCrc7( MICROSD_SPI_CMD( 13 ), 0 ), &r1, 1 );
+    if ( r != EC_SD_RES::OK )						return r;
+    if ( r1 & MICROSD_SPI_R1_ILLEGAL_COMMAND )		return EC_SD_RES::R1_ILLEGAL_COMMAND;
+    if ( r1 != 0 )									return EC_SD_RES::IO_ERROR;
+
+    return this->readRegister( reg, 64 );
+}
+
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::getSdStatus ( MicrosdSdStatus& status ) {
+    if ( this->typeMicrosd == EC_MICRO_SD_TYPE::ERROR )									return EC_SD_RESULT::NOTRDY;
+    if ( !( ( uint32_t )this->typeMicrosd & ( uint32_t )EC_MICRO_SD_TYPE::SDC ) )		return EC_SD_RESULT::ERROR;
+
+    Session session( this, true );
+    if ( !session.isOpen() )															return EC_SD_RESULT::NOTRDY;
+
+    uint8_t reg[64];
+    if ( this->readSdStatus( reg ) != EC_SD_RES::OK ) {
+        return EC_SD_RESULT::ERROR;
+    }
+
+    microsdParseSdStatus( reg, status );
+
+    return EC_SD_RESULT::OK;
+}
+
+// Стирание [sector; sector + count).
+// CMD32/CMD33 есть только у SD, MMC стирает другими командами (CMD35/CMD36) -
+// для нее discard пропускается (это лишь подсказка карте).
+template < class Spi, class Cs, class Policy >
+EC_SD_RESULT MicrosdSpiCore< Spi, Cs, Policy >::discardSectors ( uint32_t sector, uint32_t count ) {
+    if ( this->typeMicrosd == EC_MICRO_SD_TYPE::ERROR )									return EC_SD_RESULT::NOTRDY;
+    if ( !( ( uint32_t )this->typeMicrosd & ( uint32_t )EC_MICRO_SD_TYPE::SDC ) )		return EC_SD_RESULT::OK;
+    if ( count == 0 )																	return EC_SD_RESULT::OK;
+
+    EC_SD_RESULT rv = EC_SD_RESULT::ERROR;
+
+    MICROSD_STAT_START( this->policy.stat(), t );
+    Session session( this, true );
+
+    do {
+        uint8_t r1;
+        uint8_t reg[64];
+
+        // SDSC с ERASE_BLK_EN == 0 стирает только группами по SECTOR_SIZE + 1 блоков
+        // (блок - WRITE_BL_LEN, у карт 2 ГБ бывает 1024 и 2048 байт).
+        if ( !( ( uint32_t )this->typeMicrosd & ( uint32_t )EC_MICRO_SD_TYPE::BLOCK ) ) {
+            if ( this->readCsd( reg )											!= EC_SD_RES::OK ) break;
+
+            bool		eraseBlkEn		= ( reg[ 10 ] >> 6 ) & 1;
+            uint32_t	eraseSectors	= microsdSpiCsdEraseSectors( reg, true );
+            if ( !microsdAlignEraseRange( sector, count, eraseBlkEn, eraseSectors ) ) {
+                rv = EC_SD_RESULT::OK;
+                break;
+            }
+        }
+
+        // Время стирания - по ERASE_SIZE/ERASE_TIMEOUT/ERASE_OFFSET из SD Status.
+        // Старые карты без ACMD13 - по 250 мс на блок.
+        MicrosdSdStatus st = {};
+        EC_SD_RES sr = this->readSdStatus( reg );
+        if ( sr == EC_SD_RES::OK ) {
+            microsdParseSdStatus( reg, st );
+        } else if ( ( sr != EC_SD_RES::R1_ILLEGAL_COMMAND ) && ( sr != EC_SD_RES::IO_ERROR ) ) {
+            break;
+        }
+
+        uint32_t timeoutMs = microsdGetEraseTimeoutMs( sector, count, st.eraseSize, st.eraseTimeout, st.eraseOffset, st.auSize );
+
+        uint32_t first	= this->getArgAddress( sector );
+        uint32_t last	= this->getArgAddress( sector + count - 1 );
+
+        if ( this->sendCmd( MICROSD_SPI_CMD( 32 ), first, microsdSpiCrc7( MICROSD_SPI_CMD( 32 ), first ), &r1 )	!= EC_SD_RES::OK ) break;
+        if ( r1 != 0 )																			break;
+        if ( this->sendCmd( MICROSD_SPI_CMD( 33 ), last, microsdSpiCrc7( MICROSD_SPI_CMD( 33 ), last ), &r1 )	!= EC_SD_RES::OK ) break;
+        if ( r1 != 0 )																			break;
+        if ( this->sendCmd( MICROSD_SPI_CMD( 38 ), 0, microsdSpiCrc7( MICROSD_SPI_CMD( 38 ), 0 ), &r1 )			!= EC_SD_RES::OK ) break;
+        if ( r1 != 0 )																			break;
+
+        // R1b: карта держит busy все время стирания.
+        this->busyPending	= true;
+        this->busyTimeoutMs	= timeoutMs;
+
+        rv = EC_SD_RESULT::OK;
+    } while( false );
+
+    MICROSD_STAT( this->policy.stat(), op( EC_MICROSD_STAT_OP::OTHER, t ) );
+    MICROSD_STAT( this->policy.stat(), result( rv ) );
+
+    return rv;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "project_config.h"
+
+#if defined( MODULE_MICROSD_CARD_SPI_ENABLED ) || defined( MODULE_MICROSD_CARD_SPI_T_ENABLED )
+
+#include <stdint.h>
+
+/*!
+ * Общий для MicrosdSpi и MicrosdSpiT код протокола SD в режиме SPI,
+ * не зависящий от способа обмена с картой: кадр команды, поиск R1,
+ * CRC7 команды, CRC16 блока данных, разбор CSD.
+ */
+
+/// Байт команды CMDn/ACMDn (старт-бит 0, бит передачи 1).
+#define MICROSD_SPI_CMD(n)								( 0x40 + ( n ) )
+
+// Максимальная задержка R1 после команды (NCR), байт.
+#define MICROSD_SPI_NCR_MAX								( 8 )
+
+// Предельное время ожидания маркера данных (Nac) и окончания busy.
+#define MICROSD_SPI_MARK_TIMEOUT_MS						( 100 )
+#define MICROSD_SPI_BUSY_TIMEOUT_MS						( 500 )
+
+// Готовность после ACMD41 карта обязана сообщить не позже чем через 1 с.
+#define MICROSD_SPI_INIT_TIMEOUT_MS						( 1000 )
+// Первые ACMD41 идут подряд (один запрос на 400 кГц - около 0.6 мс),
+// дальше - с паузой, растущей вдвое до MICROSD_SPI_INIT_PAUSE_MAX_MS.
+#define MICROSD_SPI_INIT_FAST_POLLS						( 8 )
+#define MICROSD_SPI_INIT_PAUSE_MAX_MS					( 8 )
+
+/// Маркеры блоков данных.
+#define MICROSD_SPI_TOKEN_BLOCK							( 0xFE )			// CMD17, CMD18, CMD24, регистры.
+#define MICROSD_SPI_TOKEN_MULTI_WRITE					( 0xFC )			// CMD25.
+#define MICROSD_SPI_TOKEN_STOP_TRAN						( 0xFD )
+
+/// Биты R1.
+#define MICROSD_SPI_R1_IDLE								( 1 << 0 )
+#define MICROSD_SPI_R1_ILLEGAL_COMMAND					( 1 << 2 )
+
+/// Ответ карты на принятый блок записи (младшие 4 бита).
+#define MICROSD_SPI_DATA_ACCEPTED						( 0b0101 )
+#define MICROSD_SPI_DATA_CRC_ERROR						( 0b1011 )
+
+/// ACMD41: поддержка SDHC/SDXC (HCS), OCR: карта с блочной адресацией (CCS).
+#define MICROSD_SPI_ACMD41_HCS							( 1UL << 30 )
+#define MICROSD_SPI_OCR_CCS								( 1UL << 30 )
+
+// Таблицы CRC7 и CRC16 (одни на все экземпляры, повторный вызов ничего не делает).
+void		microsdSpiCrcInit					( void );
+
+// CRC7 команды вместе с завершающим битом (последний байт кадра).
+uint8_t		microsdSpiCrc7						( uint8_t cmd, uint32_t arg );
+
+// CRC16-CCITT блока данных (slice-by-4).
+uint16_t	microsdSpiCrc16						( const uint8_t* data, uint32_t len );
+
+// Кадр команды, 6 байт.
+void		microsdSpiFillCmd					( uint8_t* frame, uint8_t cmd, uint32_t arg, uint8_t crc );
+
+// Индекс R1 (байт со сброшенным старшим битом) в окне NCR принятых rx[ from..len ).
+// len - R1 не найден.
+uint16_t	microsdSpiFindR1					( const uint8_t* rx, uint16_t from, uint16_t len );
+
+// Объем карты в секторах по CSD (версии 1.0 и 2.0).
+uint32_t	microsdSpiCsdSectorCount			( const uint8_t* csd );
+
+// Блок стирания в секторах по CSD: SECTOR_SIZE у SD, ERASE_GRP_SIZE/MULT у MMC.
+uint32_t	microsdSpiCsdEraseSectors			( const uint8_t* csd, bool sdc );
+
+#endif
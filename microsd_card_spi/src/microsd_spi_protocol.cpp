@@ -0,0 +1,113 @@
+#include "microsd_spi_protocol.h"
+
+#if defined( MODULE_MICROSD_CARD_SPI_ENABLED ) || defined( MODULE_MICROSD_CARD_SPI_T_ENABLED )
+
+static uint8_t		crc7Table[256];
+static uint16_t		crc16Table[4][256];
+static bool			crcTableReady = false;
+
+// CRC7 (x^7 + x^3 + 1) по байту за шаг.
+// Таблицы для CRC16-CCITT (x^16 + x^12 + x^5 + 1) по 4 байта за шаг:
+// crc16Table[0] - обычная побайтовая таблица,
+// crc16Table[k][b] - вклад байта b, за которым следуют еще k байт.
+void microsdSpiCrcInit ( void ) {
+    if ( crcTableReady ) return;
+
+    for ( uint32_t i = 0; i < 256; i++ ) {
+        uint8_t crc = ( i & 0x80 ) ? ( uint8_t )( i ^ 0x89 ) : ( uint8_t )i;
+        for ( int j = 1; j < 8; j++ ) {
+            crc <<= 1;
+            if ( crc & 0x80 ) {
+                crc ^= 0x89;
+            }
+        }
+        crc7Table[ i ] = crc;
+    }
+
+    for ( uint32_t i = 0; i < 256; i++ ) {
+        uint16_t crc = ( uint16_t )( i << 8 );
+        for ( int j = 0; j < 8; j++ ) {
+            crc = ( crc & 0x8000 ) ? ( uint16_t )( ( crc << 1 ) ^ 0x1021 ) : ( uint16_t )( crc << 1 );
+        }
+        crc16Table[ 0 ][ i ] = crc;
+    }
+
+    for ( uint32_t k = 1; k < 4; k++ ) {
+        for ( uint32_t i = 0; i < 256; i++ ) {
+            uint16_t prev = crc16Table[ k - 1 ][ i ];
+            crc16Table[ k ][ i ] = ( uint16_t )( prev << 8 ) ^ crc16Table[ 0 ][ prev >> 8 ];
+        }
+    }
+
+    crcTableReady = true;
+}
+
+uint8_t microsdSpiCrc7 ( uint8_t cmd, uint32_t arg ) {
+    uint8_t crc = crc7Table[ cmd ];
+
+    for ( int i = 3; i >= 0; i-- ) {
+        crc = crc7Table[ ( crc << 1 ) ^ ( uint8_t )( arg >> ( i * 8 ) ) ];
+    }
+
+    return ( uint8_t )( ( crc << 1 ) | 1 );
+}
+
+uint16_t microsdSpiCrc16 ( const uint8_t* data, uint32_t len ) {
+    uint16_t crc = 0;
+
+    while ( len >= 4 ) {
+        crc =	crc16Table[ 3 ][ data[ 0 ] ^ ( crc >> 8 ) ]		^
+                crc16Table[ 2 ][ data[ 1 ] ^ ( crc & 0xFF ) ]		^
+                crc16Table[ 1 ][ data[ 2 ] ]						^
+                crc16Table[ 0 ][ data[ 3 ] ];
+        data	+= 4;
+        len		-= 4;
+    }
+
+    while ( len-- ) {
+        crc = ( uint16_t )( crc << 8 ) ^ crc16Table[ 0 ][ ( crc >> 8 ) ^ *data++ ];
+    }
+
+    return crc;
+}
+
+void microsdSpiFillCmd ( uint8_t* frame, uint8_t cmd, uint32_t arg, uint8_t crc ) {
+    frame[0] = cmd;
+    frame[1] = ( uint8_t )( arg >> 24 );
+    frame[2] = ( uint8_t )( arg >> 16 );
+    frame[3] = ( uint8_t )( arg >> 8 );
+    frame[4] = ( uint8_t )( arg );
+    frame[5] = crc;
+}
+
+uint16_t microsdSpiFindR1 ( const uint8_t* rx, uint16_t from, uint16_t len ) {
+    for ( uint16_t i = from; ( i < from + MICROSD_SPI_NCR_MAX + 1 ) && ( i < len ); i++ ) {
+        if ( ( rx[ i ] & ( 1 << 7 ) ) == 0 ) return i;
+    }
+
+    return len;
+}
+
+uint32_t microsdSpiCsdSectorCount ( const uint8_t* csd ) {
+    uint32_t csize;
+
+    if ( ( csd[0] >> 6 ) == 1) {	// SDC ver 2.00
+        csize = csd[9] + ((uint32_t)csd[8] << 8) + ((uint32_t)(csd[7] & 63) << 16) + 1;
+        return csize << 10;
+    }
+
+    // SDC ver 1.XX or MMC ver 3
+    uint32_t n = (csd[5] & 15) + ((csd[10] & 128) >> 7) + ((csd[9] & 3) << 1) + 2;
+    csize = (csd[8] >> 6) + ((uint32_t)csd[7] << 2) + ((uint32_t)(csd[6] & 3) << 10) + 1;
+    return csize << (n - 9);
+}
+
+uint32_t microsdSpiCsdEraseSectors ( const uint8_t* csd, bool sdc ) {
+    if ( sdc ) {					// SECTOR_SIZE.
+        return (((csd[10] & 63) << 1) + ((uint32_t)(csd[11] & 128) >> 7) + 1) << ((csd[13] >> 6) - 1);
+    }
+    // MMC: ERASE_GRP_SIZE, ERASE_GRP_MULT.
+    return ((uint32_t)((csd[10] & 124) >> 2) + 1) * (((csd[11] & 3) << 3) + ((csd[11] & 224) >> 5) + 1);
+}
+
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "project_config.h"
+
+#ifdef MODULE_MICROSD_CARD_SPI_T_ENABLED
+
+#include "microsd_spi_core.h"
+
+/*!
+ * Драйвер microsd по SPI, собираемый под конкретную плату при компиляции.
+ * Протокол - тот же MicrosdSpiCore, что у MicrosdSpi, но SPI, вывод CS и параметры
+ * заданы типами, а не microsdSpiCfg:
+ * - методы Spi и Cs вызываются квалифицированно (spi.Spi::rx) - без таблицы
+ *   виртуальных функций, так что компилятор может их встроить;
+ * - параметры Policy постоянны, и ветви выключенных возможностей (CRC, High Speed,
+ *   подбор частоты, повторная инициализация, шина, статистика, трасса) не попадают в код.
+ *
+ * Spi		- класс с методами SpiMaster8BitBase (tx, rx, txOneItem), обычно конкретный
+ *			  драйвер SPI контроллера (не сам абстрактный SpiMaster8BitBase).
+ * Cs		- класс с методами set() и reset().
+ * Policy	- см. microsd_spi_core.h. Наследник MicrosdSpiTPolicyDefault добавляет
+ *			  static void setSpeed ( Spi& spi, bool fast ) и переопределяет нужные параметры.
+ * Для кода, работающего через MicrosdBase (FatFs, кэш и т.д.), - MicrosdSpiTAdapter.
+ */
+
+/// Политика по умолчанию: все необязательные возможности выключены.
+struct MicrosdSpiTPolicyDefault {
+	template < class Spi >
+	static void					setClock		( Spi& spi, uint32_t step )	{ ( void )spi; ( void )step; }
+	static constexpr uint32_t	clockSteps		( void )	{ return 0; }
+	static constexpr bool		crc				( void )	{ return false; }
+	static constexpr uint8_t	crcRetries		( void )	{ return 0; }
+	static constexpr uint32_t	spinBudget		( void )	{ return MICROSD_SPI_SPIN_BUDGET_DEFAULT; }
+	static constexpr bool		highSpeed		( void )	{ return false; }
+	static constexpr uint32_t	initTimeoutMs	( void )	{ return MICROSD_SPI_INIT_TIMEOUT_MS; }
+	static constexpr bool		warmInit		( void )	{ return false; }
+
+#ifdef MODULE_MICROSD_STAT_ENABLED
+	static MicrosdStat*			stat			( void )	{ return nullptr; }
+#endif
+
+#ifdef MODULE_MICROSD_TRACE_ENABLED
+	static MicrosdTrace*		trace			( void )	{ return nullptr; }
+#endif
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+	static MicrosdSpiBus*		bus				( void )	{ return nullptr; }
+#endif
+};
+
+template < class Spi, class Cs, class Policy >
+class MicrosdSpiT : public MicrosdSpiCore< Spi, Cs, Policy > {
+public:
+	MicrosdSpiT ( Spi& spi, Cs& cs ) : MicrosdSpiCore< Spi, Cs, Policy >( spi, cs ) {}
+};
+
+/// MicrosdBase поверх MicrosdSpiT: один виртуальный вызов на запрос, обмен внутри - без них.
+template < class Driver >
+class MicrosdSpiTAdapter : public MicrosdBase {
+public:
+	MicrosdSpiTAdapter ( Driver& sd ) : sd( sd ) {}
+
+	EC_MICRO_SD_TYPE	initialize			( void )						{ return this->sd.initialize(); }
+	EC_MICRO_SD_TYPE	getType				( void )						{ return this->sd.getType(); }
+	EC_SD_STATUS		getStatus			( void )						{ return this->sd.getStatus(); }
+	EC_SD_RESULT		getSectorCount		( uint32_t& sectorCount )		{ return this->sd.getSectorCount( sectorCount ); }
+	EC_SD_RESULT		getBlockSize		( uint32_t& blockSize )			{ return this->sd.getBlockSize( blockSize ); }
+	EC_SD_RESULT		getSdStatus			( MicrosdSdStatus& status )		{ return this->sd.getSdStatus( status ); }
+	EC_SD_RESULT		discardSectors		( uint32_t sector, uint32_t count )	{ return this->sd.discardSectors( sector, count ); }
+
+	EC_SD_RESULT		readSector			( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms ) {
+		return this->sd.readSector( sector, target_array, cout_sector, timeout_ms );
+	}
+
+	EC_SD_RESULT		writeSector			( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms ) {
+		return this->sd.writeSector( source_array, sector, cout_sector, timeout_ms );
+	}
+
+	EC_SD_RESULT		readSectors			( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t timeout_ms ) {
+		return this->sd.readSectors( sector, seg, segCount, timeout_ms );
+	}
+
+	EC_SD_RESULT		writeSectors		( uint32_t sector, const MicrosdSegment* seg, uint32_t segCount, uint32_t timeout_ms ) {
+		return this->sd.writeSectors( sector, seg, segCount, timeout_ms );
+	}
+
+private:
+	Driver&				sd;
+};
+
+#endif
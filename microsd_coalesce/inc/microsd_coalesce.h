@@ -0,0 +1,98 @@
+#pragma once
+
+#include "project_config.h"
+
+#ifdef MODULE_MICROSD_COALESCE_ENABLED
+
+#include "user_os.h"
+#include "microsd_base.h"
+
+/*!
+ * Объединение мелких записей поверх любой реализации MicrosdBase.
+ * Записи в подряд идущие (или пересекающиеся) сектора копируются в буфер
+ * и уходят на карту одной многоблочной записью, когда:
+ * - очередная запись не примыкает к накопленному участку;
+ * - участок достиг maxSectors;
+ * - с первой записи в участок прошло maxAgeMs (из отдельной задачи);
+ * - вызван flush().
+ * Чтение видит накопленные, но еще не записанные данные.
+ */
+
+#define MICROSD_COALESCE_TASK_STACK_SIZE				( 200 )
+
+struct MicrosdCoalesceCfg {
+	MicrosdBase*		card;
+
+	uint8_t*			buf;					// maxSectors * 512 байт, выравнен на 4.
+	uint32_t			maxSectors;				// Размер участка, при котором он сразу пишется на карту.
+
+	/// Сколько участок может ждать продолжения. 0 - без ограничения (задача не создается,
+	/// данные уходят на карту только по остальным условиям).
+	uint32_t			maxAgeMs;
+	uint32_t			timeoutMs;				// Таймаут записи из задачи.
+	uint32_t			taskPrio;
+};
+
+struct MicrosdCoalesceStat {
+	uint32_t		writes;					// Запросов записи.
+	uint32_t		sectors;				// Секторов в них.
+	uint32_t		merged;					// Секторов, перезаписанных в буфере до отправки на карту.
+	uint32_t		flushes;				// Записей участка на карту.
+	uint32_t		flushedSectors;			// Секторов в них.
+	uint32_t		ageFlushes;				// Из них - по maxAgeMs.
+	uint32_t		bypass;					// Запросов не меньше maxSectors, записанных напрямую.
+	uint32_t		errors;					// Неудачных записей участка (данные остаются в буфере).
+};
+
+class MicrosdCoalesce : public MicrosdBase {
+public:
+	MicrosdCoalesce ( const MicrosdCoalesceCfg* const cfg );
+
+	/// Сначала записывает накопленный участок (ERROR, если не удалось - участок сохраняется),
+	/// затем инициализирует карту.
+	EC_MICRO_SD_TYPE	initialize			( void );
+	EC_MICRO_SD_TYPE	getType				( void );
+	EC_SD_RESULT		readSector			( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms );
+	EC_SD_RESULT		writeSector			( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms );
+	EC_SD_STATUS		getStatus			( void );
+	EC_SD_RESULT		getSectorCount		( uint32_t& sectorCount );
+	EC_SD_RESULT		getBlockSize		( uint32_t& blockSize );
+	EC_SD_RESULT		getSdStatus			( MicrosdSdStatus& status );
+	EC_SD_RESULT		discardSectors		( uint32_t sector, uint32_t count );
+
+	/// Записать накопленный участок на карту (FatFs CTRL_SYNC).
+	EC_SD_RESULT		flush				( uint32_t timeout_ms );
+
+	/// Выбросить накопленный участок без записи (например, после смены карты:
+	/// вызвать до initialize, чтобы данные старой карты не попали на новую).
+	void				invalidate			( void );
+
+	void				getStat				( MicrosdCoalesceStat& stat );
+	void				resetStat			( void );
+
+private:
+	static void			task				( void* obj );
+	void				taskLoop			( void );
+
+	// Записать участок (под mutex-ом). При ошибке участок остается в буфере.
+	EC_SD_RESULT		flushRun			( uint32_t timeout_ms );
+
+	const MicrosdCoalesceCfg*		const cfg;
+
+	USER_OS_STATIC_MUTEX_BUFFER		mb;
+	USER_OS_STATIC_MUTEX			m				= nullptr;
+
+	USER_OS_STATIC_BIN_SEMAPHORE_BUFFER		kickBuf;
+	USER_OS_STATIC_BIN_SEMAPHORE			kick		= nullptr;		// Начат новый участок.
+
+	USER_OS_STATIC_STACK_TYPE		taskStack[ MICROSD_COALESCE_TASK_STACK_SIZE ];
+	USER_OS_STATIC_TASK_STRUCT_TYPE	taskStruct;
+
+	uint32_t						runStart		= 0;
+	uint32_t						runCount		= 0;		// 0 - буфер пуст.
+	uint32_t						runTick			= 0;		// Время первой записи в участок.
+
+	MicrosdCoalesceStat				stat;
+};
+
+#endif
@@ -0,0 +1,283 @@
+#include "microsd_coalesce.h"
+
+#ifdef MODULE_MICROSD_COALESCE_ENABLED
+
+#include <string.h>
+
+MicrosdCoalesce::MicrosdCoalesce ( const MicrosdCoalesceCfg* const cfg ) : cfg( cfg ) {
+    this->m		= USER_OS_STATIC_MUTEX_CREATE( &this->mb );
+    this->kick	= USER_OS_STATIC_BIN_SEMAPHORE_CREATE( &this->kickBuf );
+
+    this->resetStat();
+
+    if ( this->cfg->maxAgeMs != 0 ) {
+        USER_OS_STATIC_TASK_CREATE( MicrosdCoalesce::task, "sdCoalesce", MICROSD_COALESCE_TASK_STACK_SIZE, this,
+                                    this->cfg->taskPrio, this->taskStack, &this->taskStruct );
+    }
+}
+
+//**********************************************************************
+// Задача записи участков, которые слишком долго ждут продолжения.
+//**********************************************************************
+void MicrosdCoalesce::task ( void* obj ) {
+    ( ( MicrosdCoalesce* )obj )->taskLoop();
+}
+
+void MicrosdCoalesce::taskLoop ( void ) {
+    while ( true ) {
+        USER_OS_TAKE_BIN_SEMAPHORE( this->kick, portMAX_DELAY );
+
+        while ( true ) {
+            USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+            if ( this->runCount == 0 ) {
+                USER_OS_GIVE_MUTEX( this->m );
+                break;
+            }
+
+            uint32_t age = USER_OS_GET_TICK_COUNT() - this->runTick;
+            uint32_t wait = 0;
+
+            if ( age >= this->cfg->maxAgeMs ) {
+                if ( this->flushRun( this->cfg->timeoutMs ) == EC_SD_RESULT::OK ) {
+                    this->stat.ageFlushes++;
+                } else {
+                    /// Карта не ответила - повторим через maxAgeMs.
+                    this->runTick = USER_OS_GET_TICK_COUNT();
+                }
+            } else {
+                wait = this->cfg->maxAgeMs - age;
+            }
+
+            USER_OS_GIVE_MUTEX( this->m );
+
+            if ( wait != 0 ) {
+                USER_OS_DELAY_MS( wait );
+            }
+        }
+    }
+}
+
+//**********************************************************************
+// Служебные методы (вызываются под mutex-ом).
+//**********************************************************************
+EC_SD_RESULT MicrosdCoalesce::flushRun ( uint32_t timeout_ms ) {
+    if ( this->runCount == 0 ) return EC_SD_RESULT::OK;
+
+    EC_SD_RESULT r = this->cfg->card->writeSector( this->cfg->buf, this->runStart, this->runCount, timeout_ms );
+
+    if ( r == EC_SD_RESULT::OK ) {
+        this->stat.flushes++;
+        this->stat.flushedSectors	+= this->runCount;
+        this->runCount				= 0;
+    } else {
+        this->stat.errors++;
+    }
+
+    return r;
+}
+
+//**********************************************************************
+// Основной функционал.
+//**********************************************************************
+EC_SD_RESULT MicrosdCoalesce::readSector ( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms ) {
+    EC_SD_RESULT r = EC_SD_RESULT::OK;
+
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    const uint32_t reqEnd = sector + cout_sector;
+    const uint32_t runEnd = this->runStart + this->runCount;
+
+    if ( ( this->runCount == 0 ) || ( reqEnd <= this->runStart ) || ( runEnd <= sector ) ) {
+        r = this->cfg->card->readSector( sector, target_array, cout_sector, timeout_ms );
+    } else {
+        /// Пересечение с участком берется из буфера, остальное (не более двух кусков) - с карты.
+        uint32_t from	= ( sector > this->runStart ) ? sector : this->runStart;
+        uint32_t to		= ( reqEnd < runEnd ) ? reqEnd : runEnd;
+
+        if ( from > sector ) {
+            r = this->cfg->card->readSector( sector, target_array, from - sector, timeout_ms );
+        }
+
+        if ( ( r == EC_SD_RESULT::OK ) && ( reqEnd > to ) ) {
+            r = this->cfg->card->readSector( to, &target_array[ ( to - sector ) * 512 ], reqEnd - to, timeout_ms );
+        }
+
+        if ( r == EC_SD_RESULT::OK ) {
+            memcpy( &target_array[ ( from - sector ) * 512 ], &this->cfg->buf[ ( from - this->runStart ) * 512 ],
+                    ( to - from ) * 512 );
+        }
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+EC_SD_RESULT MicrosdCoalesce::writeSector ( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms ) {
+    EC_SD_RESULT r = EC_SD_RESULT::OK;
+
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    this->stat.writes++;
+    this->stat.sectors += cout_sector;
+
+    const uint32_t reqEnd = sector + cout_sector;
+    const uint32_t runEnd = this->runStart + this->runCount;
+
+    do {
+        if ( this->runCount != 0 ) {
+            /// Запись примыкает к участку или пересекает его.
+            if ( ( sector <= runEnd ) && ( reqEnd >= this->runStart ) ) {
+                uint32_t newStart	= ( sector < this->runStart ) ? sector : this->runStart;
+                uint32_t newEnd		= ( reqEnd > runEnd ) ? reqEnd : runEnd;
+
+                if ( newEnd - newStart <= this->cfg->maxSectors ) {
+                    uint32_t from	= ( sector > this->runStart ) ? sector : this->runStart;
+                    uint32_t to		= ( reqEnd < runEnd ) ? reqEnd : runEnd;
+                    if ( to > from ) {
+                        this->stat.merged += to - from;
+                    }
+
+                    if ( newStart < this->runStart ) {
+                        memmove( &this->cfg->buf[ ( this->runStart - newStart ) * 512 ], this->cfg->buf,
+                                 this->runCount * 512 );
+                    }
+
+                    this->runStart	= newStart;
+                    this->runCount	= newEnd - newStart;
+                    memcpy( &this->cfg->buf[ ( sector - this->runStart ) * 512 ], source_array, cout_sector * 512 );
+
+                    if ( this->runCount == this->cfg->maxSectors ) {
+                        r = this->flushRun( timeout_ms );
+                    }
+
+                    break;
+                }
+            }
+
+            /// Участок закончился: сначала он, потом новые данные (порядок записи сохраняется).
+            r = this->flushRun( timeout_ms );
+            if ( r != EC_SD_RESULT::OK ) break;
+        }
+
+        if ( cout_sector >= this->cfg->maxSectors ) {
+            this->stat.bypass++;
+            r = this->cfg->card->writeSector( source_array, sector, cout_sector, timeout_ms );
+            break;
+        }
+
+        memcpy( this->cfg->buf, source_array, cout_sector * 512 );
+        this->runStart	= sector;
+        this->runCount	= cout_sector;
+        this->runTick	= USER_OS_GET_TICK_COUNT();
+
+        if ( this->cfg->maxAgeMs != 0 ) {
+            USER_OS_GIVE_BIN_SEMAPHORE( this->kick );
+        }
+    } while ( false );
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+EC_SD_RESULT MicrosdCoalesce::discardSectors ( uint32_t sector, uint32_t count ) {
+    EC_SD_RESULT r = EC_SD_RESULT::OK;
+
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    const uint32_t end		= sector + count;
+    const uint32_t runEnd	= this->runStart + this->runCount;
+
+    if ( ( this->runCount != 0 ) && ( sector < runEnd ) && ( this->runStart < end ) ) {
+        if ( ( sector <= this->runStart ) && ( end >= runEnd ) ) {
+            this->runCount = 0;
+        } else if ( sector <= this->runStart ) {
+            /// Стирается начало участка.
+            uint32_t cut = end - this->runStart;
+            memmove( this->cfg->buf, &this->cfg->buf[ cut * 512 ], ( this->runCount - cut ) * 512 );
+            this->runStart	+= cut;
+            this->runCount	-= cut;
+        } else if ( end >= runEnd ) {
+            /// Стирается конец участка.
+            this->runCount = sector - this->runStart;
+        } else {
+            /// Середину из непрерывного участка не вырезать - сначала записываем его.
+            r = this->flushRun( this->cfg->timeoutMs );
+        }
+    }
+
+    if ( r == EC_SD_RESULT::OK ) {
+        r = this->cfg->card->discardSectors( sector, count );
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+EC_SD_RESULT MicrosdCoalesce::flush ( uint32_t timeout_ms ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    EC_SD_RESULT r = this->flushRun( timeout_ms );
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+void MicrosdCoalesce::invalidate ( void ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    this->runCount = 0;
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+// Накопленный участок уже подтвержден writeSector: сначала он уходит на карту.
+// Если записать не удалось, участок остается в буфере и возвращается ERROR.
+EC_MICRO_SD_TYPE MicrosdCoalesce::initialize ( void ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    if ( this->flushRun( this->cfg->timeoutMs ) != EC_SD_RESULT::OK ) {
+        USER_OS_GIVE_MUTEX( this->m );
+        return EC_MICRO_SD_TYPE::ERROR;
+    }
+
+    EC_MICRO_SD_TYPE type = this->cfg->card->initialize();
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return type;
+}
+
+EC_MICRO_SD_TYPE MicrosdCoalesce::getType ( void ) {
+    return this->cfg->card->getType();
+}
+
+EC_SD_STATUS MicrosdCoalesce::getStatus ( void ) {
+    return this->cfg->card->getStatus();
+}
+
+EC_SD_RESULT MicrosdCoalesce::getSectorCount ( uint32_t& sectorCount ) {
+    return this->cfg->card->getSectorCount( sectorCount );
+}
+
+EC_SD_RESULT MicrosdCoalesce::getBlockSize ( uint32_t& blockSize ) {
+    return this->cfg->card->getBlockSize( blockSize );
+}
+
+EC_SD_RESULT MicrosdCoalesce::getSdStatus ( MicrosdSdStatus& status ) {
+    return this->cfg->card->getSdStatus( status );
+}
+
+void MicrosdCoalesce::getStat ( MicrosdCoalesceStat& stat ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    stat = this->stat;
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+void MicrosdCoalesce::resetStat ( void ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    memset( &this->stat, 0, sizeof( this->stat ) );
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+#endif
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "project_config.h"
+
+#ifdef MODULE_MICROSD_PREFETCH_ENABLED
+
+#include "user_os.h"
+#include "microsd_base.h"
+
+/*!
+ * Упреждающее чтение поверх любой реализации MicrosdBase.
+ * Обнаруживает последовательное чтение и в отдельной задаче заранее считывает
+ * следующие сектора в один из двух буферов, пока приложение обрабатывает текущие.
+ * В случае MicrosdSdio задача спит на DMA, так что чтение идет параллельно с работой CPU.
+ * Размер окна подстраивается под долю реально использованных упрежденных секторов.
+ */
+
+#define MICROSD_PREFETCH_TASK_STACK_SIZE				( 200 )
+
+struct MicrosdPrefetchCfg {
+	MicrosdBase*		card;
+
+	uint8_t*			buf;					// 2 * maxWindow * 512 байт, выравнен на 4.
+	uint32_t			minWindow;				// Границы окна упреждения (в секторах).
+	uint32_t			maxWindow;
+
+	uint32_t			seqThreshold;			// Сколько последовательных запросов подряд считать потоком.
+	uint32_t			timeoutMs;				// Таймаут упреждающего чтения.
+	uint32_t			taskPrio;
+};
+
+struct MicrosdPrefetchStat {
+	uint32_t		hits;					// Секторов, отданных из буфера упреждения.
+	uint32_t		misses;					// Секторов, прочитанных с карты по запросу.
+	uint32_t		prefetched;				// Секторов, считанных упреждающе.
+	uint32_t		wasted;					// Упрежденных, но не использованных секторов.
+	uint32_t		stalls;					// Сколько раз запрос ждал окончания упреждения.
+	uint32_t		window;					// Текущий размер окна.
+};
+
+class MicrosdPrefetch : public MicrosdBase {
+public:
+	MicrosdPrefetch ( const MicrosdPrefetchCfg* const cfg );
+
+	EC_MICRO_SD_TYPE	initialize			( void );
+	EC_MICRO_SD_TYPE	getType				( void );
+	EC_SD_RESULT		readSector			( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms );
+	EC_SD_RESULT		writeSector			( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms );
+	EC_SD_STATUS		getStatus			( void );
+	EC_SD_RESULT		getSectorCount		( uint32_t& sectorCount );
+	EC_SD_RESULT		getBlockSize		( uint32_t& blockSize );
+	EC_SD_RESULT		getSdStatus			( MicrosdSdStatus& status );
+	EC_SD_RESULT		discardSectors		( uint32_t sector, uint32_t count );
+
+	void				getStat				( MicrosdPrefetchStat& stat );
+	void				resetStat			( void );
+
+private:
+	enum class SLOT_STATE {
+		EMPTY,
+		PENDING,			// Ждет задачу упреждения.
+		FILLING,			// Читается с карты.
+		READY
+	};
+
+	struct Slot {
+		uint32_t		start;
+		uint32_t		count;
+		uint32_t		used;
+		SLOT_STATE		state;
+	};
+
+	static const uint32_t			SLOT_COUNT		= 2;
+
+	static void			task				( void* obj );
+	void				taskLoop			( void );
+
+	// Поставить в очередь упреждение, чтобы впереди потока было не меньше окна.
+	void				schedule			( uint32_t from );
+
+	// Освободить слот с учетом статистики использования (подстройка окна).
+	void				retire				( Slot* s );
+
+	// Дождаться окончания заполнения слотов, пересекающих диапазон (под mutex-ом).
+	void				waitFilling			( uint32_t sector, uint32_t count, bool countStall );
+
+	// Выбросить упрежденные копии секторов диапазона (они будут перезаписаны/стерты).
+	void				dropSlots			( uint32_t sector, uint32_t count );
+
+	uint8_t*			slotData			( uint32_t i );
+
+	const MicrosdPrefetchCfg*		const cfg;
+
+	USER_OS_STATIC_MUTEX_BUFFER		mb;
+	USER_OS_STATIC_MUTEX			m				= nullptr;
+
+	USER_OS_STATIC_BIN_SEMAPHORE_BUFFER		kickBuf;
+	USER_OS_STATIC_BIN_SEMAPHORE			kick		= nullptr;		// Есть работа для задачи.
+	USER_OS_STATIC_BIN_SEMAPHORE_BUFFER		doneBuf;
+	USER_OS_STATIC_BIN_SEMAPHORE			done		= nullptr;		// Задача заполнила слот.
+
+	USER_OS_STATIC_STACK_TYPE		taskStack[ MICROSD_PREFETCH_TASK_STACK_SIZE ];
+	USER_OS_STATIC_TASK_STRUCT_TYPE	taskStruct;
+
+	Slot							slots[ SLOT_COUNT ];
+
+	uint32_t						nextExpected	= 0xFFFFFFFF;
+	uint32_t						seqRun			= 0;
+	uint32_t						window;
+	uint32_t						sectorCount		= 0;
+
+	MicrosdPrefetchStat				stat;
+};
+
+#endif
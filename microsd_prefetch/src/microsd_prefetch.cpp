@@ -0,0 +1,325 @@
+#include "microsd_prefetch.h"
+
+#ifdef MODULE_MICROSD_PREFETCH_ENABLED
+
+#include <string.h>
+
+MicrosdPrefetch::MicrosdPrefetch ( const MicrosdPrefetchCfg* const cfg ) : cfg( cfg ) {
+    this->m		= USER_OS_STATIC_MUTEX_CREATE( &this->mb );
+    this->kick	= USER_OS_STATIC_BIN_SEMAPHORE_CREATE( &this->kickBuf );
+    this->done	= USER_OS_STATIC_BIN_SEMAPHORE_CREATE( &this->doneBuf );
+
+    for ( uint32_t i = 0; i < SLOT_COUNT; i++ ) {
+        this->slots[ i ].state = SLOT_STATE::EMPTY;
+    }
+
+    this->window = this->cfg->minWindow;
+    this->resetStat();
+
+    USER_OS_STATIC_TASK_CREATE( MicrosdPrefetch::task, "sdPrefetch", MICROSD_PREFETCH_TASK_STACK_SIZE, this,
+                                this->cfg->taskPrio, this->taskStack, &this->taskStruct );
+}
+
+uint8_t* MicrosdPrefetch::slotData ( uint32_t i ) {
+    return &this->cfg->buf[ i * this->cfg->maxWindow * 512 ];
+}
+
+//**********************************************************************
+// Задача упреждающего чтения.
+//**********************************************************************
+void MicrosdPrefetch::task ( void* obj ) {
+    ( ( MicrosdPrefetch* )obj )->taskLoop();
+}
+
+void MicrosdPrefetch::taskLoop ( void ) {
+    while ( true ) {
+        USER_OS_TAKE_BIN_SEMAPHORE( this->kick, portMAX_DELAY );
+
+        while ( true ) {
+            USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+            Slot* s = nullptr;
+            uint32_t i;
+            for ( i = 0; i < SLOT_COUNT; i++ ) {
+                if ( this->slots[ i ].state == SLOT_STATE::PENDING ) {
+                    s = &this->slots[ i ];
+                    s->state = SLOT_STATE::FILLING;
+                    break;
+                }
+            }
+
+            USER_OS_GIVE_MUTEX( this->m );
+
+            if ( s == nullptr ) break;
+
+            /// Сама карта защищена своим mutex-ом, наш на время чтения не держим.
+            EC_SD_RESULT r = this->cfg->card->readSector( s->start, this->slotData( i ), s->count, this->cfg->timeoutMs );
+
+            USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+            if ( r == EC_SD_RESULT::OK ) {
+                s->state = SLOT_STATE::READY;
+                this->stat.prefetched += s->count;
+            } else {
+                s->state = SLOT_STATE::EMPTY;
+            }
+            USER_OS_GIVE_MUTEX( this->m );
+
+            USER_OS_GIVE_BIN_SEMAPHORE( this->done );
+        }
+    }
+}
+
+//**********************************************************************
+// Служебные методы (вызываются под mutex-ом).
+//**********************************************************************
+void MicrosdPrefetch::retire ( Slot* s ) {
+    if ( s->state == SLOT_STATE::READY ) {
+        this->stat.wasted += s->count - s->used;
+
+        /// Использовали меньше половины - окно слишком велико для этого потока.
+        if ( ( s->used * 2 < s->count ) && ( this->window > this->cfg->minWindow ) ) {
+            this->window /= 2;
+            if ( this->window < this->cfg->minWindow ) this->window = this->cfg->minWindow;
+        }
+    }
+
+    s->state = SLOT_STATE::EMPTY;
+}
+
+void MicrosdPrefetch::schedule ( uint32_t from ) {
+    /// Конец уже упрежденной (или упреждаемой) области, примыкающей к потоку.
+    uint32_t end = from;
+    bool extended = true;
+    while ( extended ) {
+        extended = false;
+        for ( uint32_t i = 0; i < SLOT_COUNT; i++ ) {
+            Slot* s = &this->slots[ i ];
+            if ( s->state == SLOT_STATE::EMPTY ) continue;
+            if ( ( s->start <= end ) && ( end < s->start + s->count ) ) {
+                end = s->start + s->count;
+                extended = true;
+            }
+        }
+    }
+
+    if ( end - from >= this->window ) return;
+
+    for ( uint32_t i = 0; i < SLOT_COUNT; i++ ) {
+        Slot* s = &this->slots[ i ];
+
+        // Слот свободен либо целиком позади потока (или вне его).
+        bool stale = ( s->state == SLOT_STATE::READY ) &&
+                     ( ( s->start + s->count <= from ) || ( s->start > end ) );
+
+        if ( ( s->state != SLOT_STATE::EMPTY ) && !stale ) continue;
+
+        this->retire( s );
+
+        s->start	= end;
+        s->count	= this->window;
+        s->used		= 0;
+        s->state	= SLOT_STATE::PENDING;
+
+        /// Размер карты запрашиваем один раз (у MicrosdSpi это отдельная команда).
+        if ( this->sectorCount == 0 ) {
+            if ( this->cfg->card->getSectorCount( this->sectorCount ) != EC_SD_RESULT::OK ) {
+                this->sectorCount = 0;
+            }
+        }
+
+        if ( this->sectorCount != 0 ) {
+            if ( s->start >= this->sectorCount ) {
+                s->state = SLOT_STATE::EMPTY;
+                return;
+            }
+            if ( s->start + s->count > this->sectorCount ) {
+                s->count = this->sectorCount - s->start;
+            }
+        }
+
+        USER_OS_GIVE_BIN_SEMAPHORE( this->kick );
+        return;
+    }
+}
+
+void MicrosdPrefetch::waitFilling ( uint32_t sector, uint32_t count, bool countStall ) {
+    while ( true ) {
+        bool filling = false;
+        for ( uint32_t i = 0; i < SLOT_COUNT; i++ ) {
+            Slot* s = &this->slots[ i ];
+            if ( s->state != SLOT_STATE::FILLING ) continue;
+            if ( ( s->start < sector + count ) && ( sector < s->start + s->count ) ) {
+                filling = true;
+            }
+        }
+
+        if ( !filling ) return;
+
+        if ( countStall ) {
+            this->stat.stalls++;
+            countStall = false;
+        }
+
+        USER_OS_GIVE_MUTEX( this->m );
+        USER_OS_TAKE_BIN_SEMAPHORE( this->done, this->cfg->timeoutMs );
+        USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    }
+}
+
+//**********************************************************************
+// Основной функционал.
+//**********************************************************************
+EC_SD_RESULT MicrosdPrefetch::readSector ( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms ) {
+    EC_SD_RESULT r = EC_SD_RESULT::OK;
+
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    const uint32_t reqEnd = sector + cout_sector;
+
+    /// Поток продолжается: учитываем, чтобы включить/поддержать упреждение.
+    if ( sector == this->nextExpected ) {
+        this->seqRun++;
+    } else {
+        this->seqRun = 0;
+    }
+    this->nextExpected = reqEnd;
+
+    // Данные, которые как раз сейчас читаются, выгоднее дождаться.
+    this->waitFilling( sector, cout_sector, true );
+
+    while ( cout_sector ) {
+        Slot* hit = nullptr;
+        uint32_t i;
+        for ( i = 0; i < SLOT_COUNT; i++ ) {
+            Slot* s = &this->slots[ i ];
+            if ( ( s->state == SLOT_STATE::READY ) && ( s->start <= sector ) && ( sector < s->start + s->count ) ) {
+                hit = s;
+                break;
+            }
+        }
+
+        if ( hit == nullptr ) break;
+
+        uint32_t offset = sector - hit->start;
+        uint32_t n = hit->count - offset;
+        if ( n > cout_sector ) n = cout_sector;
+
+        memcpy( target_array, this->slotData( i ) + offset * 512, n * 512 );
+
+        hit->used		+= n;
+        this->stat.hits	+= n;
+
+        /// Слот выбран полностью - окна не хватает, увеличиваем.
+        if ( ( offset + n == hit->count ) && ( hit->used >= hit->count ) && ( this->window < this->cfg->maxWindow ) ) {
+            this->window *= 2;
+            if ( this->window > this->cfg->maxWindow ) this->window = this->cfg->maxWindow;
+        }
+
+        sector			+= n;
+        target_array	+= n * 512;
+        cout_sector		-= n;
+    }
+
+    if ( cout_sector ) {
+        this->stat.misses += cout_sector;
+        r = this->cfg->card->readSector( sector, target_array, cout_sector, timeout_ms );
+    }
+
+    if ( ( r == EC_SD_RESULT::OK ) && ( this->seqRun >= this->cfg->seqThreshold ) ) {
+        this->schedule( reqEnd );
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+// Под mutex-ом.
+void MicrosdPrefetch::dropSlots ( uint32_t sector, uint32_t count ) {
+    this->waitFilling( sector, count, false );
+    for ( uint32_t i = 0; i < SLOT_COUNT; i++ ) {
+        Slot* s = &this->slots[ i ];
+        if ( s->state == SLOT_STATE::EMPTY ) continue;
+        if ( ( s->start < sector + count ) && ( sector < s->start + s->count ) ) {
+            s->state = SLOT_STATE::EMPTY;
+        }
+    }
+}
+
+EC_SD_RESULT MicrosdPrefetch::writeSector ( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    /// Упрежденные копии перезаписываемых секторов становятся неактуальными.
+    this->dropSlots( sector, cout_sector );
+
+    EC_SD_RESULT r = this->cfg->card->writeSector( source_array, sector, cout_sector, timeout_ms );
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+EC_SD_RESULT MicrosdPrefetch::discardSectors ( uint32_t sector, uint32_t count ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    this->dropSlots( sector, count );
+
+    EC_SD_RESULT r = this->cfg->card->discardSectors( sector, count );
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return r;
+}
+
+EC_MICRO_SD_TYPE MicrosdPrefetch::initialize ( void ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    this->waitFilling( 0, 0xFFFFFFFF, false );
+    for ( uint32_t i = 0; i < SLOT_COUNT; i++ ) {
+        this->slots[ i ].state = SLOT_STATE::EMPTY;
+    }
+    this->nextExpected	= 0xFFFFFFFF;
+    this->seqRun		= 0;
+    this->sectorCount	= 0;
+
+    EC_MICRO_SD_TYPE t = this->cfg->card->initialize();
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    return t;
+}
+
+EC_MICRO_SD_TYPE MicrosdPrefetch::getType ( void ) {
+    return this->cfg->card->getType();
+}
+
+EC_SD_STATUS MicrosdPrefetch::getStatus ( void ) {
+    return this->cfg->card->getStatus();
+}
+
+EC_SD_RESULT MicrosdPrefetch::getSectorCount ( uint32_t& sectorCount ) {
+    return this->cfg->card->getSectorCount( sectorCount );
+}
+
+EC_SD_RESULT MicrosdPrefetch::getBlockSize ( uint32_t& blockSize ) {
+    return this->cfg->card->getBlockSize( blockSize );
+}
+
+EC_SD_RESULT MicrosdPrefetch::getSdStatus ( MicrosdSdStatus& status ) {
+    return this->cfg->card->getSdStatus( status );
+}
+
+void MicrosdPrefetch::getStat ( MicrosdPrefetchStat& stat ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    stat		= this->stat;
+    stat.window	= this->window;
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+void MicrosdPrefetch::resetStat ( void ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    memset( &this->stat, 0, sizeof( this->stat ) );
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+#endif
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "project_config.h"
+
+#ifdef MODULE_MICROSD_SCHEDULER_ENABLED
+
+#include "user_os.h"
+#include "microsd_base.h"
+
+/*!
+ * Планировщик запросов поверх любой реализации MicrosdBase.
+ * Запросы всех задач (блокирующие readSector/writeSector и submit) попадают
+ * в одну очередь, которую обслуживает задача планировщика:
+ * - запросы выбираются по возрастанию сектора от текущего положения (C-LOOK),
+ *   после последнего - снова с наименьшего;
+ * - самый старый из запросов, ждущих дольше своего срока (readDeadlineMs/writeDeadlineMs),
+ *   выполняется первым, независимо от сектора и от более старых непросроченных запросов;
+ * - следующие подряд по секторам запросы одного типа объединяются
+ *   в одну многоблочную операцию (readSectors/writeSectors с фрагментами);
+ * - пересекающиеся запросы, из которых хотя бы один - запись,
+ *   выполняются строго в порядке поступления.
+ */
+
+#define MICROSD_SCHEDULER_TASK_STACK_SIZE				( 300 )
+
+/// Сколько запросов можно объединить в одну операцию.
+#define MICROSD_SCHEDULER_MERGE_MAX						( 16 )
+
+struct MicrosdSchedulerCfg {
+	MicrosdBase*		card;
+
+	uint32_t			readDeadlineMs;			// Максимальное ожидание в очереди до принудительного выполнения.
+	uint32_t			writeDeadlineMs;
+
+	/// Сколько ждать соседей, если в очереди всего один запрос (0 - не ждать).
+	uint32_t			batchMs;
+	uint32_t			taskPrio;
+};
+
+struct MicrosdSchedulerStat {
+	uint32_t		requests;				// Принято запросов.
+	uint32_t		dispatches;				// Операций с картой.
+	uint32_t		merged;					// Запросов, выполненных в составе чужой операции.
+	uint32_t		reordered;				// Операций, начатых не с самого старого запроса.
+	uint32_t		expired;				// Операций, выбранных по истекшему сроку.
+	uint32_t		maxDepth;				// Наибольшая длина очереди.
+};
+
+class MicrosdScheduler : public MicrosdBase {
+public:
+	MicrosdScheduler ( const MicrosdSchedulerCfg* const cfg );
+
+	EC_MICRO_SD_TYPE	initialize			( void );
+	EC_MICRO_SD_TYPE	getType				( void );
+
+	/// Ждут выполнения своего запроса без ограничения по времени
+	/// (запрос лежит в стеке вызывающего), timeout_ms передается карте.
+	EC_SD_RESULT		readSector			( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms );
+	EC_SD_RESULT		writeSector			( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms );
+
+	EC_SD_STATUS		getStatus			( void );
+	EC_SD_RESULT		getSectorCount		( uint32_t& sectorCount );
+	EC_SD_RESULT		getBlockSize		( uint32_t& blockSize );
+	EC_SD_RESULT		getSdStatus			( MicrosdSdStatus& status );
+
+	/// Выполняется после всех ранее поставленных запросов, пересекающих диапазон.
+	EC_SD_RESULT		discardSectors		( uint32_t sector, uint32_t count );
+
+	/// callback вызывается из задачи планировщика.
+	EC_SD_RESULT		submit				( MicrosdRequest* req );
+
+	void				getStat				( MicrosdSchedulerStat& stat );
+	void				resetStat			( void );
+
+private:
+	static void			task				( void* obj );
+	void				taskLoop			( void );
+
+	// Выбрать и выполнить одну операцию. false - очередь пуста.
+	bool				dispatch			( void );
+
+	// Выбор по сроку/C-LOOK и объединение соседей (под mutex-ом очереди).
+	// Выбранные запросы убираются из очереди, возвращается их количество.
+	uint32_t			pick				( MicrosdRequest** batch );
+
+	// Можно ли выполнить req раньше более старых запросов очереди.
+	bool				canReorder			( MicrosdRequest* req );
+
+	// Есть ли в очереди запросы, пересекающие диапазон.
+	bool				hasOverlap			( uint32_t sector, uint32_t count );
+
+	void				unlink				( MicrosdRequest* req );
+
+	EC_SD_RESULT		execute				( MicrosdRequest* const* batch, uint32_t count );
+
+	EC_SD_RESULT		transferBlocking	( EC_SD_REQUEST_TYPE type, uint8_t* buf, uint32_t sector, uint32_t count, uint32_t timeout_ms );
+
+	static void			blockingDone		( MicrosdRequest* req );
+
+	const MicrosdSchedulerCfg*		const cfg;
+
+	USER_OS_STATIC_MUTEX_BUFFER		qmb;
+	USER_OS_STATIC_MUTEX			qm				= nullptr;		// Очередь.
+
+	USER_OS_STATIC_MUTEX_BUFFER		dmb;
+	USER_OS_STATIC_MUTEX			dm				= nullptr;		// Обращения к карте.
+
+	USER_OS_STATIC_BIN_SEMAPHORE_BUFFER		kickBuf;
+	USER_OS_STATIC_BIN_SEMAPHORE			kick		= nullptr;		// Есть новые запросы.
+	USER_OS_STATIC_BIN_SEMAPHORE_BUFFER		doneBuf;
+	USER_OS_STATIC_BIN_SEMAPHORE			done		= nullptr;		// Выполнена очередная операция.
+
+	USER_OS_STATIC_STACK_TYPE		taskStack[ MICROSD_SCHEDULER_TASK_STACK_SIZE ];
+	USER_OS_STATIC_TASK_STRUCT_TYPE	taskStruct;
+
+	// Очередь в порядке поступления.
+	MicrosdRequest*					qHead			= nullptr;
+	MicrosdRequest*					qTail			= nullptr;
+	uint32_t						depth			= 0;
+
+	uint32_t						position		= 0;		// Сектор за последней операцией.
+
+	MicrosdSchedulerStat			stat;
+};
+
+#endif
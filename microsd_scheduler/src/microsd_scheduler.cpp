@@ -0,0 +1,356 @@
+#include "microsd_scheduler.h"
+
+#ifdef MODULE_MICROSD_SCHEDULER_ENABLED
+
+#include <string.h>
+
+MicrosdScheduler::MicrosdScheduler ( const MicrosdSchedulerCfg* const cfg ) : cfg( cfg ) {
+    this->qm	= USER_OS_STATIC_MUTEX_CREATE( &this->qmb );
+    this->dm	= USER_OS_STATIC_MUTEX_CREATE( &this->dmb );
+    this->kick	= USER_OS_STATIC_BIN_SEMAPHORE_CREATE( &this->kickBuf );
+    this->done	= USER_OS_STATIC_BIN_SEMAPHORE_CREATE( &this->doneBuf );
+
+    this->resetStat();
+
+    USER_OS_STATIC_TASK_CREATE( MicrosdScheduler::task, "sdSched", MICROSD_SCHEDULER_TASK_STACK_SIZE, this,
+                                this->cfg->taskPrio, this->taskStack, &this->taskStruct );
+}
+
+static bool isOverlap ( const MicrosdRequest* a, uint32_t sector, uint32_t count ) {
+    return ( a->sector < sector + count ) && ( sector < a->sector + a->count );
+}
+
+//**********************************************************************
+// Задача планировщика.
+//**********************************************************************
+void MicrosdScheduler::task ( void* obj ) {
+    ( ( MicrosdScheduler* )obj )->taskLoop();
+}
+
+void MicrosdScheduler::taskLoop ( void ) {
+    while ( true ) {
+        USER_OS_TAKE_BIN_SEMAPHORE( this->kick, portMAX_DELAY );
+
+        /// Одиночный запрос: даем соседям шанс прийти и объединиться с ним.
+        if ( ( this->cfg->batchMs != 0 ) && ( this->depth == 1 ) ) {
+            USER_OS_DELAY_MS( this->cfg->batchMs );
+        }
+
+        while ( this->dispatch() );
+    }
+}
+
+//**********************************************************************
+// Служебные методы очереди (вызываются под mutex-ом qm).
+//**********************************************************************
+void MicrosdScheduler::unlink ( MicrosdRequest* req ) {
+    MicrosdRequest** p = &this->qHead;
+    MicrosdRequest* prev = nullptr;
+    while ( *p != req ) {
+        prev = *p;
+        p = &( *p )->next;
+    }
+
+    *p = req->next;
+    if ( this->qTail == req ) {
+        this->qTail = prev;
+    }
+    req->next = nullptr;
+    this->depth--;
+}
+
+// Чтения между собой переставлять можно всегда, с записью - только без пересечения.
+bool MicrosdScheduler::canReorder ( MicrosdRequest* req ) {
+    for ( MicrosdRequest* r = this->qHead; r != req; r = r->next ) {
+        if ( ( ( r->type == EC_SD_REQUEST_TYPE::WRITE ) || ( req->type == EC_SD_REQUEST_TYPE::WRITE ) ) &&
+             isOverlap( r, req->sector, req->count ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MicrosdScheduler::hasOverlap ( uint32_t sector, uint32_t count ) {
+    for ( MicrosdRequest* r = this->qHead; r != nullptr; r = r->next ) {
+        if ( isOverlap( r, sector, count ) ) return true;
+    }
+    return false;
+}
+
+uint32_t MicrosdScheduler::pick ( MicrosdRequest** batch ) {
+    MicrosdRequest* c = this->qHead;
+    if ( c == nullptr ) return 0;
+
+    /// Очередь идет в порядке поступления: первый просроченный (со своим сроком
+    /// для чтения или записи) - самый старый. Если его нельзя обогнать
+    /// пересекающуюся запись, первой выполняется голова очереди.
+    uint32_t now = USER_OS_GET_TICK_COUNT();
+    MicrosdRequest* expired = nullptr;
+    for ( MicrosdRequest* r = this->qHead; r != nullptr; r = r->next ) {
+        uint32_t deadline = ( r->type == EC_SD_REQUEST_TYPE::READ ) ? this->cfg->readDeadlineMs : this->cfg->writeDeadlineMs;
+        if ( ( uint32_t )( now - r->tick ) >= deadline ) {
+            expired = r;
+            break;
+        }
+    }
+
+    if ( expired != nullptr ) {
+        this->stat.expired++;
+        c = this->canReorder( expired ) ? expired : this->qHead;
+    } else {
+        /// C-LOOK: ближайший сектор впереди, если впереди ничего нет - наименьший.
+        MicrosdRequest* ahead = nullptr;
+        MicrosdRequest* lowest = nullptr;
+        for ( MicrosdRequest* r = this->qHead; r != nullptr; r = r->next ) {
+            if ( !this->canReorder( r ) ) continue;
+            if ( ( r->sector >= this->position ) && ( ( ahead == nullptr ) || ( r->sector < ahead->sector ) ) ) {
+                ahead = r;
+            }
+            if ( ( lowest == nullptr ) || ( r->sector < lowest->sector ) ) {
+                lowest = r;
+            }
+        }
+        c = ( ahead != nullptr ) ? ahead : lowest;
+    }
+
+    if ( c != this->qHead ) {
+        this->stat.reordered++;
+    }
+
+    this->unlink( c );
+    batch[ 0 ] = c;
+    uint32_t n = 1;
+    uint32_t end = c->sector + c->count;
+
+    /// Присоединяем запросы того же типа, начинающиеся ровно на конце операции.
+    while ( n < MICROSD_SCHEDULER_MERGE_MAX ) {
+        MicrosdRequest* next = nullptr;
+        for ( MicrosdRequest* r = this->qHead; r != nullptr; r = r->next ) {
+            if ( ( r->type == c->type ) && ( r->sector == end ) && this->canReorder( r ) ) {
+                next = r;
+                break;
+            }
+        }
+
+        if ( next == nullptr ) break;
+
+        this->unlink( next );
+        batch[ n++ ] = next;
+        end += next->count;
+        this->stat.merged++;
+    }
+
+    this->position = end;
+    this->stat.dispatches++;
+
+    return n;
+}
+
+//**********************************************************************
+// Выполнение.
+//**********************************************************************
+EC_SD_RESULT MicrosdScheduler::execute ( MicrosdRequest* const* batch, uint32_t count ) {
+    EC_SD_REQUEST_TYPE type = batch[ 0 ]->type;
+    EC_SD_RESULT r;
+
+    if ( count == 1 ) {
+        MicrosdRequest* req = batch[ 0 ];
+        if ( type == EC_SD_REQUEST_TYPE::READ ) {
+            r = this->cfg->card->readSector( req->sector, req->buf, req->count, req->timeoutMs );
+        } else {
+            r = this->cfg->card->writeSector( req->buf, req->sector, req->count, req->timeoutMs );
+        }
+        req->result = r;
+        return r;
+    }
+
+    MicrosdSegment seg[ MICROSD_SCHEDULER_MERGE_MAX ];
+    uint32_t timeoutMs = 0;
+    for ( uint32_t i = 0; i < count; i++ ) {
+        seg[ i ].buf	= batch[ i ]->buf;
+        seg[ i ].count	= batch[ i ]->count;
+        if ( batch[ i ]->timeoutMs > timeoutMs ) timeoutMs = batch[ i ]->timeoutMs;
+    }
+
+    if ( type == EC_SD_REQUEST_TYPE::READ ) {
+        r = this->cfg->card->readSectors( batch[ 0 ]->sector, seg, count, timeoutMs );
+    } else {
+        r = this->cfg->card->writeSectors( batch[ 0 ]->sector, seg, count, timeoutMs );
+    }
+
+    if ( r == EC_SD_RESULT::OK ) {
+        for ( uint32_t i = 0; i < count; i++ ) {
+            batch[ i ]->result = r;
+        }
+        return r;
+    }
+
+    /// Ошибка объединенной операции не должна достаться чужим запросам - повторяем по одному.
+    for ( uint32_t i = 0; i < count; i++ ) {
+        this->execute( &batch[ i ], 1 );
+    }
+
+    return r;
+}
+
+bool MicrosdScheduler::dispatch ( void ) {
+    MicrosdRequest* batch[ MICROSD_SCHEDULER_MERGE_MAX ];
+
+    USER_OS_TAKE_MUTEX( this->dm, portMAX_DELAY );
+
+    USER_OS_TAKE_MUTEX( this->qm, portMAX_DELAY );
+    uint32_t n = this->pick( batch );
+    USER_OS_GIVE_MUTEX( this->qm );
+
+    if ( n != 0 ) {
+        this->execute( batch, n );
+    }
+
+    USER_OS_GIVE_MUTEX( this->dm );
+
+    /// После освобождения dm: callback может сразу поставить следующий запрос.
+    for ( uint32_t i = 0; i < n; i++ ) {
+        if ( batch[ i ]->callback != nullptr ) {
+            batch[ i ]->callback( batch[ i ] );
+        }
+    }
+
+    if ( n != 0 ) {
+        USER_OS_GIVE_BIN_SEMAPHORE( this->done );
+    }
+
+    return n != 0;
+}
+
+//**********************************************************************
+// Основной функционал.
+//**********************************************************************
+EC_SD_RESULT MicrosdScheduler::submit ( MicrosdRequest* req ) {
+    if ( req->count == 0 ) {
+        req->result = EC_SD_RESULT::OK;
+        if ( req->callback != nullptr ) {
+            req->callback( req );
+        }
+        return EC_SD_RESULT::OK;
+    }
+
+    req->next	= nullptr;
+    req->tick	= USER_OS_GET_TICK_COUNT();
+
+    USER_OS_TAKE_MUTEX( this->qm, portMAX_DELAY );
+
+    if ( this->qTail != nullptr ) {
+        this->qTail->next = req;
+    } else {
+        this->qHead = req;
+    }
+    this->qTail = req;
+
+    this->depth++;
+    this->stat.requests++;
+    if ( this->depth > this->stat.maxDepth ) {
+        this->stat.maxDepth = this->depth;
+    }
+
+    USER_OS_GIVE_MUTEX( this->qm );
+
+    USER_OS_GIVE_BIN_SEMAPHORE( this->kick );
+
+    return EC_SD_RESULT::OK;
+}
+
+void MicrosdScheduler::blockingDone ( MicrosdRequest* req ) {
+    USER_OS_GIVE_BIN_SEMAPHORE( *( USER_OS_STATIC_BIN_SEMAPHORE* )req->ctx );
+}
+
+EC_SD_RESULT MicrosdScheduler::transferBlocking ( EC_SD_REQUEST_TYPE type, uint8_t* buf, uint32_t sector, uint32_t count, uint32_t timeout_ms ) {
+    if ( count == 0 ) return EC_SD_RESULT::OK;
+
+    USER_OS_STATIC_BIN_SEMAPHORE_BUFFER sb;
+    USER_OS_STATIC_BIN_SEMAPHORE s = USER_OS_STATIC_BIN_SEMAPHORE_CREATE( &sb );
+
+    MicrosdRequest req;
+    req.type		= type;
+    req.sector		= sector;
+    req.buf			= buf;
+    req.count		= count;
+    req.timeoutMs	= timeout_ms;
+    req.callback	= MicrosdScheduler::blockingDone;
+    req.ctx			= &s;
+    req.result		= EC_SD_RESULT::ERROR;
+
+    this->submit( &req );
+    USER_OS_TAKE_BIN_SEMAPHORE( s, portMAX_DELAY );
+
+    return req.result;
+}
+
+EC_SD_RESULT MicrosdScheduler::readSector ( uint32_t sector, uint8_t *target_array, uint32_t cout_sector, uint32_t timeout_ms ) {
+    return this->transferBlocking( EC_SD_REQUEST_TYPE::READ, target_array, sector, cout_sector, timeout_ms );
+}
+
+EC_SD_RESULT MicrosdScheduler::writeSector ( const uint8_t* const source_array, uint32_t sector, uint32_t cout_sector, uint32_t timeout_ms ) {
+    return this->transferBlocking( EC_SD_REQUEST_TYPE::WRITE, ( uint8_t* )source_array, sector, cout_sector, timeout_ms );
+}
+
+EC_SD_RESULT MicrosdScheduler::discardSectors ( uint32_t sector, uint32_t count ) {
+    /// Ранее поставленные запросы к этим секторам должны выполниться до стирания.
+    while ( true ) {
+        USER_OS_TAKE_MUTEX( this->qm, portMAX_DELAY );
+        bool pending = this->hasOverlap( sector, count );
+        USER_OS_GIVE_MUTEX( this->qm );
+
+        if ( !pending ) break;
+
+        USER_OS_TAKE_BIN_SEMAPHORE( this->done, 10 );
+    }
+
+    /// Выполняемая сейчас операция (уже не в очереди) закончится до захвата dm.
+    USER_OS_TAKE_MUTEX( this->dm, portMAX_DELAY );
+    EC_SD_RESULT r = this->cfg->card->discardSectors( sector, count );
+    USER_OS_GIVE_MUTEX( this->dm );
+
+    return r;
+}
+
+EC_MICRO_SD_TYPE MicrosdScheduler::initialize ( void ) {
+    USER_OS_TAKE_MUTEX( this->dm, portMAX_DELAY );
+    EC_MICRO_SD_TYPE t = this->cfg->card->initialize();
+    USER_OS_GIVE_MUTEX( this->dm );
+
+    return t;
+}
+
+EC_MICRO_SD_TYPE MicrosdScheduler::getType ( void ) {
+    return this->cfg->card->getType();
+}
+
+EC_SD_STATUS MicrosdScheduler::getStatus ( void ) {
+    return this->cfg->card->getStatus();
+}
+
+EC_SD_RESULT MicrosdScheduler::getSectorCount ( uint32_t& sectorCount ) {
+    return this->cfg->card->getSectorCount( sectorCount );
+}
+
+EC_SD_RESULT MicrosdScheduler::getBlockSize ( uint32_t& blockSize ) {
+    return this->cfg->card->getBlockSize( blockSize );
+}
+
+EC_SD_RESULT MicrosdScheduler::getSdStatus ( MicrosdSdStatus& status ) {
+    return this->cfg->card->getSdStatus( status );
+}
+
+void MicrosdScheduler::getStat ( MicrosdSchedulerStat& stat ) {
+    USER_OS_TAKE_MUTEX( this->qm, portMAX_DELAY );
+    stat = this->stat;
+    USER_OS_GIVE_MUTEX( this->qm );
+}
+
+void MicrosdScheduler::resetStat ( void ) {
+    USER_OS_TAKE_MUTEX( this->qm, portMAX_DELAY );
+    memset( &this->stat, 0, sizeof( this->stat ) );
+    USER_OS_GIVE_MUTEX( this->qm );
+}
+
+#endif
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "project_config.h"
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+
+#include "mc_spi.h"
+#include "user_os.h"
+
+/*!
+ * Общая шина SPI для нескольких устройств (карты MicrosdSpi, flash и т.д.).
+ * Шина выдается устройствам строго по очереди запросов (FIFO), поэтому
+ * частые запросы одного устройства не могут бесконечно откладывать другие
+ * (mutex FreeRTOS отдается по приоритету задач, а не по очереди).
+ * Скорость/режим SPI настраиваются callback-ом устройства только когда
+ * шина переходит к другому устройству или устройство просит другой режим.
+ */
+
+class MicrosdSpiBus;
+
+class MicrosdSpiBusDevice {
+	friend class MicrosdSpiBus;
+
+public:
+	/// configure - выставить скорость/режим SPI для этого устройства (mode - см. acquire).
+	MicrosdSpiBusDevice ( void ( *configure ) ( SpiMaster8BitBase* spi, void* ctx, uint32_t mode ), void* ctx );
+
+private:
+	void						( * const configure ) ( SpiMaster8BitBase* spi, void* ctx, uint32_t mode );
+	void*						const ctx;
+
+	uint32_t					mode			= 0;
+	MicrosdSpiBusDevice*		next			= nullptr;		// Очередь ожидающих.
+
+	USER_OS_STATIC_BIN_SEMAPHORE_BUFFER		sb;
+	USER_OS_STATIC_BIN_SEMAPHORE			s		= nullptr;		// Шина передана этому устройству.
+};
+
+struct MicrosdSpiBusStat {
+	uint32_t		acquires;
+	uint32_t		contended;				// Запросов, которым пришлось ждать в очереди.
+	uint32_t		switches;				// Перенастроек SPI (смена устройства или режима).
+	uint32_t		yields;					// Передач шины другому устройству на время busy.
+	uint32_t		timeouts;
+};
+
+class MicrosdSpiBus {
+public:
+	MicrosdSpiBus ( SpiMaster8BitBase* const spi );
+
+	/// Занять шину. Возвращает false, если за timeoutMs очередь не дошла.
+	/// mode - произвольный код режима устройства (для MicrosdSpi: 0 - низкая скорость, 1 - высокая).
+	bool				acquire				( MicrosdSpiBusDevice* dev, uint32_t mode, uint32_t timeoutMs = portMAX_DELAY );
+
+	/// Отдать шину следующему в очереди. CS устройства к этому моменту должен быть снят.
+	void				release				( MicrosdSpiBusDevice* dev );
+
+	/// Если шину ждут другие устройства - отдать ее им и встать в конец очереди
+	/// (например, пока карта программирует flash и CS снят).
+	/// true - шина отдавалась (SPI мог быть перенастроен другим устройством).
+	bool				yield				( MicrosdSpiBusDevice* dev );
+
+	/// Есть ли устройства, ждущие шину (без блокировки, для решения "стоит ли вызывать yield").
+	bool				hasWaiters			( void );
+
+	SpiMaster8BitBase*	getSpi				( void );
+
+	void				getStat				( MicrosdSpiBusStat& stat );
+	void				resetStat			( void );
+
+private:
+	// Шина уже у dev: перенастроить SPI, если он настроен под другое устройство/режим.
+	void				setup				( MicrosdSpiBusDevice* dev );
+
+	// Встать в конец очереди / отдать шину первому в очереди (под mutex-ом).
+	void				enqueue				( MicrosdSpiBusDevice* dev );
+	void				passOn				( void );
+
+	SpiMaster8BitBase*				const spi;
+
+	USER_OS_STATIC_MUTEX_BUFFER		mb;
+	USER_OS_STATIC_MUTEX			m				= nullptr;		// Защищает очередь, не саму шину.
+
+	MicrosdSpiBusDevice*			owner			= nullptr;
+	MicrosdSpiBusDevice*			qHead			= nullptr;
+	MicrosdSpiBusDevice*			qTail			= nullptr;
+
+	MicrosdSpiBusDevice*			configured		= nullptr;		// Под кого сейчас настроен SPI.
+	uint32_t						configuredMode	= 0;
+
+	MicrosdSpiBusStat				stat;
+};
+
+#endif
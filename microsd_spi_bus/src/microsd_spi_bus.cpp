@@ -0,0 +1,159 @@
+#include "microsd_spi_bus.h"
+
+#ifdef MODULE_MICROSD_SPI_BUS_ENABLED
+
+#include <string.h>
+
+MicrosdSpiBusDevice::MicrosdSpiBusDevice ( void ( *configure ) ( SpiMaster8BitBase* spi, void* ctx, uint32_t mode ), void* ctx ) :
+    configure( configure ), ctx( ctx ) {
+    this->s = USER_OS_STATIC_BIN_SEMAPHORE_CREATE( &this->sb );
+}
+
+MicrosdSpiBus::MicrosdSpiBus ( SpiMaster8BitBase* const spi ) : spi( spi ) {
+    this->m = USER_OS_STATIC_MUTEX_CREATE( &this->mb );
+    this->resetStat();
+}
+
+SpiMaster8BitBase* MicrosdSpiBus::getSpi ( void ) {
+    return this->spi;
+}
+
+// Вызывается владельцем шины, поэтому configured меняется без mutex-а.
+void MicrosdSpiBus::setup ( MicrosdSpiBusDevice* dev ) {
+    if ( ( this->configured == dev ) && ( this->configuredMode == dev->mode ) ) return;
+
+    dev->configure( this->spi, dev->ctx, dev->mode );
+    this->configured		= dev;
+    this->configuredMode	= dev->mode;
+    this->stat.switches++;
+}
+
+void MicrosdSpiBus::passOn ( void ) {
+    MicrosdSpiBusDevice* d = this->qHead;
+    if ( d == nullptr ) return;
+
+    this->qHead = d->next;
+    if ( this->qHead == nullptr ) {
+        this->qTail = nullptr;
+    }
+    d->next = nullptr;
+
+    this->owner = d;
+    USER_OS_GIVE_BIN_SEMAPHORE( d->s );
+}
+
+void MicrosdSpiBus::enqueue ( MicrosdSpiBusDevice* dev ) {
+    if ( this->qTail != nullptr ) {
+        this->qTail->next = dev;
+    } else {
+        this->qHead = dev;
+    }
+    this->qTail = dev;
+}
+
+bool MicrosdSpiBus::acquire ( MicrosdSpiBusDevice* dev, uint32_t mode, uint32_t timeoutMs ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    this->stat.acquires++;
+    dev->mode = mode;
+
+    if ( ( this->owner == nullptr ) && ( this->qHead == nullptr ) ) {
+        this->owner = dev;
+        USER_OS_GIVE_MUTEX( this->m );
+        this->setup( dev );
+        return true;
+    }
+
+    this->stat.contended++;
+
+    USER_OS_TAKE_BIN_SEMAPHORE( dev->s, 0 );			// Отдача, оставшаяся от прошлого таймаута.
+    this->enqueue( dev );
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    bool ok = ( USER_OS_TAKE_BIN_SEMAPHORE( dev->s, timeoutMs ) == pdTRUE );
+
+    if ( !ok ) {
+        USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+        if ( this->owner == dev ) {
+            /// Шина пришла одновременно с таймаутом.
+            ok = true;
+        } else {
+            MicrosdSpiBusDevice** p = &this->qHead;
+            MicrosdSpiBusDevice* prev = nullptr;
+            while ( *p != dev ) {
+                prev = *p;
+                p = &( *p )->next;
+            }
+            *p = dev->next;
+            if ( this->qTail == dev ) {
+                this->qTail = prev;
+            }
+            dev->next = nullptr;
+            this->stat.timeouts++;
+        }
+
+        USER_OS_GIVE_MUTEX( this->m );
+    }
+
+    if ( ok ) {
+        this->setup( dev );
+    }
+
+    return ok;
+}
+
+void MicrosdSpiBus::release ( MicrosdSpiBusDevice* dev ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    if ( this->owner == dev ) {
+        this->owner = nullptr;
+        this->passOn();
+    }
+
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+bool MicrosdSpiBus::yield ( MicrosdSpiBusDevice* dev ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+
+    if ( ( this->owner != dev ) || ( this->qHead == nullptr ) ) {
+        USER_OS_GIVE_MUTEX( this->m );
+        return false;
+    }
+
+    this->stat.yields++;
+
+    USER_OS_TAKE_BIN_SEMAPHORE( dev->s, 0 );
+    this->owner = nullptr;
+    this->passOn();
+
+    /// В конец очереди: до нас шину получат все, кто уже ждал.
+    this->enqueue( dev );
+
+    USER_OS_GIVE_MUTEX( this->m );
+
+    USER_OS_TAKE_BIN_SEMAPHORE( dev->s, portMAX_DELAY );
+    this->setup( dev );
+
+    return true;
+}
+
+bool MicrosdSpiBus::hasWaiters ( void ) {
+    return __atomic_load_n( &this->qHead, __ATOMIC_RELAXED ) != nullptr;
+}
+
+void MicrosdSpiBus::getStat ( MicrosdSpiBusStat& stat ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    stat = this->stat;
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+void MicrosdSpiBus::resetStat ( void ) {
+    USER_OS_TAKE_MUTEX( this->m, portMAX_DELAY );
+    memset( &this->stat, 0, sizeof( this->stat ) );
+    USER_OS_GIVE_MUTEX( this->m );
+}
+
+#endif
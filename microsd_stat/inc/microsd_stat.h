@@ -0,0 +1,105 @@
+#pragma once
+
+#include "project_config.h"
+
+#include <stdint.h>
+
+/*!
+ * Необязательная статистика драйверов MicrosdSpi и MicrosdSdio.
+ * Без MODULE_MICROSD_STAT_ENABLED от нее остаются только пустые макросы,
+ * в код драйверов ничего не попадает.
+ *
+ * Счетчики 32-х битные и обновляются атомарно (LDREX/STREX), поэтому
+ * snapshot можно снимать из задачи телеметрии, не останавливая обмен.
+ * Времена - в мкс от getTimeUs, суммы переполняются через ~71 минуту
+ * (задача телеметрии должна снимать их с reset чаще).
+ */
+
+#ifdef MODULE_MICROSD_STAT_ENABLED
+
+#include "microsd_base.h"
+
+// Ячейка [0] - 0 мкс, ячейка [i] - [2^(i-1); 2^i) мкс, последняя - все, что больше.
+#define MICROSD_STAT_HIST_SIZE				( 24 )
+
+enum class EC_MICROSD_STAT_OP {
+	READ			=	0,
+	WRITE			=	1,
+	OTHER			=	2			// initialize, getStatus, getSectorCount...
+};
+
+#define MICROSD_STAT_OP_COUNT				( 3 )
+
+struct MicrosdStatData {
+	uint32_t		cmd[ 64 ];									// Передано команд CMDn.
+	uint32_t		acmd[ 64 ];									// Передано команд ACMDn.
+
+	uint32_t		ops[ MICROSD_STAT_OP_COUNT ];
+	uint32_t		latency[ MICROSD_STAT_OP_COUNT ][ MICROSD_STAT_HIST_SIZE ];	// Длительность операций.
+
+	uint32_t		mutexWaitUs;								// Ожидание mutex драйвера.
+	uint32_t		mutexWaitMaxUs;
+	uint32_t		mutexWait[ MICROSD_STAT_HIST_SIZE ];
+
+	uint32_t		busyUs;										// Ожидание готовности карты (busy/waitReadySd).
+	uint32_t		busyMaxUs;
+	uint32_t		busyWaits;
+
+	uint32_t		spins;										// Опрошено байт/состояний в ожидании маркера/busy.
+	uint32_t		yields;										// Сколько раз при этом отдали процессор.
+
+	uint32_t		retries;									// Повторы запросов (ошибка CRC).
+
+	uint32_t		zeroCopySectors;							// Секторов передано по DMA прямо в буфер пользователя.
+	uint32_t		bounceSectors;								// Секторов передано через промежуточный буфер (SDIO).
+	uint32_t		bounceOps;									// Фрагментов, которым понадобился промежуточный буфер.
+
+	uint32_t		result[ 8 ];								// Итоги операций по EC_SD_RESULT.
+	uint32_t		res[ 8 ];									// Ошибки протокола по EC_SD_RES (SPI).
+};
+
+class MicrosdStat {
+public:
+	/// getTimeUs - источник времени в мкс (может переполняться).
+	MicrosdStat ( uint32_t ( *getTimeUs ) ( void ) );
+
+	uint32_t			now				( void );
+
+	void				cmd				( uint8_t index );
+	void				acmd			( uint8_t index );
+	void				op				( EC_MICROSD_STAT_OP op, uint32_t startUs );
+	void				mutexWait		( uint32_t startUs );
+	void				busy			( uint32_t startUs );
+	void				spins			( uint32_t count );
+	void				yield			( void );
+	void				retry			( void );
+	void				zeroCopy		( uint32_t sectors );
+	void				bounce			( uint32_t sectors );
+	void				result			( EC_SD_RESULT r );
+	void				res				( EC_SD_RES r );
+
+	/// Копия всех счетчиков. reset == true - обнулить скопированное
+	/// (каждый счетчик забирается атомарно, события между полями не теряются).
+	void				snapshot		( MicrosdStatData& out, bool reset = false );
+	void				reset			( void );
+
+private:
+	static uint32_t		getBucket		( uint32_t us );
+	static void			add				( uint32_t* v, uint32_t d );
+	static void			max				( uint32_t* v, uint32_t d );
+
+	uint32_t			( * const getTimeUs ) ( void );
+	MicrosdStatData		d;
+};
+
+// Засечь время (переменная объявляется только при включенной статистике).
+#define MICROSD_STAT_START(stat,var)		uint32_t var = ( ( stat ) != nullptr ) ? ( stat )->now() : 0
+// Вызов метода MicrosdStat, если статистика подключена.
+#define MICROSD_STAT(stat,call)				do { if ( ( stat ) != nullptr ) ( stat )->call; } while ( 0 )
+
+#else
+
+#define MICROSD_STAT_START(stat,var)
+#define MICROSD_STAT(stat,call)				do {} while ( 0 )
+
+#endif
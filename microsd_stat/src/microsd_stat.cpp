@@ -0,0 +1,102 @@
+#include "microsd_stat.h"
+
+#ifdef MODULE_MICROSD_STAT_ENABLED
+
+#include <string.h>
+
+MicrosdStat::MicrosdStat ( uint32_t ( *getTimeUs ) ( void ) ) : getTimeUs( getTimeUs ) {
+    memset( &this->d, 0, sizeof( this->d ) );
+}
+
+uint32_t MicrosdStat::now ( void ) {
+    return this->getTimeUs();
+}
+
+uint32_t MicrosdStat::getBucket ( uint32_t us ) {
+    uint32_t b = ( us == 0 ) ? 0 : ( 32 - __builtin_clz( us ) );
+    return ( b < MICROSD_STAT_HIST_SIZE ) ? b : ( MICROSD_STAT_HIST_SIZE - 1 );
+}
+
+void MicrosdStat::add ( uint32_t* v, uint32_t d ) {
+    __atomic_fetch_add( v, d, __ATOMIC_RELAXED );
+}
+
+void MicrosdStat::max ( uint32_t* v, uint32_t d ) {
+    uint32_t cur = __atomic_load_n( v, __ATOMIC_RELAXED );
+    while ( ( d > cur ) && !__atomic_compare_exchange_n( v, &cur, d, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+}
+
+void MicrosdStat::cmd ( uint8_t index ) {
+    add( &this->d.cmd[ index & 0x3F ], 1 );
+}
+
+void MicrosdStat::acmd ( uint8_t index ) {
+    add( &this->d.acmd[ index & 0x3F ], 1 );
+}
+
+void MicrosdStat::op ( EC_MICROSD_STAT_OP op, uint32_t startUs ) {
+    uint32_t us = this->now() - startUs;
+    add( &this->d.ops[ ( uint32_t )op ], 1 );
+    add( &this->d.latency[ ( uint32_t )op ][ getBucket( us ) ], 1 );
+}
+
+void MicrosdStat::mutexWait ( uint32_t startUs ) {
+    uint32_t us = this->now() - startUs;
+    add( &this->d.mutexWaitUs, us );
+    max( &this->d.mutexWaitMaxUs, us );
+    add( &this->d.mutexWait[ getBucket( us ) ], 1 );
+}
+
+void MicrosdStat::busy ( uint32_t startUs ) {
+    uint32_t us = this->now() - startUs;
+    add( &this->d.busyUs, us );
+    max( &this->d.busyMaxUs, us );
+    add( &this->d.busyWaits, 1 );
+}
+
+void MicrosdStat::spins ( uint32_t count ) {
+    add( &this->d.spins, count );
+}
+
+void MicrosdStat::yield ( void ) {
+    add( &this->d.yields, 1 );
+}
+
+void MicrosdStat::retry ( void ) {
+    add( &this->d.retries, 1 );
+}
+
+void MicrosdStat::zeroCopy ( uint32_t sectors ) {
+    add( &this->d.zeroCopySectors, sectors );
+}
+
+void MicrosdStat::bounce ( uint32_t sectors ) {
+    add( &this->d.bounceOps, 1 );
+    add( &this->d.bounceSectors, sectors );
+}
+
+void MicrosdStat::result ( EC_SD_RESULT r ) {
+    add( &this->d.result[ ( uint32_t )r & 7 ], 1 );
+}
+
+void MicrosdStat::res ( EC_SD_RES r ) {
+    add( &this->d.res[ ( uint32_t )r & 7 ], 1 );
+}
+
+// Структура состоит только из uint32_t, поэтому копируется пословно.
+void MicrosdStat::snapshot ( MicrosdStatData& out, bool reset ) {
+    uint32_t* src = ( uint32_t* )&this->d;
+    uint32_t* dst = ( uint32_t* )&out;
+
+    for ( uint32_t i = 0; i < sizeof( MicrosdStatData ) / sizeof( uint32_t ); i++ ) {
+        dst[ i ] = reset ? __atomic_exchange_n( &src[ i ], 0, __ATOMIC_RELAXED ) :
+                           __atomic_load_n( &src[ i ], __ATOMIC_RELAXED );
+    }
+}
+
+void MicrosdStat::reset ( void ) {
+    MicrosdStatData tmp;
+    this->snapshot( tmp, true );
+}
+
+#endif
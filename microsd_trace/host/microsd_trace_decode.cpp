@@ -0,0 +1,288 @@
+/*!
+ * Разбор выгрузки MicrosdTrace::dump на хосте (Linux).
+ *
+ * Сборка:
+ * g++ -std=c++14 -O2 -Imicrosd_trace/host -Imicrosd_trace/inc \
+ *     microsd_trace/host/microsd_trace_decode.cpp -o microsd_trace_decode
+ *
+ * Запуск:
+ *     ./microsd_trace_decode trace.bin		- временная шкала и сводка.
+ *     ./microsd_trace_decode -s trace.bin		- только сводка.
+ *
+ * Для каждого события печатается время от первого события, интервал от
+ * предыдущего и длительность фазы, которую событие завершает:
+ *     RESPONSE	- от CMD (передача команды и NCR);
+ *     TOKEN		- от предыдущего RESPONSE/DATA_END (ожидание маркера данных);
+ *     DATA_END	- от DATA_START (передача блока);
+ *     DMA_DONE	- от DATA_START (команда и DMA целиком, SDIO);
+ *     BUSY_END	- от последнего DATA_END (программирование flash картой);
+ *     OP_END		- от OP_START (вся операция).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "microsd_trace.h"
+
+enum PHASE {
+    PHASE_CMD		= 0,
+    PHASE_TOKEN,
+    PHASE_DATA,
+    PHASE_DMA,
+    PHASE_BUSY,
+    PHASE_READ,
+    PHASE_WRITE,
+    PHASE_COUNT
+};
+
+static const char* const phaseName[ PHASE_COUNT ] = {
+    "cmd+ncr", "token wait", "data block", "dma", "busy", "read op", "write op"
+};
+
+struct PhaseStat {
+    uint32_t		count;
+    uint64_t		totalUs;
+    uint32_t		maxUs;
+};
+
+static PhaseStat	phases[ PHASE_COUNT ];
+
+static void addPhase ( PHASE p, uint32_t us ) {
+    phases[ p ].count++;
+    phases[ p ].totalUs += us;
+    if ( us > phases[ p ].maxUs ) phases[ p ].maxUs = us;
+}
+
+static const char* eventName ( EC_MICROSD_TRACE_EVENT t ) {
+    switch ( t ) {
+    case EC_MICROSD_TRACE_EVENT::OP_START:		return "OP_START";
+    case EC_MICROSD_TRACE_EVENT::OP_END:		return "OP_END";
+    case EC_MICROSD_TRACE_EVENT::CMD:			return "CMD";
+    case EC_MICROSD_TRACE_EVENT::RESPONSE:		return "RESPONSE";
+    case EC_MICROSD_TRACE_EVENT::TOKEN:			return "TOKEN";
+    case EC_MICROSD_TRACE_EVENT::DATA_START:	return "DATA_START";
+    case EC_MICROSD_TRACE_EVENT::DATA_END:		return "DATA_END";
+    case EC_MICROSD_TRACE_EVENT::BUSY_END:		return "BUSY_END";
+    case EC_MICROSD_TRACE_EVENT::DMA_DONE:		return "DMA_DONE";
+    default:									return "?";
+    }
+}
+
+// Метка времени, от которой отсчитывается фаза (valid == false - начала фазы не было в трассе).
+struct Mark {
+    bool			valid;
+    uint32_t		timeUs;
+};
+
+static void setMark ( Mark& m, uint32_t timeUs ) {
+    m.valid		= true;
+    m.timeUs	= timeUs;
+}
+
+int main ( int argc, char** argv ) {
+    bool summaryOnly = false;
+    const char* path = nullptr;
+
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp( argv[ i ], "-s" ) == 0 ) {
+            summaryOnly = true;
+        } else {
+            path = argv[ i ];
+        }
+    }
+
+    if ( path == nullptr ) {
+        fprintf( stderr, "usage: %s [-s] trace.bin\n", argv[ 0 ] );
+        return 2;
+    }
+
+    FILE* f = fopen( path, "rb" );
+    if ( f == nullptr ) {
+        perror( path );
+        return 1;
+    }
+
+    MicrosdTraceHeader h;
+    if ( ( fread( &h, sizeof( h ), 1, f ) != 1 ) || ( h.magic != MICROSD_TRACE_MAGIC ) ) {
+        fprintf( stderr, "%s: not a microsd trace dump\n", path );
+        fclose( f );
+        return 1;
+    }
+
+    if ( ( h.version != MICROSD_TRACE_VERSION ) || ( h.eventSize != sizeof( MicrosdTraceEvent ) ) ) {
+        fprintf( stderr, "%s: unsupported version %u (event size %u)\n", path, h.version, h.eventSize );
+        fclose( f );
+        return 1;
+    }
+
+    Mark cmd = {}, data = {}, lastPhaseEnd = {}, lastDataEnd = {}, op = {};
+    EC_MICROSD_TRACE_OP opType = EC_MICROSD_TRACE_OP::READ;
+    uint32_t opSectors = 0;
+
+    uint64_t bytes[ 2 ] = { 0, 0 };
+    uint32_t errors = 0, empty = 0, read = 0;
+    uint32_t first = 0, prev = 0, last = 0;
+
+    if ( !summaryOnly ) {
+        printf( "%12s %10s  %-10s\n", "time, us", "+us", "event" );
+    }
+
+    MicrosdTraceEvent e;
+    while ( ( read < h.count ) && ( fread( &e, sizeof( e ), 1, f ) == 1 ) ) {
+        read++;
+
+        if ( e.type == EC_MICROSD_TRACE_EVENT::EMPTY ) {			// Ячейка перезаписывалась во время выгрузки.
+            empty++;
+            continue;
+        }
+
+        if ( read - empty == 1 ) {
+            first = prev = e.timeUs;
+        }
+        last = e.timeUs;
+
+        char info[ 96 ] = "";
+        uint32_t phaseUs = 0;
+        bool phase = false;
+
+        switch ( e.type ) {
+        case EC_MICROSD_TRACE_EVENT::OP_START:
+            setMark( op, e.timeUs );
+            opType		= ( EC_MICROSD_TRACE_OP )e.code;
+            opSectors	= e.len;
+            snprintf( info, sizeof( info ), "%s sector=%u count=%u",
+                      ( opType == EC_MICROSD_TRACE_OP::READ ) ? "read" : "write", e.arg, e.len );
+            break;
+
+        case EC_MICROSD_TRACE_EVENT::OP_END:
+            if ( e.code != 0 ) errors++;
+            if ( op.valid ) {
+                phaseUs = e.timeUs - op.timeUs;
+                phase = true;
+                bool isRead = ( opType == EC_MICROSD_TRACE_OP::READ );
+                addPhase( isRead ? PHASE_READ : PHASE_WRITE, phaseUs );
+                if ( e.code == 0 ) {
+                    bytes[ isRead ? 0 : 1 ] += ( uint64_t )opSectors * 512;
+                }
+                op.valid = false;
+            }
+            snprintf( info, sizeof( info ), "result=%u", e.code );
+            break;
+
+        case EC_MICROSD_TRACE_EVENT::CMD:
+            setMark( cmd, e.timeUs );
+            snprintf( info, sizeof( info ), "%s%u arg=0x%08X",
+                      ( e.code & MICROSD_TRACE_ACMD_FLAG ) ? "ACMD" : "CMD", e.code & 0x3F, e.arg );
+            break;
+
+        case EC_MICROSD_TRACE_EVENT::RESPONSE:
+            if ( cmd.valid ) {
+                phaseUs = e.timeUs - cmd.timeUs;
+                phase = true;
+                addPhase( PHASE_CMD, phaseUs );
+                cmd.valid = false;
+            }
+            setMark( lastPhaseEnd, e.timeUs );
+            snprintf( info, sizeof( info ), "r1=0x%02X", e.code );
+            break;
+
+        case EC_MICROSD_TRACE_EVENT::TOKEN:
+            if ( lastPhaseEnd.valid ) {
+                phaseUs = e.timeUs - lastPhaseEnd.timeUs;
+                phase = true;
+                addPhase( PHASE_TOKEN, phaseUs );
+            }
+            snprintf( info, sizeof( info ), "token=0x%02X", e.code );
+            break;
+
+        case EC_MICROSD_TRACE_EVENT::DATA_START:
+            setMark( data, e.timeUs );
+            snprintf( info, sizeof( info ), "sectors=%u", e.len );
+            break;
+
+        case EC_MICROSD_TRACE_EVENT::DATA_END:
+            if ( e.code != 0 ) errors++;
+            if ( data.valid ) {
+                phaseUs = e.timeUs - data.timeUs;
+                phase = true;
+                addPhase( PHASE_DATA, phaseUs );
+                data.valid = false;
+            }
+            setMark( lastPhaseEnd, e.timeUs );
+            setMark( lastDataEnd, e.timeUs );
+            snprintf( info, sizeof( info ), "res=%u", e.code );
+            break;
+
+        case EC_MICROSD_TRACE_EVENT::DMA_DONE:
+            if ( e.code != 0 ) errors++;
+            if ( data.valid ) {
+                phaseUs = e.timeUs - data.timeUs;
+                phase = true;
+                addPhase( PHASE_DMA, phaseUs );
+                data.valid = false;
+            }
+            setMark( lastDataEnd, e.timeUs );
+            snprintf( info, sizeof( info ), "result=%u", e.code );
+            break;
+
+        case EC_MICROSD_TRACE_EVENT::BUSY_END:
+            if ( e.code != 0 ) errors++;
+            if ( lastDataEnd.valid ) {
+                phaseUs = e.timeUs - lastDataEnd.timeUs;
+                phase = true;
+                addPhase( PHASE_BUSY, phaseUs );
+                lastDataEnd.valid = false;
+            }
+            snprintf( info, sizeof( info ), "res=%u", e.code );
+            break;
+
+        default:
+            snprintf( info, sizeof( info ), "type=%u", ( unsigned )e.type );
+            break;
+        }
+
+        if ( !summaryOnly ) {
+            // События из прерываний могут прийти с меткой чуть раньше предыдущей.
+            printf( "%12u %+10d  %-10s %s", e.timeUs - first, ( int32_t )( e.timeUs - prev ), eventName( e.type ), info );
+            if ( phase ) {
+                printf( "  [%u us]", phaseUs );
+            }
+            printf( "\n" );
+        }
+
+        prev = e.timeUs;
+    }
+
+    fclose( f );
+
+    if ( read < h.count ) {
+        fprintf( stderr, "%s: truncated, %u of %u events\n", path, read, h.count );
+    }
+
+    uint32_t spanUs = last - first;
+
+    printf( "\nevents: %u (lost before dump: %u, torn: %u), span %u us, errors: %u\n",
+            read - empty, h.lost, empty, spanUs, errors );
+
+    printf( "%-12s %8s %12s %10s %10s\n", "phase", "count", "total, us", "avg, us", "max, us" );
+    for ( uint32_t i = 0; i < PHASE_COUNT; i++ ) {
+        if ( phases[ i ].count == 0 ) continue;
+        printf( "%-12s %8u %12llu %10.1f %10u\n", phaseName[ i ], phases[ i ].count,
+                ( unsigned long long )phases[ i ].totalUs,
+                ( double )phases[ i ].totalUs / phases[ i ].count, phases[ i ].maxUs );
+    }
+
+    // "op" - полезные байты к суммарному времени операций (скорость самой карты),
+    // "span" - к длительности трассы (с учетом простоев между запросами).
+    for ( uint32_t i = 0; i < 2; i++ ) {
+        const PhaseStat& p = phases[ ( i == 0 ) ? PHASE_READ : PHASE_WRITE ];
+        if ( p.count == 0 ) continue;
+        printf( "%-5s: %llu bytes, %.3f MB/s (op), %.3f MB/s (span)\n", ( i == 0 ) ? "read" : "write",
+                ( unsigned long long )bytes[ i ],
+                ( p.totalUs != 0 ) ? ( double )bytes[ i ] / p.totalUs : 0.0,
+                ( spanUs != 0 ) ? ( double )bytes[ i ] / spanUs : 0.0 );
+    }
+
+    return 0;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// Конфигурация для сборки декодера трассы на хосте (Linux).
+// Декодеру нужны только форматы событий, сам MicrosdTrace не собирается.
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "project_config.h"
+
+#include <stdint.h>
+
+/*!
+ * Кольцевой буфер событий шины для отладки в поле.
+ * Драйвер пишет короткие события с меткой времени, буфер выгружается
+ * (dump) на карту/UART и разбирается на хосте утилитой
+ * microsd_trace/host/microsd_trace_decode.cpp.
+ *
+ * Запись одного события - атомарный инкремент индекса, чтение времени
+ * и 12 байт в память, без mutex и запрета прерываний. Писать можно
+ * из нескольких задач и из прерываний одновременно.
+ * Буфер хранит последние size событий, старые перезаписываются.
+ */
+
+#define MICROSD_TRACE_MAGIC					( 0x5444534D )		// "MSDT".
+#define MICROSD_TRACE_VERSION				( 1 )
+
+enum class EC_MICROSD_TRACE_EVENT : uint8_t {
+	EMPTY			=	0,			// Ячейка еще не записывалась.
+	OP_START		=	1,			// code - EC_MICROSD_TRACE_OP,	len - секторов,	arg - сектор.
+	OP_END			=	2,			// code - EC_SD_RESULT.
+	CMD				=	3,			// code - индекс команды (ACMD - с флагом 0x40), arg - аргумент.
+	RESPONSE		=	4,			// code - R1 (SPI) / 0 (SDIO).
+	TOKEN			=	5,			// Получен маркер начала данных, code - маркер.
+	DATA_START		=	6,			// len - секторов.
+	DATA_END		=	7,			// code - 0 / EC_SD_RES при ошибке.
+	BUSY_END		=	8,			// Карта закончила программирование.
+	DMA_DONE		=	9			// Прерывание окончания DMA (SDIO), code - EC_SD_RESULT.
+};
+
+enum class EC_MICROSD_TRACE_OP : uint8_t {
+	READ			=	0,
+	WRITE			=	1
+};
+
+// Флаг ACMD в поле code события CMD.
+#define MICROSD_TRACE_ACMD_FLAG				( 0x40 )
+
+struct MicrosdTraceEvent {
+	uint32_t					timeUs;
+	EC_MICROSD_TRACE_EVENT		type;
+	uint8_t						code;
+	uint16_t					len;
+	uint32_t					arg;
+};
+
+static_assert( sizeof( MicrosdTraceEvent ) == 12, "MicrosdTraceEvent layout" );
+
+/// Заголовок выгрузки, за ним - count событий в хронологическом порядке.
+/// Все поля little-endian (как в памяти Cortex-M).
+struct MicrosdTraceHeader {
+	uint32_t		magic;
+	uint16_t		version;
+	uint16_t		eventSize;
+	uint32_t		count;
+	uint32_t		lost;			// Сколько событий перезаписано до выгрузки.
+};
+
+static_assert( sizeof( MicrosdTraceHeader ) == 16, "MicrosdTraceHeader layout" );
+
+#ifdef MODULE_MICROSD_TRACE_ENABLED
+
+class MicrosdTrace {
+public:
+	/// buf - size событий, size должен быть степенью 2.
+	/// getTimeUs - источник времени в мкс (может переполняться).
+	MicrosdTrace ( MicrosdTraceEvent* const buf, uint32_t size, uint32_t ( *getTimeUs ) ( void ) );
+
+	void		record			( EC_MICROSD_TRACE_EVENT type, uint8_t code = 0, uint16_t len = 0, uint32_t arg = 0 );
+
+	/// Выгрузить заголовок и события через write (по одному вызову на заголовок и на событие).
+	/// Запись в буфер во время выгрузки не останавливается,
+	/// но самые старые события при этом могут оказаться уже перезаписанными.
+	void		dump			( void ( *write ) ( void* ctx, const void* data, uint32_t len ), void* ctx );
+
+	void		clear			( void );
+
+private:
+	MicrosdTraceEvent*		const buf;
+	const uint32_t			mask;
+	uint32_t				( * const getTimeUs ) ( void );
+	uint32_t				head;
+};
+
+// Записать событие, если трасса подключена.
+#define MICROSD_TRACE(trace,...)			do { if ( ( trace ) != nullptr ) ( trace )->record( __VA_ARGS__ ); } while ( 0 )
+
+#else
+
+#define MICROSD_TRACE(trace,...)			do {} while ( 0 )
+
+#endif
@@ -0,0 +1,69 @@
+#include "microsd_trace.h"
+
+#ifdef MODULE_MICROSD_TRACE_ENABLED
+
+#include <string.h>
+
+MicrosdTrace::MicrosdTrace ( MicrosdTraceEvent* const buf, uint32_t size, uint32_t ( *getTimeUs ) ( void ) ) :
+    buf( buf ), mask( size - 1 ), getTimeUs( getTimeUs ), head( 0 ) {
+    this->clear();
+}
+
+// Ячейка захватывается атомарным инкрементом head, поэтому одновременные
+// записи из задач и прерываний попадают в разные ячейки.
+void MicrosdTrace::record ( EC_MICROSD_TRACE_EVENT type, uint8_t code, uint16_t len, uint32_t arg ) {
+    uint32_t i = __atomic_fetch_add( &this->head, 1, __ATOMIC_RELAXED );
+    MicrosdTraceEvent* e = &this->buf[ i & this->mask ];
+
+    // Пока ячейка заполняется, она помечена пустой (см. dump).
+    __atomic_store_n( ( uint8_t* )&e->type, ( uint8_t )EC_MICROSD_TRACE_EVENT::EMPTY, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    e->timeUs	= this->getTimeUs();
+    e->code		= code;
+    e->len		= len;
+    e->arg		= arg;
+    __atomic_store_n( ( uint8_t* )&e->type, ( uint8_t )type, __ATOMIC_RELEASE );
+}
+
+void MicrosdTrace::dump ( void ( *write ) ( void* ctx, const void* data, uint32_t len ), void* ctx ) {
+    uint32_t end		= __atomic_load_n( &this->head, __ATOMIC_ACQUIRE );
+    uint32_t size		= this->mask + 1;
+    uint32_t count		= ( end < size ) ? end : size;
+
+    MicrosdTraceHeader h;
+    h.magic			= MICROSD_TRACE_MAGIC;
+    h.version		= MICROSD_TRACE_VERSION;
+    h.eventSize		= sizeof( MicrosdTraceEvent );
+    h.count			= count;
+    h.lost			= end - count;
+    write( ctx, &h, sizeof( h ) );
+
+    // Событие, которое во время копирования начали перезаписывать (type сменился
+    // или ячейку заняло событие следующего круга), отдается как EMPTY.
+    // Не ловится только запись той же ячейки с тем же type, целиком прошедшая
+    // за время копирования (писатель, вытесненный между захватом ячейки и пометкой EMPTY).
+    for ( uint32_t i = end - count; i != end; i++ ) {
+        MicrosdTraceEvent* p = &this->buf[ i & this->mask ];
+        MicrosdTraceEvent e;
+
+        uint8_t t1 = __atomic_load_n( ( uint8_t* )&p->type, __ATOMIC_ACQUIRE );
+        memcpy( &e, p, sizeof( e ) );
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        uint8_t t2 = __atomic_load_n( ( uint8_t* )&p->type, __ATOMIC_RELAXED );
+        uint32_t now = __atomic_load_n( &this->head, __ATOMIC_RELAXED );
+
+        if ( ( t1 != t2 ) || ( ( uint8_t )e.type != t1 ) || ( now - i > this->mask + 1 ) ) {
+            memset( &e, 0, sizeof( e ) );
+            e.type = EC_MICROSD_TRACE_EVENT::EMPTY;
+        }
+
+        write( ctx, &e, sizeof( e ) );
+    }
+}
+
+void MicrosdTrace::clear ( void ) {
+    memset( this->buf, 0, ( this->mask + 1 ) * sizeof( MicrosdTraceEvent ) );
+    __atomic_store_n( &this->head, 0, __ATOMIC_RELEASE );
+}
+
+#endif